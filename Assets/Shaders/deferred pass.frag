@@ -1,31 +1,77 @@
 #version 330 core
 layout(location = 0) out vec4 out_color;
 
-in vec2 f_texcoord;
 
 #define _PI_ 3.14159
 
-uniform vec3 uniform_camera_pos;
-uniform vec3 uniform_camera_dir;
+layout(std140) uniform FrameData
+{
+	mat4 uniform_view_matrix;
+	mat4 uniform_projection_matrix;
+	mat4 uniform_view_projection_matrix;
+	mat4 uniform_light_projection_view;
+	vec3 uniform_camera_pos;
+	float uniform_time;
+	vec3 uniform_camera_dir;
+	int uniform_cast_shadows;
+	vec3 uniform_light_pos;
+	float uniform_light_umbra;
+	vec3 uniform_light_dir;
+	float uniform_light_penumbra;
+	vec3 uniform_light_color;
+};
+
+// MAX_SPOT_LIGHTS, LIGHT_TILE_SIZE, LIGHT_SLICES and MAX_CLUSTER_LIGHTS are defined by the renderer,
+// LIGHT_STORAGE when the lights are in a storage buffer
+struct SpotLight
+{
+	mat4 projection_view;
+	// xyz position, w range
+	vec4 position_range;
+	// xyz direction, w cosine of half the umbra
+	vec4 direction_cos_umbra;
+	// rgb color, w cosine of half the penumbra
+	vec4 color_cos_penumbra;
+	// offset and scale of the shadow tile in the atlas, zero without a shadow
+	vec4 shadow_rect;
+};
+
+// spot lights of the map by decreasing priority, their shadows share one atlas
+#ifdef LIGHT_STORAGE
+layout(std430) readonly buffer LightData
+#else
+layout(std140) uniform LightData
+#endif
+{
+	int uniform_spot_light_count;
+	SpotLight uniform_spot_lights[MAX_SPOT_LIGHTS];
+};
 
-uniform sampler2D uniform_tex_pos;
+// the geometry pass writes normal and gloss, albedo and metallic, emission and reflectance
 uniform sampler2D uniform_tex_normal;
 uniform sampler2D uniform_tex_albedo;
 uniform sampler2D uniform_tex_mask;
 uniform sampler2D uniform_tex_depth;
+uniform mat4 uniform_inverse_view_projection;
 
-uniform vec3 uniform_light_color;
-uniform vec3 uniform_light_pos;
-uniform vec3 uniform_light_dir;
-
-uniform float uniform_light_umbra;
-uniform float uniform_light_penumbra;
-
-uniform mat4 uniform_light_projection_view;
-uniform int uniform_cast_shadows;
 float uniform_constant_bias;
 
 uniform sampler2D uniform_shadow_map;
+uniform sampler2D uniform_shadow_moments;
+uniform sampler2D uniform_shadow_atlas;
+// 0 compares the depth map, 1 reads the exponential variance moments
+uniform int uniform_shadow_filter;
+uniform float uniform_light_far;
+uniform float uniform_shadow_exponent;
+
+// the lights of each screen tile and depth slice, written by the light clusters pass,
+// without it every pixel goes through all the lights
+uniform int uniform_light_clusters;
+uniform usampler3D uniform_light_clusters_texture;
+uniform vec2 uniform_cluster_depth;
+
+// 0 the map lights over the whole screen, 1 the main light inside its volume, added on top
+uniform int uniform_light_pass;
 
 float compute_spotlight(const in vec3 pSurfToLight)
 {
@@ -111,11 +157,30 @@ float shadow_nearest(vec3 light_space_xyz)
 	return ((light_space_xyz.z - uniform_constant_bias) < shadow_map_z) ? 1.0 : 0.0;
 }
 
+float shadow_evsm(vec2 uv, float linear_depth)
+{
+	// the blur and the mipmaps did the filtering, one fetch covers the whole footprint
+	vec2 moments = texture(uniform_shadow_moments, uv).rg;
+	float warped = exp(uniform_shadow_exponent * linear_depth);
+	if (warped <= moments.x) return 1.0;
+
+	// the smallest variance stands in for the depth bias, scaled by the slope of the warp
+	float min_deviation = uniform_shadow_exponent * warped * 0.001;
+	float variance = max(moments.y - moments.x * moments.x, min_deviation * min_deviation);
+	float d = warped - moments.x;
+
+	// Chebyshev's upper bound, the low end is cut to hide light bleeding
+	float p_max = variance / (variance + d * d);
+	return clamp((p_max - 0.2) / 0.8, 0.0, 1.0);
+}
+
 // 1 sample per pixel
 float shadow(vec3 pwcs)
 {
 	// project the pwcs to the light source point of view
 	vec4 plcs = uniform_light_projection_view * vec4(pwcs, 1.0);
+	// distance along the light direction, before the division
+	float linear_depth = plcs.w / uniform_light_far;
 	// perspective division
 	plcs /= plcs.w;
 	// convert from [-1 1] to [0 1]
@@ -127,6 +192,8 @@ float shadow(vec3 pwcs)
 	if (plcs.x > 1.0) return 0.0;
 	if (plcs.y > 1.0) return 0.0;
 
+	if (uniform_shadow_filter == 1) return shadow_evsm(plcs.xy, linear_depth);
+
 	// set scale of light space z value to [0, 1]
 	plcs.z = 0.5 * plcs.z + 0.5;
 
@@ -136,6 +203,33 @@ float shadow(vec3 pwcs)
 	return shadow_pcf2x2_mean(plcs.xyz);
 }
 
+// 2x2 comparisons like shadow_pcf2x2_mean, clamped so the taps stay inside the tile of the light
+float shadow_atlas(const in SpotLight light, vec3 pwcs, float bias)
+{
+	// a point light has no tile, a spot light whose tile was never rendered casts no light yet
+	if (light.shadow_rect.z == 0.0) return 1.0;
+	if (light.shadow_rect.z < 0.0) return 0.0;
+
+	vec4 plcs = light.projection_view * vec4(pwcs, 1.0);
+	plcs.xyz /= plcs.w;
+	if (any(greaterThan(abs(plcs.xy), vec2(1.0)))) return 0.0;
+
+	vec2 texelSize = 1.0 / vec2(textureSize(uniform_shadow_atlas, 0));
+	vec2 uv = light.shadow_rect.xy + (plcs.xy * 0.5 + 0.5) * light.shadow_rect.zw;
+	vec2 uv_min = light.shadow_rect.xy + 0.5 * texelSize;
+	vec2 uv_max = light.shadow_rect.xy + light.shadow_rect.zw - 0.5 * texelSize;
+
+	float z = 0.5 * plcs.z + 0.5 - bias;
+
+	float factor = 0.0;
+	factor += (texture(uniform_shadow_atlas, clamp(uv + vec2(-1.0, -1.0) * texelSize, uv_min, uv_max)).r > z) ? 1.0 : 0.0;
+	factor += (texture(uniform_shadow_atlas, clamp(uv + vec2(0.0, -1.0) * texelSize, uv_min, uv_max)).r > z) ? 1.0 : 0.0;
+	factor += (texture(uniform_shadow_atlas, clamp(uv + vec2(-1.0, 0.0) * texelSize, uv_min, uv_max)).r > z) ? 1.0 : 0.0;
+	factor += (texture(uniform_shadow_atlas, clamp(uv, uv_min, uv_max)).r > z) ? 1.0 : 0.0;
+
+	return factor / 4.0;
+}
+
 vec3 blinn_phong(
 	const in vec3 pSurfToEye,
 	const in vec3 pSurfToLight,
@@ -204,7 +298,9 @@ vec3 cook_torrance(
 	const in vec3 pNormal,
 	const in vec3 pAlbedo,
 	const in vec4 pMask,
-	const in vec3 pEmission)
+	const in vec3 pEmission,
+	const in vec3 pLightPos,
+	const in vec3 pLightColor)
 {
 	vec3 halfVector = normalize(pSurfToEye + pSurfToLight);
 
@@ -224,52 +320,144 @@ vec3 cook_torrance(
 	float G = geometric(NdotH, NdotV, HdotV, NdotL);
 	vec3 ks = (F * G * D) / max((4.0 * NdotL * NdotV), 0.0001);
 	vec3 kd = (pAlbedo / _PI_) * (1.0 - F) * (1.0 - metallic);
-	float dist = distance(uniform_light_pos, pPos);
+	float dist = distance(pLightPos, pPos);
+
+	return (ks + kd) * (pLightColor / pow(dist, 2)) * NdotL + pEmission;
+}
 
-	return (ks + kd) * (uniform_light_color / pow(dist, 2)) * NdotL + pEmission;
+vec3 spot_light(const in SpotLight light, vec3 pos, vec3 normal, vec3 albedo, vec4 mask, vec3 surfToEye)
+{
+	// the cheap tests first, most lights miss most pixels
+	vec3 to_light = light.position_range.xyz - pos;
+	float dist = length(to_light);
+	if (dist > light.position_range.w) return vec3(0.0);
+
+	vec3 surfToLight = to_light / dist;
+	float cos_angle = dot(-surfToLight, light.direction_cos_umbra.xyz);
+	if (cos_angle < light.color_cos_penumbra.w) return vec3(0.0);
+
+	float spotEffect = (cos_angle >= light.direction_cos_umbra.w) ? 1.0 :
+		smoothstep(light.color_cos_penumbra.w, light.direction_cos_umbra.w, cos_angle);
+
+	// slope scaled, capped where the surface turns away from the light
+	float NdotL = clamp(dot(normal, surfToLight), 0.0, 1.0);
+	float bias = min(0.0005 * tan(acos(NdotL)), 0.005);
+	float shadow_value = shadow_atlas(light, pos, bias);
+	if (shadow_value == 0.0) return vec3(0.0);
+
+	// fades to nothing at the range instead of cutting off
+	float falloff = clamp(1.0 - pow(dist / light.position_range.w, 4.0), 0.0, 1.0);
+
+	return shadow_value * spotEffect * falloff * falloff *
+		cook_torrance(surfToEye, surfToLight, pos, normal, albedo, mask, vec3(0.0), light.position_range.xyz, light.color_cos_penumbra.rgb);
+}
+
+vec3 decode_normal(vec2 encoded)
+{
+	vec2 f = encoded * 2.0 - 1.0;
+	vec3 n = vec3(f, 1.0 - abs(f.x) - abs(f.y));
+	// unfold the lower hemisphere
+	float t = clamp(-n.z, 0.0, 1.0);
+	n.xy += vec2(n.x >= 0.0 ? -t : t, n.y >= 0.0 ? -t : t);
+	return normalize(n);
+}
+
+float decode_gloss(float encoded)
+{
+	return exp2(encoded * 10.0) - 1.0;
 }
 
 void main(void)
 {	
-    float d = texture(uniform_tex_depth, f_texcoord).r;
+	// the light volume has no texture coordinates of its own
+	vec2 texcoord = gl_FragCoord.xy / vec2(textureSize(uniform_tex_depth, 0));
+	float d = texture(uniform_tex_depth, texcoord).r;
 
 	if(d == 1.0) discard;
 
-	vec4 pos_wcs = texture(uniform_tex_pos, f_texcoord);
-	vec4 normal_wcs = texture(uniform_tex_normal, f_texcoord);
-	vec4 albedo = texture(uniform_tex_albedo, f_texcoord);
-	vec4 mask = texture(uniform_tex_mask, f_texcoord);
+	// back from the depth buffer to the world
+	vec4 pos_wcs = uniform_inverse_view_projection * vec4(vec3(texcoord, d) * 2.0 - 1.0, 1.0);
+	pos_wcs /= pos_wcs.w;
+
+	vec4 normal_gloss = texture(uniform_tex_normal, texcoord);
+	vec4 albedo_metallic = texture(uniform_tex_albedo, texcoord);
+	vec4 emission_reflectance = texture(uniform_tex_mask, texcoord);
+
+	vec3 normal_wcs = decode_normal(normal_gloss.xy);
+	vec3 albedo = albedo_metallic.rgb;
+	vec3 emission = emission_reflectance.rgb;
+	// metallic, ambient occlusion (not stored), reflectance, gloss
+	vec4 mask = vec4(albedo_metallic.a, 0.0, emission_reflectance.a, decode_gloss(normal_gloss.b));
 
 	vec3 surfToEye = normalize(uniform_camera_pos - pos_wcs.xyz);
-	vec3 surfToLight = normalize(uniform_light_pos - pos_wcs.xyz);
 
-	float cosTheta = clamp(dot(surfToEye, surfToLight), 0,1);
+	// the passes are blended together, each pixel is lit by the main light only where its volume covers it
+	vec3 color = vec3(0.0);
+	if (uniform_light_pass == 1)
+	{
+		vec3 surfToLight = normalize(uniform_light_pos - pos_wcs.xyz);
+
+		// only the depth comparisons need the slope bias
+		if (uniform_shadow_filter == 0)
+		{
+			float cosTheta = clamp(dot(surfToEye, surfToLight), 0,1);
 
-	uniform_constant_bias = 0.005*tan(acos(cosTheta));
+			uniform_constant_bias = 0.005*tan(acos(cosTheta));
+		}
 
-	// check if we have shadows
-	float shadow_value = (uniform_cast_shadows == 1) ? shadow(pos_wcs.xyz) : 1.0;
+		// check if we have shadows
+		float shadow_value = (uniform_cast_shadows == 1) ? shadow(pos_wcs.xyz) : 1.0;
 
 	
-	vec3 brdf = blinn_phong(surfToEye, surfToLight, pos_wcs.xyz,
-		normal_wcs.xyz,
-		albedo.xyz, mask,
-		vec3(pos_wcs.a, normal_wcs.a, albedo.a));
+		vec3 brdf = blinn_phong(surfToEye, surfToLight, pos_wcs.xyz,
+			normal_wcs,
+			albedo, mask,
+			emission);
 
-	vec3 c_t = cook_torrance(surfToEye, surfToLight, pos_wcs.xyz,
-		normal_wcs.xyz,
-		albedo.xyz, mask,
-		vec3(pos_wcs.a, normal_wcs.a, albedo.a));
+		vec3 c_t = cook_torrance(surfToEye, surfToLight, pos_wcs.xyz,
+			normal_wcs,
+			albedo, mask,
+			emission,
+			uniform_light_pos, uniform_light_color);
 
-	float spotEffect = compute_spotlight(surfToLight);
+		float spotEffect = compute_spotlight(surfToLight);
 
-	//out_color = vec4(shadow_value * brdf * spotEffect, 1.0);
+		//out_color = vec4(shadow_value * brdf * spotEffect, 1.0);
+
+		color = shadow_value * c_t * spotEffect;
+	}
+	else
+	{
+		if (uniform_light_clusters == 1)
+		{
+			// the same logarithmic slices as the binning
+			float view_depth = -(uniform_view_matrix * pos_wcs).z;
+			float ratio = uniform_cluster_depth.y / uniform_cluster_depth.x;
+			int slice = int(floor(log(view_depth / uniform_cluster_depth.x) / log(ratio) * LIGHT_SLICES));
+			slice = clamp(slice, 0, LIGHT_SLICES - 1);
+
+			ivec3 cluster = ivec3(ivec2(gl_FragCoord.xy) / LIGHT_TILE_SIZE, slice * (MAX_CLUSTER_LIGHTS + 1));
+			int count = int(texelFetch(uniform_light_clusters_texture, cluster, 0).r);
+			for (int i = 1; i <= count; i++)
+			{
+				int index = int(texelFetch(uniform_light_clusters_texture, cluster + ivec3(0, 0, i), 0).r);
+				color += spot_light(uniform_spot_lights[index], pos_wcs.xyz, normal_wcs, albedo, mask, surfToEye);
+			}
+		}
+		else
+		{
+			for (int i = 0; i < uniform_spot_light_count; i++)
+			{
+				color += spot_light(uniform_spot_lights[i], pos_wcs.xyz, normal_wcs, albedo, mask, surfToEye);
+			}
+		}
+	}
 
-	out_color = vec4(shadow_value * c_t * spotEffect, 1.0);
+	out_color = vec4(color, 1.0);
 
 	/*out_color = 0.8 * vec4(shadow_value * brdf * spotEffect, 1.0) +
 				0.2 * vec4(cook_torrance(surfToEye, surfToLight, pos_wcs.xyz,
-						normal_wcs.xyz,
-						albedo.xyz, mask,
-						vec3(pos_wcs.a, normal_wcs.a, albedo.a)), 1.0);*/
+						normal_wcs,
+						albedo, mask,
+						emission), 1.0);*/
 }
\ No newline at end of file
@@ -0,0 +1,6 @@
+#version 330 core
+
+// depth only, the color writes are masked
+void main(void)
+{
+}
\ No newline at end of file
@@ -0,0 +1,77 @@
+#version 430 core
+#extension GL_ARB_shader_draw_parameters : require
+layout(location = 0) in vec3 coord3d;
+layout(location = 1) in vec3 v_normal;
+layout(location = 2) in vec2 texcoord;
+layout(location = 3) in vec3 v_tangent;
+layout(location = 4) in vec3 v_bitangent;
+
+// the depth prepass runs the same code and the G-buffer pass tests its depth for equality
+invariant gl_Position;
+
+out vec2 f_texcoord;
+out vec3 f_position_wcs;
+out mat3 f_TBN;
+flat out uint f_material;
+
+layout(std140) uniform FrameData
+{
+	mat4 uniform_view_matrix;
+	mat4 uniform_projection_matrix;
+	mat4 uniform_view_projection_matrix;
+	mat4 uniform_light_projection_view;
+	vec3 uniform_camera_pos;
+	float uniform_time;
+	vec3 uniform_camera_dir;
+	int uniform_cast_shadows;
+	vec3 uniform_light_pos;
+	float uniform_light_umbra;
+	vec3 uniform_light_dir;
+	float uniform_light_penumbra;
+	vec3 uniform_light_color;
+};
+
+struct Item
+{
+	mat4 world_matrix;
+	mat4 normal_matrix;
+	vec3 bounds_min;
+	uint asset;
+	vec3 bounds_max;
+	uint flags;
+};
+
+layout(std430, binding = 0) readonly buffer CullItems
+{
+	Item items[];
+};
+
+layout(std430, binding = 1) readonly buffer DrawData
+{
+	uint draw_materials[];
+};
+
+// items that passed the culling, grouped by asset
+layout(std430, binding = 3) readonly buffer VisibleItems
+{
+	uint visible_items[];
+};
+
+// index of the first command of this glMultiDrawArraysIndirect call
+uniform int uniform_draw_offset;
+
+void main(void)
+{
+	Item instance = items[visible_items[gl_BaseInstanceARB + gl_InstanceID]];
+	f_material = draw_materials[uniform_draw_offset + gl_DrawIDARB];
+
+	f_TBN = mat3(
+		normalize(vec3(instance.normal_matrix * vec4(v_tangent, 0.0))),
+		normalize(vec3(instance.normal_matrix * vec4(v_bitangent, 0.0))),
+		normalize(vec3(instance.normal_matrix * vec4(v_normal, 0.0))));
+
+	f_texcoord = texcoord;
+	vec4 position_wcs = instance.world_matrix * vec4(coord3d, 1.0);
+	f_position_wcs = position_wcs.xyz;
+	gl_Position = uniform_view_projection_matrix * position_wcs;
+}
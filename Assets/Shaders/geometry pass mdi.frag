@@ -0,0 +1,84 @@
+#version 430 core
+// location 0 is the lit target, written by the deferred pass
+layout(location = 1) out vec4 out_normal;
+layout(location = 2) out vec4 out_albedo;
+layout(location = 3) out vec4 out_mask;
+
+in vec2 f_texcoord;
+in vec3 f_position_wcs;
+in mat3 f_TBN;
+flat in uint f_material;
+
+#define _PI_ 3.14159
+
+struct Material
+{
+	vec3 diffuse;
+	float shininess;
+	vec3 ambient;
+	int has_tex_diffuse;
+	vec3 specular;
+	int has_tex_mask;
+	int has_tex_normal;
+	int has_tex_emissive;
+	int is_tex_bumb;
+};
+
+layout(std430, binding = 2) readonly buffer MaterialData
+{
+	Material materials[];
+};
+
+uniform sampler2D uniform_tex_diffuse;
+uniform sampler2D uniform_tex_mask;
+uniform sampler2D uniform_tex_normal;
+uniform sampler2D uniform_tex_emissive;
+
+// octahedral mapping, the unit sphere folded onto the [0 1] square
+vec2 encode_normal(vec3 n)
+{
+	n /= abs(n.x) + abs(n.y) + abs(n.z);
+	vec2 folded = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+	return (n.z >= 0.0 ? n.xy : folded) * 0.5 + 0.5;
+}
+
+// the material shininess goes up to 1023, a log scale keeps the precision of the small texture values
+float encode_gloss(float gloss)
+{
+	return log2(clamp(gloss, 0.0, 1023.0) + 1.0) / 10.0;
+}
+
+void main(void)
+{
+	Material material = materials[f_material];
+	vec3 normal = f_TBN[2];
+
+	if(material.has_tex_normal == 1)
+	{
+		vec3 nmap = texture(uniform_tex_normal, f_texcoord).rgb;
+		nmap = nmap * 2.0 - 1.0;
+		normal = normalize(f_TBN * nmap);
+	}
+
+	vec3 albedo = material.has_tex_diffuse == 1 ?
+		texture(uniform_tex_diffuse, f_texcoord).rgb : material.diffuse;
+
+	vec3 emission = material.has_tex_emissive == 1 ?
+		texture(uniform_tex_emissive, f_texcoord).rgb : material.ambient;
+
+	float reflectance = (material.specular.x + material.specular.y + material.specular.z) / 3;
+	float gloss = material.shininess;
+	float metallic = 0.0;
+
+	if(material.has_tex_mask == 1)
+	{
+		vec4 mask = texture(uniform_tex_mask, f_texcoord);
+		metallic = mask.r;
+		reflectance = mask.b;
+		gloss = 1.0 - mask.a;
+	}
+
+	out_normal = vec4(encode_normal(normalize(normal)), encode_gloss(gloss), 0.0);
+	out_albedo = vec4(albedo, metallic);
+	out_mask = vec4(emission, reflectance);
+}
\ No newline at end of file
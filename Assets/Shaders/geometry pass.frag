@@ -1,63 +1,96 @@
 #version 330 core
-layout(location = 0) out vec4 out_pos;
+// location 0 is the lit target, written by the deferred pass
 layout(location = 1) out vec4 out_normal;
 layout(location = 2) out vec4 out_albedo;
 layout(location = 3) out vec4 out_mask;
 
-in vec2 f_texcoord;
-in vec3 f_position_wcs;
-in mat3 f_TBN;
+// straight from the vertex shader, or through the geometry shader of the variant that hides a triangle
+in GeometryData
+{
+	vec2 texcoord;
+	vec3 position_wcs;
+	mat3 TBN;
+} f_in;
 
 #define _PI_ 3.14159
 
-uniform vec3 uniform_diffuse;
-uniform vec3 uniform_specular;
-uniform vec3 uniform_ambient;
-uniform float uniform_shininess;
+layout(std140) uniform MaterialData
+{
+	vec3 uniform_diffuse;
+	float uniform_shininess;
+	vec3 uniform_ambient;
+	int uniform_has_tex_diffuse;
+	vec3 uniform_specular;
+	int uniform_has_tex_mask;
+	int uniform_has_tex_normal;
+	int uniform_has_tex_emissive;
+	int uniform_is_tex_bumb;
+};
 
-uniform int uniform_has_tex_diffuse;
-uniform int uniform_has_tex_mask;
-uniform int uniform_has_tex_normal;
-uniform int uniform_has_tex_emissive;
+// the renderer compiles one variant per combination of textures, with each feature defined as true or false,
+// so the branches and the fetches of missing textures fold away, without the defines the material block decides
+#ifndef HAS_TEX_DIFFUSE
+#define HAS_TEX_DIFFUSE (uniform_has_tex_diffuse == 1)
+#endif
+#ifndef HAS_TEX_MASK
+#define HAS_TEX_MASK (uniform_has_tex_mask == 1)
+#endif
+#ifndef HAS_TEX_NORMAL
+#define HAS_TEX_NORMAL (uniform_has_tex_normal == 1)
+#endif
+#ifndef HAS_TEX_EMISSIVE
+#define HAS_TEX_EMISSIVE (uniform_has_tex_emissive == 1)
+#endif
 
 uniform sampler2D uniform_tex_diffuse;
 uniform sampler2D uniform_tex_mask;
 uniform sampler2D uniform_tex_normal;
 uniform sampler2D uniform_tex_emissive;
 
+// octahedral mapping, the unit sphere folded onto the [0 1] square
+vec2 encode_normal(vec3 n)
+{
+	n /= abs(n.x) + abs(n.y) + abs(n.z);
+	vec2 folded = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+	return (n.z >= 0.0 ? n.xy : folded) * 0.5 + 0.5;
+}
+
+// the material shininess goes up to 1023, a log scale keeps the precision of the small texture values
+float encode_gloss(float gloss)
+{
+	return log2(clamp(gloss, 0.0, 1023.0) + 1.0) / 10.0;
+}
+
 void main(void)
 {
-	vec3 normal = f_TBN[2];
+	vec3 normal = f_in.TBN[2];
 
-	if(uniform_has_tex_normal == 1)
+	if (HAS_TEX_NORMAL)
 	{
-		vec3 nmap = texture(uniform_tex_normal, f_texcoord).rgb;
+		vec3 nmap = texture(uniform_tex_normal, f_in.texcoord).rgb;
 		nmap = nmap * 2.0 - 1.0;
-		normal = normalize(f_TBN * nmap);
+		normal = normalize(f_in.TBN * nmap);
 	}
 
-	vec3 albedo = uniform_has_tex_diffuse == 1 ?
-		texture(uniform_tex_diffuse, f_texcoord).rgb : uniform_diffuse;
+	vec3 albedo = HAS_TEX_DIFFUSE ?
+		texture(uniform_tex_diffuse, f_in.texcoord).rgb : uniform_diffuse;
 
-	vec3 emission = uniform_has_tex_emissive == 1 ?
-		texture(uniform_tex_emissive, f_texcoord).rgb : uniform_ambient;
+	vec3 emission = HAS_TEX_EMISSIVE ?
+		texture(uniform_tex_emissive, f_in.texcoord).rgb : uniform_ambient;
 
 	float reflectance = (uniform_specular.x + uniform_specular.y + uniform_specular.z) / 3;
 	float gloss = uniform_shininess;
 	float metallic = 0.0;
-	float ao = 0.0;
 
-	if(uniform_has_tex_mask == 1)
+	if (HAS_TEX_MASK)
 	{
-		vec4 mask = texture(uniform_tex_mask, f_texcoord);
+		vec4 mask = texture(uniform_tex_mask, f_in.texcoord);
 		metallic = mask.r;
-		ao = mask.g;
 		reflectance = mask.b;
 		gloss = 1.0 - mask.a;
 	}
 
-	out_pos = vec4(f_position_wcs, emission.x);
-	out_normal = vec4(normal, emission.y);
-	out_albedo = vec4(albedo, emission.z);
-	out_mask = vec4(metallic, ao, reflectance, gloss);
+	out_normal = vec4(encode_normal(normalize(normal)), encode_gloss(gloss), 0.0);
+	out_albedo = vec4(albedo, metallic);
+	out_mask = vec4(emission, reflectance);
 }
\ No newline at end of file
@@ -4,23 +4,51 @@ layout(location = 1) in vec3 v_normal;
 layout(location = 2) in vec2 texcoord;
 layout(location = 3) in vec3 v_tangent;
 layout(location = 4) in vec3 v_bitangent;
+layout(location = 5) in mat4 instance_world_matrix;
+layout(location = 9) in mat4 instance_normal_matrix;
 
-out vec2 v_texcoord;
-out vec3 v_position_wcs;
-out mat3 v_TBN;
+// the depth prepass runs the same code and the G-buffer pass tests its depth for equality
+invariant gl_Position;
 
-uniform mat4 uniform_projection_matrix;
-uniform mat4 uniform_normal_matrix;
-uniform mat4 uniform_world_matrix;
+out GeometryData
+{
+	vec2 texcoord;
+	vec3 position_wcs;
+	mat3 TBN;
+} v_out;
+
+layout(std140) uniform FrameData
+{
+	mat4 uniform_view_matrix;
+	mat4 uniform_projection_matrix;
+	mat4 uniform_view_projection_matrix;
+	mat4 uniform_light_projection_view;
+	vec3 uniform_camera_pos;
+	float uniform_time;
+	vec3 uniform_camera_dir;
+	int uniform_cast_shadows;
+	vec3 uniform_light_pos;
+	float uniform_light_umbra;
+	vec3 uniform_light_dir;
+	float uniform_light_penumbra;
+	vec3 uniform_light_color;
+};
+
+// the triangle of the mesh pool with this index collapses to a point, the pool holds triangle lists
+uniform int uniform_prim_id;
 
 void main(void)
 {
-	v_TBN = mat3(
-		normalize(vec3(uniform_normal_matrix * vec4(v_tangent, 0.0))),
-		normalize(vec3(uniform_normal_matrix * vec4(v_bitangent, 0.0))),
-		normalize(vec3(uniform_normal_matrix * vec4(v_normal, 0.0))));
+	v_out.TBN = mat3(
+		normalize(vec3(instance_normal_matrix * vec4(v_tangent, 0.0))),
+		normalize(vec3(instance_normal_matrix * vec4(v_bitangent, 0.0))),
+		normalize(vec3(instance_normal_matrix * vec4(v_normal, 0.0))));
+
+	v_out.texcoord = texcoord;
+	vec4 position_wcs = instance_world_matrix * vec4(coord3d, 1.0);
+	v_out.position_wcs = position_wcs.xyz;
+	gl_Position = uniform_view_projection_matrix * position_wcs;
 
-	v_texcoord = texcoord;
-	v_position_wcs = vec3(uniform_world_matrix * vec4(coord3d, 1.0));
-	gl_Position = uniform_projection_matrix * vec4(coord3d, 1.0);
+	// all three corners at the same place, the rasterizer drops the triangle
+	if (gl_VertexID / 3 == uniform_prim_id) gl_Position = vec4(0.0);
 }
@@ -0,0 +1,10 @@
+#version 330 core
+layout(location = 0) in vec3 coord3d;
+
+// identity for the full screen quad, the light clip space to the camera clip space for the light volume
+uniform mat4 uniform_light_volume;
+
+void main(void)
+{
+	gl_Position = uniform_light_volume * vec4(coord3d, 1.0);
+}
\ No newline at end of file
@@ -0,0 +1,6 @@
+#version 330 core
+
+// only the depth test of the box matters, color writes are masked off
+void main(void)
+{
+}
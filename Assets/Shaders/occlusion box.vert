@@ -0,0 +1,27 @@
+#version 330 core
+layout(location = 0) in vec3 coord3d;
+
+layout(std140) uniform FrameData
+{
+	mat4 uniform_view_matrix;
+	mat4 uniform_projection_matrix;
+	mat4 uniform_view_projection_matrix;
+	mat4 uniform_light_projection_view;
+	vec3 uniform_camera_pos;
+	float uniform_time;
+	vec3 uniform_camera_dir;
+	int uniform_cast_shadows;
+	vec3 uniform_light_pos;
+	float uniform_light_umbra;
+	vec3 uniform_light_dir;
+	float uniform_light_penumbra;
+	vec3 uniform_light_color;
+};
+
+uniform vec3 uniform_box_center;
+uniform vec3 uniform_box_extent;
+
+void main(void)
+{
+	gl_Position = uniform_view_projection_matrix * vec4(uniform_box_center + coord3d * uniform_box_extent, 1.0);
+}
@@ -6,7 +6,6 @@ in vec2 f_texcoord;
 uniform sampler2D uniform_texture;
 uniform sampler2D uniform_shadow_map;
 
-uniform sampler2D uniform_tex_pos;
 uniform sampler2D uniform_tex_normal;
 uniform sampler2D uniform_tex_albedo;
 uniform sampler2D uniform_tex_mask;
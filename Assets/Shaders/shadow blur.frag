@@ -0,0 +1,22 @@
+#version 330 core
+layout(location = 0) out vec2 out_moments;
+
+uniform sampler2D uniform_source;
+
+// binomial weights, about as wide as the horizontal blur at this resolution
+const float weights[5] = float[5](1.0, 4.0, 6.0, 4.0, 1.0);
+
+void main(void)
+{
+	ivec2 size = textureSize(uniform_source, 0);
+	ivec2 base = ivec2(gl_FragCoord.xy);
+
+	vec2 moments = vec2(0.0);
+	for (int i = 0; i < 5; i++)
+	{
+		ivec2 texel = clamp(base + ivec2(0, i - 2), ivec2(0), size - 1);
+		moments += weights[i] * texelFetch(uniform_source, texel, 0).rg;
+	}
+
+	out_moments = moments / 16.0;
+}
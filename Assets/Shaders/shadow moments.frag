@@ -0,0 +1,39 @@
+#version 330 core
+layout(location = 0) out vec2 out_moments;
+
+uniform sampler2D uniform_shadow_map;
+uniform float uniform_light_near;
+uniform float uniform_light_far;
+uniform float uniform_shadow_exponent;
+
+// binomial weights of 8 depth texels, centered between the two under this texel
+const float weights[8] = float[8](1.0, 7.0, 21.0, 35.0, 35.0, 21.0, 7.0, 1.0);
+
+// distance along the light direction over the far plane, the lighting compares the same
+float linear_depth(float depth)
+{
+	float z_ndc = 2.0 * depth - 1.0;
+	float distance = 2.0 * uniform_light_near * uniform_light_far /
+		(uniform_light_far + uniform_light_near - z_ndc * (uniform_light_far - uniform_light_near));
+	return distance / uniform_light_far;
+}
+
+void main(void)
+{
+	// every texel covers 2x2 depth texels, the rows are averaged and the columns blurred
+	ivec2 size = textureSize(uniform_shadow_map, 0);
+	ivec2 base = ivec2(gl_FragCoord.xy) * 2;
+
+	vec2 moments = vec2(0.0);
+	for (int row = 0; row < 2; row++)
+	{
+		for (int column = 0; column < 8; column++)
+		{
+			ivec2 texel = clamp(base + ivec2(column - 3, row), ivec2(0), size - 1);
+			float warped = exp(uniform_shadow_exponent * linear_depth(texelFetch(uniform_shadow_map, texel, 0).r));
+			moments += weights[column] * vec2(warped, warped * warped);
+		}
+	}
+
+	out_moments = moments / 256.0;
+}
@@ -0,0 +1,47 @@
+#version 430 core
+#extension GL_ARB_shader_draw_parameters : require
+layout(location = 0) in vec3 coord3d;
+
+layout(std140) uniform FrameData
+{
+	mat4 uniform_view_matrix;
+	mat4 uniform_projection_matrix;
+	mat4 uniform_view_projection_matrix;
+	mat4 uniform_light_projection_view;
+	vec3 uniform_camera_pos;
+	float uniform_time;
+	vec3 uniform_camera_dir;
+	int uniform_cast_shadows;
+	vec3 uniform_light_pos;
+	float uniform_light_umbra;
+	vec3 uniform_light_dir;
+	float uniform_light_penumbra;
+	vec3 uniform_light_color;
+};
+
+struct Item
+{
+	mat4 world_matrix;
+	mat4 normal_matrix;
+	vec3 bounds_min;
+	uint asset;
+	vec3 bounds_max;
+	uint flags;
+};
+
+layout(std430, binding = 0) readonly buffer CullItems
+{
+	Item items[];
+};
+
+// items that passed the culling, grouped by asset
+layout(std430, binding = 3) readonly buffer VisibleItems
+{
+	uint visible_items[];
+};
+
+void main(void) 
+{
+	mat4 world_matrix = items[visible_items[gl_BaseInstanceARB + gl_InstanceID]].world_matrix;
+	gl_Position = uniform_light_projection_view * world_matrix * vec4(coord3d, 1.0);
+}
@@ -1,9 +1,25 @@
 #version 330 core
 layout(location = 0) in vec3 coord3d;
+layout(location = 5) in mat4 instance_world_matrix;
 
-uniform mat4 uniform_projection_matrix;
+layout(std140) uniform FrameData
+{
+	mat4 uniform_view_matrix;
+	mat4 uniform_projection_matrix;
+	mat4 uniform_view_projection_matrix;
+	mat4 uniform_light_projection_view;
+	vec3 uniform_camera_pos;
+	float uniform_time;
+	vec3 uniform_camera_dir;
+	int uniform_cast_shadows;
+	vec3 uniform_light_pos;
+	float uniform_light_umbra;
+	vec3 uniform_light_dir;
+	float uniform_light_penumbra;
+	vec3 uniform_light_color;
+};
 
 void main(void) 
 {
-	gl_Position = uniform_projection_matrix * vec4(coord3d, 1.0);
+	gl_Position = uniform_light_projection_view * instance_world_matrix * vec4(coord3d, 1.0);
 }
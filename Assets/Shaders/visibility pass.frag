@@ -0,0 +1,10 @@
+#version 430 core
+layout(location = 0) out uint out_id;
+
+flat in uint f_item;
+flat in uint f_triangle;
+
+void main(void)
+{
+	out_id = (f_item << 16) | f_triangle;
+}
\ No newline at end of file
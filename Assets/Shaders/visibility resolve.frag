@@ -0,0 +1,192 @@
+#version 430 core
+// location 0 is the lit target, written by the deferred pass
+layout(location = 1) out vec4 out_normal;
+layout(location = 2) out vec4 out_albedo;
+layout(location = 3) out vec4 out_mask;
+
+in vec2 f_texcoord;
+
+layout(std140) uniform FrameData
+{
+	mat4 uniform_view_matrix;
+	mat4 uniform_projection_matrix;
+	mat4 uniform_view_projection_matrix;
+	mat4 uniform_light_projection_view;
+	vec3 uniform_camera_pos;
+	float uniform_time;
+	vec3 uniform_camera_dir;
+	int uniform_cast_shadows;
+	vec3 uniform_light_pos;
+	float uniform_light_umbra;
+	vec3 uniform_light_dir;
+	float uniform_light_penumbra;
+	vec3 uniform_light_color;
+};
+
+struct Item
+{
+	mat4 world_matrix;
+	mat4 normal_matrix;
+	vec3 bounds_min;
+	uint asset;
+	vec3 bounds_max;
+	uint flags;
+};
+
+layout(std430, binding = 0) readonly buffer CullItems
+{
+	Item items[];
+};
+
+// material in the low 16 bits, texture set in the high ones
+layout(std430, binding = 1) readonly buffer TriangleData
+{
+	uint triangle_materials[];
+};
+
+struct Material
+{
+	vec3 diffuse;
+	float shininess;
+	vec3 ambient;
+	int has_tex_diffuse;
+	vec3 specular;
+	int has_tex_mask;
+	int has_tex_normal;
+	int has_tex_emissive;
+	int is_tex_bumb;
+};
+
+layout(std430, binding = 2) readonly buffer MaterialData
+{
+	Material materials[];
+};
+
+// the vertex streams of the mesh pool, tightly packed
+layout(std430, binding = 3) readonly buffer Positions { float positions[]; };
+layout(std430, binding = 4) readonly buffer Normals { float normals[]; };
+layout(std430, binding = 5) readonly buffer Texcoords { float texcoords[]; };
+layout(std430, binding = 6) readonly buffer Tangents { float tangents[]; };
+layout(std430, binding = 7) readonly buffer Bitangents { float bitangents[]; };
+
+// item in the high 16 bits, pool triangle in the low ones, all ones where nothing was drawn
+uniform usampler2D uniform_visibility;
+// this pass writes only the pixels of this texture set
+uniform int uniform_texture_set;
+
+uniform sampler2D uniform_tex_diffuse;
+uniform sampler2D uniform_tex_mask;
+uniform sampler2D uniform_tex_normal;
+uniform sampler2D uniform_tex_emissive;
+
+// perspective correct barycentrics of a point given in normalized device coordinates,
+// outside the triangle they extrapolate along its plane
+vec3 barycentrics(vec2 p, vec2 a, vec2 b, vec2 c, vec3 inv_w)
+{
+	vec2 e0 = b - a;
+	vec2 e1 = c - a;
+	vec2 e2 = p - a;
+	float inv_den = 1.0 / (e0.x * e1.y - e1.x * e0.y);
+	float s1 = (e2.x * e1.y - e1.x * e2.y) * inv_den;
+	float s2 = (e0.x * e2.y - e2.x * e0.y) * inv_den;
+	vec3 weights = vec3(1.0 - s1 - s2, s1, s2) * inv_w;
+	return weights / (weights.x + weights.y + weights.z);
+}
+
+vec3 interpolate(const in vec3 v[3], vec3 b)
+{
+	return v[0] * b.x + v[1] * b.y + v[2] * b.z;
+}
+
+// octahedral mapping, the unit sphere folded onto the [0 1] square
+vec2 encode_normal(vec3 n)
+{
+	n /= abs(n.x) + abs(n.y) + abs(n.z);
+	vec2 folded = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+	return (n.z >= 0.0 ? n.xy : folded) * 0.5 + 0.5;
+}
+
+// the material shininess goes up to 1023, a log scale keeps the precision of the small texture values
+float encode_gloss(float gloss)
+{
+	return log2(clamp(gloss, 0.0, 1023.0) + 1.0) / 10.0;
+}
+
+void main(void)
+{
+	uint id = texelFetch(uniform_visibility, ivec2(gl_FragCoord.xy), 0).r;
+	if (id == 0xFFFFFFFFu) discard;
+
+	uint triangle = id & 0xFFFFu;
+	uint triangle_material = triangle_materials[triangle];
+	if (int(triangle_material >> 16) != uniform_texture_set) discard;
+
+	Item item = items[id >> 16];
+	Material material = materials[triangle_material & 0xFFFFu];
+
+	// the three vertices again, as the vertex shader of the G-buffer path transforms them
+	vec2 ndc[3];
+	vec3 inv_w;
+	vec2 uv[3];
+	vec3 T[3];
+	vec3 B[3];
+	vec3 N[3];
+	for (int i = 0; i < 3; i++)
+	{
+		uint v = triangle * 3u + uint(i);
+		vec3 position = vec3(positions[v * 3u], positions[v * 3u + 1u], positions[v * 3u + 2u]);
+		vec4 clip = uniform_view_projection_matrix * (item.world_matrix * vec4(position, 1.0));
+		inv_w[i] = 1.0 / clip.w;
+		ndc[i] = clip.xy * inv_w[i];
+
+		uv[i] = vec2(texcoords[v * 2u], texcoords[v * 2u + 1u]);
+		T[i] = normalize(vec3(item.normal_matrix * vec4(tangents[v * 3u], tangents[v * 3u + 1u], tangents[v * 3u + 2u], 0.0)));
+		B[i] = normalize(vec3(item.normal_matrix * vec4(bitangents[v * 3u], bitangents[v * 3u + 1u], bitangents[v * 3u + 2u], 0.0)));
+		N[i] = normalize(vec3(item.normal_matrix * vec4(normals[v * 3u], normals[v * 3u + 1u], normals[v * 3u + 2u], 0.0)));
+	}
+
+	// the neighbouring pixels give the derivatives the hardware would have taken
+	vec2 pixel = 2.0 / vec2(textureSize(uniform_visibility, 0));
+	vec2 p = gl_FragCoord.xy * pixel - 1.0;
+	vec3 b = barycentrics(p, ndc[0], ndc[1], ndc[2], inv_w);
+	vec3 b_dx = barycentrics(p + vec2(pixel.x, 0.0), ndc[0], ndc[1], ndc[2], inv_w);
+	vec3 b_dy = barycentrics(p + vec2(0.0, pixel.y), ndc[0], ndc[1], ndc[2], inv_w);
+
+	vec2 texcoord = uv[0] * b.x + uv[1] * b.y + uv[2] * b.z;
+	vec2 texcoord_dx = uv[0] * b_dx.x + uv[1] * b_dx.y + uv[2] * b_dx.z - texcoord;
+	vec2 texcoord_dy = uv[0] * b_dy.x + uv[1] * b_dy.y + uv[2] * b_dy.z - texcoord;
+
+	mat3 TBN = mat3(interpolate(T, b), interpolate(B, b), interpolate(N, b));
+
+	// from here on the same as the geometry pass
+	vec3 normal = TBN[2];
+
+	if(material.has_tex_normal == 1)
+	{
+		vec3 nmap = textureGrad(uniform_tex_normal, texcoord, texcoord_dx, texcoord_dy).rgb;
+		nmap = nmap * 2.0 - 1.0;
+		normal = normalize(TBN * nmap);
+	}
+
+	vec3 albedo = material.has_tex_diffuse == 1 ?
+		textureGrad(uniform_tex_diffuse, texcoord, texcoord_dx, texcoord_dy).rgb : material.diffuse;
+
+	vec3 emission = material.has_tex_emissive == 1 ?
+		textureGrad(uniform_tex_emissive, texcoord, texcoord_dx, texcoord_dy).rgb : material.ambient;
+
+	float reflectance = (material.specular.x + material.specular.y + material.specular.z) / 3;
+	float gloss = material.shininess;
+	float metallic = 0.0;
+
+	if(material.has_tex_mask == 1)
+	{
+		vec4 mask = textureGrad(uniform_tex_mask, texcoord, texcoord_dx, texcoord_dy);
+		metallic = mask.r;
+		reflectance = mask.b;
+		gloss = 1.0 - mask.a;
+	}
+
+	out_normal = vec4(encode_normal(normalize(normal)), encode_gloss(gloss), 0.0);
+	out_albedo = vec4(albedo, metallic);
+	out_mask = vec4(emission, reflectance);
+}
\ No newline at end of file
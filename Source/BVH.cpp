@@ -0,0 +1,234 @@
+#include "BVH.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+// items per leaf, small enough that a partially visible leaf is cheap to test
+static const uint32_t MAX_LEAF_ITEMS = 4;
+
+BVH::BVH()
+{
+}
+
+void BVH::Build(const std::vector<glm::vec3>& centers, const std::vector<glm::vec3>& extents)
+{
+	size_t count = centers.size();
+
+	m_tree.clear();
+	m_items.resize(count);
+	m_item_leaf.assign(count, -1);
+	m_item_min.resize(count);
+	m_item_max.resize(count);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		m_items[i] = static_cast<uint32_t>(i);
+		m_item_min[i] = centers[i] - extents[i];
+		m_item_max[i] = centers[i] + extents[i];
+	}
+
+	if (count == 0) return;
+
+	m_tree.reserve(2 * count);
+	Node root;
+	root.left = -1;
+	root.parent = -1;
+	root.first_item = 0;
+	root.item_count = static_cast<uint32_t>(count);
+	m_tree.push_back(root);
+
+	Subdivide(0);
+}
+
+void BVH::Subdivide(int32_t index)
+{
+	FitNode(m_tree[index]);
+
+	uint32_t first = m_tree[index].first_item;
+	uint32_t count = m_tree[index].item_count;
+
+	if (count <= MAX_LEAF_ITEMS)
+	{
+		for (uint32_t i = first; i < first + count; i++) m_item_leaf[m_items[i]] = index;
+		return;
+	}
+
+	// split at the median of the centroids along their widest axis
+	glm::vec3 centroid_min = glm::vec3(std::numeric_limits<float>::max());
+	glm::vec3 centroid_max = glm::vec3(-std::numeric_limits<float>::max());
+	for (uint32_t i = first; i < first + count; i++)
+	{
+		glm::vec3 centroid = (m_item_min[m_items[i]] + m_item_max[m_items[i]]) * 0.5f;
+		centroid_min = glm::min(centroid_min, centroid);
+		centroid_max = glm::max(centroid_max, centroid);
+	}
+
+	glm::vec3 size = centroid_max - centroid_min;
+	int axis = (size.x > size.y && size.x > size.z) ? 0 : (size.y > size.z ? 1 : 2);
+
+	uint32_t half = count / 2;
+	std::nth_element(m_items.begin() + first, m_items.begin() + first + half, m_items.begin() + first + count,
+		[&](uint32_t a, uint32_t b) { return m_item_min[a][axis] + m_item_max[a][axis] < m_item_min[b][axis] + m_item_max[b][axis]; });
+
+	int32_t left = static_cast<int32_t>(m_tree.size());
+
+	Node child;
+	child.left = -1;
+	child.parent = index;
+	child.first_item = first;
+	child.item_count = half;
+	m_tree.push_back(child);
+
+	child.first_item = first + half;
+	child.item_count = count - half;
+	m_tree.push_back(child);
+
+	m_tree[index].left = left;
+
+	Subdivide(left);
+	Subdivide(left + 1);
+}
+
+void BVH::FitNode(Node& node)
+{
+	if (node.left >= 0)
+	{
+		node.min = glm::min(m_tree[node.left].min, m_tree[node.left + 1].min);
+		node.max = glm::max(m_tree[node.left].max, m_tree[node.left + 1].max);
+		return;
+	}
+
+	node.min = glm::vec3(std::numeric_limits<float>::max());
+	node.max = glm::vec3(-std::numeric_limits<float>::max());
+	for (uint32_t i = node.first_item; i < node.first_item + node.item_count; i++)
+	{
+		node.min = glm::min(node.min, m_item_min[m_items[i]]);
+		node.max = glm::max(node.max, m_item_max[m_items[i]]);
+	}
+}
+
+void BVH::Refit(uint32_t item, const glm::vec3& center, const glm::vec3& extent)
+{
+	m_item_min[item] = center - extent;
+	m_item_max[item] = center + extent;
+
+	// the leaf is fitted to its items, every node above it to its two children
+	for (int32_t index = m_item_leaf[item]; index >= 0; index = m_tree[index].parent)
+	{
+		FitNode(m_tree[index]);
+	}
+}
+
+void BVH::QueryFrustum(const glm::vec4* planes, std::vector<uint32_t>& items) const
+{
+	items.clear();
+	if (m_tree.empty()) return;
+
+	// every entry carries the planes its parent was not already fully inside of
+	m_stack.clear();
+	m_stack.push_back(std::make_pair(0, 0x3Fu));
+
+	while (!m_stack.empty())
+	{
+		const Node& node = m_tree[m_stack.back().first];
+		uint32_t mask = m_stack.back().second;
+		m_stack.pop_back();
+
+		glm::vec3 center = (node.min + node.max) * 0.5f;
+		glm::vec3 extent = (node.max - node.min) * 0.5f;
+
+		bool outside = false;
+		for (int p = 0; p < 6 && !outside; p++)
+		{
+			if (!(mask & (1u << p))) continue;
+
+			glm::vec3 normal = glm::vec3(planes[p]);
+			float distance = glm::dot(normal, center) + planes[p].w;
+			float radius = glm::dot(glm::abs(normal), extent);
+
+			if (distance + radius < 0.f) outside = true;
+			else if (distance - radius >= 0.f) mask &= ~(1u << p);
+		}
+		if (outside) continue;
+
+		if (mask == 0)
+		{
+			// inside all planes, the whole subtree is visible without further tests
+			items.insert(items.end(), m_items.begin() + node.first_item, m_items.begin() + node.first_item + node.item_count);
+		}
+		else if (node.left < 0)
+		{
+			for (uint32_t i = node.first_item; i < node.first_item + node.item_count; i++)
+			{
+				uint32_t item = m_items[i];
+				glm::vec3 item_center = (m_item_min[item] + m_item_max[item]) * 0.5f;
+				glm::vec3 item_extent = (m_item_max[item] - m_item_min[item]) * 0.5f;
+
+				bool visible = true;
+				for (int p = 0; p < 6 && visible; p++)
+				{
+					if (!(mask & (1u << p))) continue;
+
+					glm::vec3 normal = glm::vec3(planes[p]);
+					visible = glm::dot(normal, item_center) + planes[p].w + glm::dot(glm::abs(normal), item_extent) >= 0.f;
+				}
+				if (visible) items.push_back(item);
+			}
+		}
+		else
+		{
+			m_stack.push_back(std::make_pair(node.left, mask));
+			m_stack.push_back(std::make_pair(node.left + 1, mask));
+		}
+	}
+}
+
+void BVH::QuerySphere(const glm::vec3& center, float radius, std::vector<uint32_t>& items) const
+{
+	items.clear();
+	if (m_tree.empty()) return;
+
+	float radius2 = radius * radius;
+	auto touches = [&](const glm::vec3& min, const glm::vec3& max)
+	{
+		glm::vec3 closest = glm::clamp(center, min, max);
+		glm::vec3 d = closest - center;
+		return glm::dot(d, d) <= radius2;
+	};
+
+	m_stack.clear();
+	m_stack.push_back(std::make_pair(0, 0u));
+
+	while (!m_stack.empty())
+	{
+		const Node& node = m_tree[m_stack.back().first];
+		m_stack.pop_back();
+
+		if (!touches(node.min, node.max)) continue;
+
+		if (node.left < 0)
+		{
+			for (uint32_t i = node.first_item; i < node.first_item + node.item_count; i++)
+			{
+				uint32_t item = m_items[i];
+				if (touches(m_item_min[item], m_item_max[item])) items.push_back(item);
+			}
+		}
+		else
+		{
+			m_stack.push_back(std::make_pair(node.left, 0u));
+			m_stack.push_back(std::make_pair(node.left + 1, 0u));
+		}
+	}
+}
+
+void BVH::GetItemBounds(uint32_t item, glm::vec3& min, glm::vec3& max) const
+{
+	min = m_item_min[item];
+	max = m_item_max[item];
+}
+
+size_t BVH::GetItemCount() const
+{
+	return m_items.size();
+}
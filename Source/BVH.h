@@ -0,0 +1,53 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <vector>
+#include <cstdint>
+#include <utility>
+#include "glm\glm.hpp"
+
+// Bounding volume hierarchy over world space boxes given as center/extent.
+// Built top down by splitting at the median centroid of the widest axis,
+// moved items are refit in place by walking from their leaf up to the root.
+class BVH
+{
+	struct Node
+	{
+		glm::vec3 min;
+		glm::vec3 max;
+		// first child, the second one follows it, -1 for leaves
+		int32_t left;
+		int32_t parent;
+		// items of the whole subtree are contiguous in m_items
+		uint32_t first_item;
+		uint32_t item_count;
+	};
+
+	std::vector<Node> m_tree;
+	// item ids in tree order
+	std::vector<uint32_t> m_items;
+	// leaf of every item and its box, indexed by item id
+	std::vector<int32_t> m_item_leaf;
+	std::vector<glm::vec3> m_item_min;
+	std::vector<glm::vec3> m_item_max;
+	mutable std::vector<std::pair<int32_t, uint32_t>> m_stack;
+
+	void Subdivide(int32_t index);
+	void FitNode(Node& node);
+
+public:
+	BVH();
+
+	void Build(const std::vector<glm::vec3>& centers, const std::vector<glm::vec3>& extents);
+	void Refit(uint32_t item, const glm::vec3& center, const glm::vec3& extent);
+
+	// items whose box touches the frustum, planes as extracted by FrustumCuller
+	void QueryFrustum(const glm::vec4* planes, std::vector<uint32_t>& items) const;
+	// items whose box is closer than radius to the point
+	void QuerySphere(const glm::vec3& center, float radius, std::vector<uint32_t>& items) const;
+
+	void GetItemBounds(uint32_t item, glm::vec3& min, glm::vec3& max) const;
+	size_t GetItemCount() const;
+};
+
+#endif
@@ -9,7 +9,7 @@ CollidableNode::CollidableNode(void) :
 
 CollidableNode::~CollidableNode(void){}
 
-void CollidableNode::Init(class GeometricMesh* mesh)
+void CollidableNode::Init(class GeometricMesh* mesh, class MeshPool& pool)
 {
     this->triangles.resize(mesh->vertices.size() / 3);
 
@@ -20,7 +20,25 @@ void CollidableNode::Init(class GeometricMesh* mesh)
         this->triangles[t].v2 = mesh->vertices[t * 3 + 2];
     }
 
-    super::Init(mesh);
+    super::Init(mesh, pool);
+}
+
+void CollidableNode::Share(const GeometryNode& source)
+{
+    this->triangles = static_cast<const CollidableNode&>(source).triangles;
+
+    super::Share(source);
+}
+
+const glm::vec3* CollidableNode::GetTriangleVertices() const
+{
+    static_assert(sizeof(triangle) == 3 * sizeof(glm::vec3), "triangles must be tightly packed vertices");
+    return triangles.empty() ? nullptr : &triangles[0].v0;
+}
+
+size_t CollidableNode::GetTriangleCount() const
+{
+    return triangles.size();
 }
 
 bool CollidableNode::intersectRay(
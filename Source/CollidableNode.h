@@ -14,12 +14,17 @@ public:
     CollidableNode& operator=(const CollidableNode&) = default;
     CollidableNode& operator=(CollidableNode&&) = default;
 
-    void Init(GeometricMesh* mesh) override;
+    void Init(GeometricMesh* mesh, MeshPool& pool) override;
+    void Share(const GeometryNode& source) override;
     std::vector<float> calculateCameraCollision(const glm::vec3& pOrigin, const glm::vec3& pDir, const glm::mat4& pWorldMatrix, 
                                                 float& pIsectDist, int32_t& pPrimID, float pTmax = 1.e+15f, float pTmin = 0.f);
     bool intersectRay(const glm::vec3& pOrigin, const glm::vec3& pDir, const glm::mat4& pWorldMatrix, 
                       float& pIsectDist, int32_t& pPrimID, float pTmax = 1.e+15f, float pTmin = 0.f, float angleX = 0.f, float angleY = 0.f);
 
+    // object space triangle list, three consecutive vertices per triangle
+    const glm::vec3* GetTriangleVertices() const;
+    size_t GetTriangleCount() const;
+
 protected:
 
     // Empty
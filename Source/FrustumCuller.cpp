@@ -0,0 +1,336 @@
+#include "FrustumCuller.h"
+#include "BVH.h"
+#include "glm/gtc/matrix_transform.hpp"
+#include <cstdio>
+#include <cmath>
+#include <chrono>
+#include <random>
+#include <algorithm>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define FRUSTUM_CULLER_AVX
+#elif defined(_M_X64) || defined(_M_IX86) || defined(__SSE__)
+#include <xmmintrin.h>
+#define FRUSTUM_CULLER_SSE
+#endif
+
+FrustumCuller::FrustumCuller()
+{
+	for (int i = 0; i < 6; i++) m_planes[i] = glm::vec4(0.f);
+	m_count = 0;
+}
+
+void FrustumCuller::Resize(size_t count)
+{
+	m_count = count;
+	size_t padded = (count + 7) & ~size_t(7);
+
+	m_center_x.resize(padded, 0.f);
+	m_center_y.resize(padded, 0.f);
+	m_center_z.resize(padded, 0.f);
+	m_extent_x.resize(padded, 0.f);
+	m_extent_y.resize(padded, 0.f);
+	m_extent_z.resize(padded, 0.f);
+}
+
+size_t FrustumCuller::GetCount() const
+{
+	return m_count;
+}
+
+void FrustumCuller::SetBounds(size_t i, const glm::vec3& min, const glm::vec3& max, const glm::mat4& transform)
+{
+	glm::vec3 center, extent;
+	TransformBox(min, max, transform, center, extent);
+	SetBox(i, center, extent);
+}
+
+void FrustumCuller::TransformBox(const glm::vec3& min, const glm::vec3& max, const glm::mat4& transform, glm::vec3& center, glm::vec3& extent)
+{
+	glm::vec3 local_center = (min + max) * 0.5f;
+	glm::vec3 local_extent = (max - min) * 0.5f;
+
+	// the center goes through the matrix, the extent through the absolute value of its linear part
+	center = glm::vec3(transform * glm::vec4(local_center, 1.f));
+	extent =
+		glm::abs(glm::vec3(transform[0])) * local_extent.x +
+		glm::abs(glm::vec3(transform[1])) * local_extent.y +
+		glm::abs(glm::vec3(transform[2])) * local_extent.z;
+}
+
+void FrustumCuller::SetBox(size_t i, const glm::vec3& center, const glm::vec3& extent)
+{
+	m_center_x[i] = center.x;
+	m_center_y[i] = center.y;
+	m_center_z[i] = center.z;
+	m_extent_x[i] = extent.x;
+	m_extent_y[i] = extent.y;
+	m_extent_z[i] = extent.z;
+}
+
+void FrustumCuller::ExtractPlanes(const glm::mat4& view_projection)
+{
+	for (int i = 0; i < 4; i++)
+	{
+		m_planes[0][i] = view_projection[i][3] + view_projection[i][0]; // left plane
+		m_planes[1][i] = view_projection[i][3] - view_projection[i][0]; // right plane
+		m_planes[2][i] = view_projection[i][3] + view_projection[i][1]; // bottom plane
+		m_planes[3][i] = view_projection[i][3] - view_projection[i][1]; // top plane
+		m_planes[4][i] = view_projection[i][3] + view_projection[i][2]; // near plane
+		m_planes[5][i] = view_projection[i][3] - view_projection[i][2]; // far plane
+	}
+
+	for (int i = 0; i < 6; i++)
+	{
+		m_planes[i] /= glm::length(glm::vec3(m_planes[i]));
+	}
+}
+
+const glm::vec4* FrustumCuller::GetPlanes() const
+{
+	return m_planes;
+}
+
+void FrustumCuller::GetCorners(const glm::mat4& view_projection, glm::vec3 corners[8])
+{
+	glm::mat4 inverse = glm::inverse(view_projection);
+	for (int i = 0; i < 8; i++)
+	{
+		glm::vec4 corner = inverse * glm::vec4((i & 1) ? 1.f : -1.f, (i & 2) ? 1.f : -1.f, (i & 4) ? 1.f : -1.f, 1.f);
+		corners[i] = glm::vec3(corner) / corner.w;
+	}
+}
+
+void FrustumCuller::ClipHexahedron(const glm::vec3 corners[8], const glm::vec4* planes, int plane_count, std::vector<glm::vec3>& points)
+{
+	// corners of every face in winding order
+	static const int faces[6][4] = {
+		{ 0, 2, 6, 4 }, { 1, 3, 7, 5 },
+		{ 0, 1, 5, 4 }, { 2, 3, 7, 6 },
+		{ 0, 1, 3, 2 }, { 4, 5, 7, 6 },
+	};
+
+	std::vector<glm::vec3> polygon, clipped;
+	for (auto& face : faces)
+	{
+		polygon.assign({ corners[face[0]], corners[face[1]], corners[face[2]], corners[face[3]] });
+
+		// Sutherland-Hodgman, one plane at a time
+		for (int p = 0; p < plane_count && !polygon.empty(); p++)
+		{
+			const glm::vec4& plane = planes[p];
+			clipped.clear();
+			for (size_t i = 0; i < polygon.size(); i++)
+			{
+				const glm::vec3& a = polygon[i];
+				const glm::vec3& b = polygon[(i + 1) % polygon.size()];
+				float distance_a = glm::dot(glm::vec3(plane), a) + plane.w;
+				float distance_b = glm::dot(glm::vec3(plane), b) + plane.w;
+
+				if (distance_a >= 0.f) clipped.push_back(a);
+				if ((distance_a >= 0.f) != (distance_b >= 0.f))
+				{
+					clipped.push_back(a + (b - a) * (distance_a / (distance_a - distance_b)));
+				}
+			}
+			polygon.swap(clipped);
+		}
+
+		points.insert(points.end(), polygon.begin(), polygon.end());
+	}
+}
+
+bool FrustumCuller::IntersectsBox(const glm::vec4* planes, const glm::vec3& center, const glm::vec3& extent)
+{
+	for (int p = 0; p < 6; p++)
+	{
+		float distance = glm::dot(glm::vec3(planes[p]), center) + planes[p].w;
+		float radius = glm::dot(glm::abs(glm::vec3(planes[p])), extent);
+		if (distance + radius < 0.f) return false;
+	}
+	return true;
+}
+
+bool FrustumCuller::ConeIntersectsBox(const Cone& cone, const glm::vec3& center, const glm::vec3& extent)
+{
+	float radius = glm::length(extent);
+	glm::vec3 to_center = center - cone.apex;
+	float along = glm::dot(to_center, cone.direction);
+	float across = std::sqrt(std::max(glm::dot(to_center, to_center) - along * along, 0.f));
+
+	// distance from the sphere center to the cone surface, negative inside
+	float distance = std::cos(cone.angle) * across - std::sin(cone.angle) * along;
+
+	return distance <= radius && along >= -radius && along <= cone.range + radius;
+}
+
+void FrustumCuller::CullScalar(std::vector<uint32_t>& visible) const
+{
+	visible.clear();
+
+	for (size_t i = 0; i < m_count; i++)
+	{
+		bool inside = true;
+		for (int p = 0; p < 6 && inside; p++)
+		{
+			const glm::vec4& plane = m_planes[p];
+			float distance = plane.x * m_center_x[i] + plane.y * m_center_y[i] + plane.z * m_center_z[i] + plane.w;
+			float radius = std::fabs(plane.x) * m_extent_x[i] + std::fabs(plane.y) * m_extent_y[i] + std::fabs(plane.z) * m_extent_z[i];
+			inside = distance + radius >= 0.f;
+		}
+		if (inside) visible.push_back(static_cast<uint32_t>(i));
+	}
+}
+
+void FrustumCuller::Cull(std::vector<uint32_t>& visible) const
+{
+#if defined(FRUSTUM_CULLER_AVX)
+	visible.clear();
+
+	__m256 n[6][3], a[6][3], w[6];
+	for (int p = 0; p < 6; p++)
+	{
+		for (int c = 0; c < 3; c++)
+		{
+			n[p][c] = _mm256_set1_ps(m_planes[p][c]);
+			a[p][c] = _mm256_set1_ps(std::fabs(m_planes[p][c]));
+		}
+		w[p] = _mm256_set1_ps(m_planes[p].w);
+	}
+	const __m256 zero = _mm256_setzero_ps();
+
+	for (size_t i = 0; i < m_count; i += 8)
+	{
+		__m256 cx = _mm256_loadu_ps(&m_center_x[i]);
+		__m256 cy = _mm256_loadu_ps(&m_center_y[i]);
+		__m256 cz = _mm256_loadu_ps(&m_center_z[i]);
+		__m256 ex = _mm256_loadu_ps(&m_extent_x[i]);
+		__m256 ey = _mm256_loadu_ps(&m_extent_y[i]);
+		__m256 ez = _mm256_loadu_ps(&m_extent_z[i]);
+
+		__m256 outside = zero;
+		for (int p = 0; p < 6; p++)
+		{
+			__m256 distance = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(n[p][0], cx), _mm256_mul_ps(n[p][1], cy)),
+				_mm256_add_ps(_mm256_mul_ps(n[p][2], cz), w[p]));
+			__m256 radius = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(a[p][0], ex), _mm256_mul_ps(a[p][1], ey)),
+				_mm256_mul_ps(a[p][2], ez));
+			outside = _mm256_or_ps(outside, _mm256_cmp_ps(_mm256_add_ps(distance, radius), zero, _CMP_LT_OQ));
+		}
+
+		// padding lanes past m_count are dropped here
+		unsigned int mask = ~static_cast<unsigned int>(_mm256_movemask_ps(outside)) & 0xFFu;
+		if (m_count - i < 8) mask &= (1u << (m_count - i)) - 1u;
+
+		for (uint32_t lane = 0; mask; lane++, mask >>= 1)
+		{
+			if (mask & 1u) visible.push_back(static_cast<uint32_t>(i) + lane);
+		}
+	}
+#elif defined(FRUSTUM_CULLER_SSE)
+	visible.clear();
+
+	__m128 n[6][3], a[6][3], w[6];
+	for (int p = 0; p < 6; p++)
+	{
+		for (int c = 0; c < 3; c++)
+		{
+			n[p][c] = _mm_set1_ps(m_planes[p][c]);
+			a[p][c] = _mm_set1_ps(std::fabs(m_planes[p][c]));
+		}
+		w[p] = _mm_set1_ps(m_planes[p].w);
+	}
+	const __m128 zero = _mm_setzero_ps();
+
+	for (size_t i = 0; i < m_count; i += 4)
+	{
+		__m128 cx = _mm_loadu_ps(&m_center_x[i]);
+		__m128 cy = _mm_loadu_ps(&m_center_y[i]);
+		__m128 cz = _mm_loadu_ps(&m_center_z[i]);
+		__m128 ex = _mm_loadu_ps(&m_extent_x[i]);
+		__m128 ey = _mm_loadu_ps(&m_extent_y[i]);
+		__m128 ez = _mm_loadu_ps(&m_extent_z[i]);
+
+		__m128 outside = zero;
+		for (int p = 0; p < 6; p++)
+		{
+			__m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(n[p][0], cx), _mm_mul_ps(n[p][1], cy)),
+				_mm_add_ps(_mm_mul_ps(n[p][2], cz), w[p]));
+			__m128 radius = _mm_add_ps(_mm_add_ps(_mm_mul_ps(a[p][0], ex), _mm_mul_ps(a[p][1], ey)),
+				_mm_mul_ps(a[p][2], ez));
+			outside = _mm_or_ps(outside, _mm_cmplt_ps(_mm_add_ps(distance, radius), zero));
+		}
+
+		// padding lanes past m_count are dropped here
+		unsigned int mask = ~static_cast<unsigned int>(_mm_movemask_ps(outside)) & 0xFu;
+		if (m_count - i < 4) mask &= (1u << (m_count - i)) - 1u;
+
+		for (uint32_t lane = 0; mask; lane++, mask >>= 1)
+		{
+			if (mask & 1u) visible.push_back(static_cast<uint32_t>(i) + lane);
+		}
+	}
+#else
+	CullScalar(visible);
+#endif
+}
+
+void FrustumCuller::Benchmark(size_t count, int iterations)
+{
+	FrustumCuller culler;
+	culler.Resize(count);
+
+	// boxes scattered around a camera at the origin looking down -z, about a quarter of them visible
+	std::mt19937 generator(1234);
+	std::uniform_real_distribution<float> position(-150.f, 150.f);
+	std::uniform_real_distribution<float> size(0.5f, 10.f);
+	std::vector<glm::vec3> centers(count), extents(count);
+	for (size_t i = 0; i < count; i++)
+	{
+		centers[i] = glm::vec3(position(generator), position(generator) * 0.1f, position(generator));
+		extents[i] = glm::vec3(size(generator));
+		culler.SetBox(i, centers[i], extents[i]);
+	}
+
+	BVH bvh;
+	bvh.Build(centers, extents);
+
+	glm::mat4 projection = glm::perspective(glm::radians(90.f), 16.f / 9.f, 0.1f, 150.f);
+	culler.ExtractPlanes(projection);
+
+	std::vector<uint32_t> reference, visible;
+	reference.reserve(count);
+	visible.reserve(count);
+
+	auto start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < iterations; i++) culler.CullScalar(reference);
+	auto middle = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < iterations; i++) culler.Cull(visible);
+	auto simd_end = std::chrono::high_resolution_clock::now();
+	std::vector<uint32_t> hierarchy;
+	hierarchy.reserve(count);
+	for (int i = 0; i < iterations; i++) bvh.QueryFrustum(culler.GetPlanes(), hierarchy);
+	auto end = std::chrono::high_resolution_clock::now();
+
+	double scalar_us = std::chrono::duration<double, std::micro>(middle - start).count() / iterations;
+	double simd_us = std::chrono::duration<double, std::micro>(simd_end - middle).count() / iterations;
+	double bvh_us = std::chrono::duration<double, std::micro>(end - simd_end).count() / iterations;
+
+#if defined(FRUSTUM_CULLER_AVX)
+	const char* path = "avx";
+#elif defined(FRUSTUM_CULLER_SSE)
+	const char* path = "sse";
+#else
+	const char* path = "scalar";
+#endif
+
+	printf("frustum culling benchmark: %u boxes, %u visible\n", static_cast<unsigned int>(count), static_cast<unsigned int>(visible.size()));
+	printf("  scalar: %.2f us\n", scalar_us);
+	printf("  %s: %.2f us (%.1fx)\n", path, simd_us, scalar_us / simd_us);
+	printf("  bvh: %.2f us (%.1fx)\n", bvh_us, scalar_us / bvh_us);
+	if (visible != reference) printf("  error: %s and scalar results differ\n", path);
+
+	std::sort(hierarchy.begin(), hierarchy.end());
+	if (hierarchy != reference) printf("  error: bvh and scalar results differ\n");
+}
@@ -0,0 +1,67 @@
+#ifndef FRUSTUM_CULLER_H
+#define FRUSTUM_CULLER_H
+
+#include <vector>
+#include <cstdint>
+#include "glm\glm.hpp"
+
+// World space bounding boxes of all culled nodes, kept as center/extent arrays
+// (structure of arrays) so the visibility test runs on 4 boxes at a time with SSE,
+// or 8 with AVX, against planes extracted once per frame.
+class FrustumCuller
+{
+public:
+	// cone of a spot light, angle is half the aperture in radians
+	struct Cone
+	{
+		glm::vec3 apex;
+		glm::vec3 direction;
+		float angle;
+		float range;
+	};
+
+private:
+	// left, right, bottom, top, near, far, normalized, inside is positive
+	glm::vec4 m_planes[6];
+
+	// padded to a multiple of 8 so the SIMD loops never read past the end
+	std::vector<float> m_center_x, m_center_y, m_center_z;
+	std::vector<float> m_extent_x, m_extent_y, m_extent_z;
+	size_t m_count;
+
+public:
+	FrustumCuller();
+
+	void Resize(size_t count);
+	size_t GetCount() const;
+
+	// bounds of box i from an object space box and its object to world transform
+	void SetBounds(size_t i, const glm::vec3& min, const glm::vec3& max, const glm::mat4& transform);
+	void SetBox(size_t i, const glm::vec3& center, const glm::vec3& extent);
+	// world space center and extent of an object space box
+	static void TransformBox(const glm::vec3& min, const glm::vec3& max, const glm::mat4& transform, glm::vec3& center, glm::vec3& extent);
+
+	void ExtractPlanes(const glm::mat4& view_projection);
+	const glm::vec4* GetPlanes() const;
+
+	// world space corners of the frustum of a matrix, indexed like box corners (bit 0 x, bit 1 y, bit 2 z)
+	static void GetCorners(const glm::mat4& view_projection, glm::vec3 corners[8]);
+	// clips the faces of a convex hexahedron given by its corners against the planes and appends
+	// the vertices left, together with the inside corners of the clip volume they are the vertices of the intersection
+	static void ClipHexahedron(const glm::vec3 corners[8], const glm::vec4* planes, int plane_count, std::vector<glm::vec3>& points);
+
+	// true unless the box is fully outside one of the six planes
+	static bool IntersectsBox(const glm::vec4* planes, const glm::vec3& center, const glm::vec3& extent);
+	// conservative test of the sphere around a box against a cone
+	static bool ConeIntersectsBox(const Cone& cone, const glm::vec3& center, const glm::vec3& extent);
+
+	// indices of the boxes touching the frustum, in increasing order
+	void Cull(std::vector<uint32_t>& visible) const;
+	// one box per iteration, reference for the SIMD path
+	void CullScalar(std::vector<uint32_t>& visible) const;
+
+	// times both paths and a BVH traversal over count random boxes and prints the results
+	static void Benchmark(size_t count, int iterations = 200);
+};
+
+#endif
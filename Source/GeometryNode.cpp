@@ -2,132 +2,31 @@
 #include "GeometricMesh.h"
 #include <glm/gtc/type_ptr.hpp>
 #include "TextureManager.h"
+#include "MeshPool.h"
 
 GeometryNode::GeometryNode()
 {
-	m_vao = 0;
-	m_vbo_positions = 0;
-	m_vbo_normals = 0;
-	m_vbo_texcoords = 0;
-	m_vbo_tangents = 0;
-	m_vbo_bitangents = 0;
+	m_first_vertex = 0;
+	m_vertex_count = 0;
+	m_bounds_dirty = true;
 }
 
 GeometryNode::~GeometryNode()
 {
-	// delete buffers
-	glDeleteVertexArrays(1, &m_vao);
-	glDeleteBuffers(1, &m_vbo_positions);
-	glDeleteBuffers(1, &m_vbo_normals);
-	glDeleteBuffers(1, &m_vbo_tangents);
-	glDeleteBuffers(1, &m_vbo_bitangents);
-	glDeleteBuffers(1, &m_vbo_texcoords);
 }
 
-void GeometryNode::Init(GeometricMesh* mesh)
+void GeometryNode::Init(GeometricMesh* mesh, MeshPool& pool)
 {
-	glGenVertexArrays(1, &m_vao);
-	glBindVertexArray(m_vao);
-
-	glGenBuffers(1, &m_vbo_positions);
-	glBindBuffer(GL_ARRAY_BUFFER, m_vbo_positions);
-	glBufferData(GL_ARRAY_BUFFER, mesh->vertices.size() * sizeof(glm::vec3), &mesh->vertices[0], GL_STATIC_DRAW);
-
-	glEnableVertexAttribArray(0);
-	glVertexAttribPointer(
-		0,				// attribute index
-		3,              // number of elements per vertex, here (x,y,z)
-		GL_FLOAT,       // the type of each element
-		GL_FALSE,       // take our values as-is
-		0,		         // no extra data between each position
-		0				// pointer to the C array or an offset to our buffer
-	);
-
-	glGenBuffers(1, &m_vbo_normals);
-	glBindBuffer(GL_ARRAY_BUFFER, m_vbo_normals);
-	glBufferData(GL_ARRAY_BUFFER, mesh->normals.size() * sizeof(glm::vec3), &mesh->normals[0], GL_STATIC_DRAW);
-
-	glEnableVertexAttribArray(1);
-	glVertexAttribPointer(
-		1,				// attribute index
-		3,              // number of elements per vertex, here (x,y,z)
-		GL_FLOAT,		// the type of each element
-		GL_FALSE,       // take our values as-is
-		0,		         // no extra data between each position
-		0				// pointer to the C array or an offset to our buffer
-	);
-
-	if (!mesh->textureCoord.empty())
-	{
-		glGenBuffers(1, &m_vbo_texcoords);
-		glBindBuffer(GL_ARRAY_BUFFER, m_vbo_texcoords);
-		glBufferData(GL_ARRAY_BUFFER, mesh->textureCoord.size() * sizeof(glm::vec2), &mesh->textureCoord[0], GL_STATIC_DRAW);
-
-		glEnableVertexAttribArray(2);
-		glVertexAttribPointer(
-			2,				// attribute index
-			2,              // number of elements per vertex, here (x,y,z)
-			GL_FLOAT,		// the type of each element
-			GL_FALSE,       // take our values as-is
-			0,		         // no extra data between each position
-			0				// pointer to the C array or an offset to our buffer
-		);
-	}
-
-	if (!mesh->tangents.empty())
-	{
-		glGenBuffers(1, &m_vbo_tangents);
-		glBindBuffer(GL_ARRAY_BUFFER, m_vbo_tangents);
-		glBufferData(GL_ARRAY_BUFFER, mesh->tangents.size() * sizeof(glm::vec3), &mesh->tangents[0], GL_STATIC_DRAW);
-
-		glEnableVertexAttribArray(3);
-		glVertexAttribPointer(
-			3,				// attribute index
-			3,              // number of elements per vertex, here (x,y,z)
-			GL_FLOAT,		// the type of each element
-			GL_FALSE,       // take our values as-is
-			0,		         // no extra data between each position
-			0				// pointer to the C array or an offset to our buffer
-		);
-
-		glGenBuffers(1, &m_vbo_tangents);
-		glBindBuffer(GL_ARRAY_BUFFER, m_vbo_tangents);
-		glBufferData(GL_ARRAY_BUFFER, mesh->tangents.size() * sizeof(glm::vec3), &mesh->tangents[0], GL_STATIC_DRAW);
-
-		glEnableVertexAttribArray(3);
-		glVertexAttribPointer(
-			3,				// attribute index
-			3,              // number of elements per vertex, here (x,y,z)
-			GL_FLOAT,		// the type of each element
-			GL_FALSE,       // take our values as-is
-			0,		         // no extra data between each position
-			0				// pointer to the C array or an offset to our buffer
-		);
-
-		glGenBuffers(1, &m_vbo_bitangents);
-		glBindBuffer(GL_ARRAY_BUFFER, m_vbo_bitangents);
-		glBufferData(GL_ARRAY_BUFFER, mesh->bitangents.size() * sizeof(glm::vec3), &mesh->bitangents[0], GL_STATIC_DRAW);
-
-		glEnableVertexAttribArray(4);
-		glVertexAttribPointer(
-			4,				// attribute index
-			3,              // number of elements per vertex, here (x,y,z)
-			GL_FLOAT,		// the type of each element
-			GL_FALSE,       // take our values as-is
-			0,		         // no extra data between each position
-			0				// pointer to the C array or an offset to our buffer
-		);
-	}
-
-	glBindVertexArray(0);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	// the vertices live in the shared pool, the parts address it directly
+	m_first_vertex = pool.Append(mesh);
+	m_vertex_count = static_cast<GLsizei>(mesh->vertices.size());
 
 	// *********************************************************************
 
 	for (int i = 0; i < mesh->objects.size(); i++)
 	{
 		Objects part;
-		part.start_offset = mesh->objects[i].start;
+		part.start_offset = m_first_vertex + mesh->objects[i].start;
 		part.count = mesh->objects[i].end - mesh->objects[i].start;
 		auto material = mesh->materials[mesh->objects[i].material_id];
 
@@ -141,6 +40,8 @@ void GeometryNode::Init(GeometricMesh* mesh)
 		part.emissive_textureID = (material.textureAmbient.empty()) ? 0 : TextureManager::GetInstance().RequestTexture(material.textureAmbient.c_str());
 		part.normal_textureID = (material.textureNormal.empty()) ? 0 : TextureManager::GetInstance().RequestTexture(material.textureNormal.c_str());
 		part.bump_textureID = (material.textureBump.empty()) ? 0 : TextureManager::GetInstance().RequestTexture(material.textureBump.c_str());
+		part.material_id = 0;
+		part.texture_set_id = 0;
 
 		parts.push_back(part);
 	}
@@ -157,11 +58,25 @@ void GeometryNode::Init(GeometricMesh* mesh)
 	this->m_aabb.center = (this->m_aabb.min + this->m_aabb.max) * 0.5f;
 }
 
+void GeometryNode::Share(const GeometryNode& source)
+{
+	m_first_vertex = source.m_first_vertex;
+	m_vertex_count = source.m_vertex_count;
+
+	parts = source.parts;
+
+	// the source may already be placed, so only its object space bounds are valid
+	this->m_aabb.min = source.m_aabb.min;
+	this->m_aabb.max = source.m_aabb.max;
+	this->m_aabb.center = (this->m_aabb.min + this->m_aabb.max) * 0.5f;
+}
+
 glm::mat4 GeometryNode::Scale(glm::vec3 s, bool flag)
 {
 	model_matrix = glm::scale(glm::mat4(1.f), s);
 	if (flag) m_aabb.center = glm::vec3(model_matrix * glm::vec4(m_aabb.center, 1.f));
 	SetScale(s);
+	m_bounds_dirty = true;
 	return model_matrix;
 }
 
@@ -170,6 +85,7 @@ glm::mat4 GeometryNode::Move(glm::vec3 p, bool flag)
 	model_matrix = glm::translate(glm::mat4(1.f), p);
 	if (flag) m_aabb.center = glm::vec3(model_matrix * glm::vec4(m_aabb.center, 1.f));
 	SetPosition(p);
+	m_bounds_dirty = true;
 	return model_matrix;
 }
 
@@ -189,6 +105,7 @@ glm::mat4 GeometryNode::Rotate(glm::vec3 r, bool flag)
 	if (flag) m_aabb.center = glm::vec3(model_matrix * glm::vec4(m_aabb.center, 1.f));
 
 	SetRotation(r);
+	m_bounds_dirty = true;
 
 	return model_matrix;
 }
@@ -197,6 +114,7 @@ void GeometryNode::Place(glm::vec3 m, glm::vec3 r, glm::vec3 s)
 {
 	model_matrix = Move(m) * Rotate(r) * Scale(s);
 	m_aabb.center = glm::vec3(model_matrix * glm::vec4(m_aabb.center, 1.f));
+	m_bounds_dirty = true;
 }
 
 void GeometryNode::ExtractMinMaxFromAABB(GeometryNode& node)
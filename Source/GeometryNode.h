@@ -19,7 +19,9 @@ public:
 	GeometryNode();
 	virtual ~GeometryNode();
 
-	virtual void Init(class GeometricMesh* mesh);
+	virtual void Init(class GeometricMesh* mesh, class MeshPool& pool);
+	// reuse the vertices and materials of an already initialized node of the same asset
+	virtual void Share(const GeometryNode& source);
 
 	int GetType()
 	{
@@ -91,6 +93,10 @@ public:
 		GLuint bump_textureID;
 		GLuint emissive_textureID;
 		GLuint mask_textureID;
+
+		// indices into the renderer material and texture set tables
+		int material_id;
+		int texture_set_id;
 	};
 
 	struct aabb
@@ -109,12 +115,12 @@ public:
 	glm::mat4 app_model_matrix;
 	aabb m_aabb;
 
-	GLuint m_vao;
-	GLuint m_vbo_positions;
-	GLuint m_vbo_normals;
-	GLuint m_vbo_tangents;
-	GLuint m_vbo_bitangents;
-	GLuint m_vbo_texcoords;
+	// set whenever the model matrix changes, cleared once the renderer refits its bounds
+	bool m_bounds_dirty;
+
+	// vertex range of the mesh inside the shared MeshPool
+	GLint m_first_vertex;
+	GLsizei m_vertex_count;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,264 @@
+#include "GpuCuller.h"
+#include "ShaderUniforms.h"
+#include "glm/gtc/type_ptr.hpp"
+#include <algorithm>
+#include <cstdio>
+
+static_assert(sizeof(GpuCuller::Item) == 160, "the item must match its std430 layout");
+
+GpuCuller::GpuCuller()
+{
+	for (auto& view : m_views)
+	{
+		view.commands = 0;
+		view.command_assets = 0;
+		view.visible = 0;
+		view.counters = 0;
+		view.command_count = 0;
+	}
+	m_items = 0;
+	m_asset_ranges = 0;
+	m_item_count = 0;
+	m_node_count = 0;
+	m_depth_pyramid = 0;
+	m_pyramid_width = 0;
+	m_pyramid_height = 0;
+	m_pyramid_levels = 0;
+	m_pyramid_valid = false;
+}
+
+GpuCuller::~GpuCuller()
+{
+	for (auto& view : m_views)
+	{
+		glDeleteBuffers(1, &view.commands);
+		glDeleteBuffers(1, &view.command_assets);
+		glDeleteBuffers(1, &view.visible);
+		glDeleteBuffers(1, &view.counters);
+	}
+	glDeleteBuffers(1, &m_items);
+	glDeleteBuffers(1, &m_asset_ranges);
+	glDeleteTextures(1, &m_depth_pyramid);
+}
+
+bool GpuCuller::Init()
+{
+	m_cull_program.LoadComputeShaderFromFile("Assets/Shaders/gpu cull.comp");
+	m_cull_program.CreateProgram();
+
+	m_command_program.LoadComputeShaderFromFile("Assets/Shaders/gpu cull commands.comp");
+	m_command_program.CreateProgram();
+
+	m_pyramid_program.LoadComputeShaderFromFile("Assets/Shaders/depth pyramid.comp");
+	m_pyramid_program.CreateProgram();
+
+	for (auto& view : m_views)
+	{
+		glGenBuffers(1, &view.commands);
+		glGenBuffers(1, &view.command_assets);
+		glGenBuffers(1, &view.visible);
+		glGenBuffers(1, &view.counters);
+	}
+	glGenBuffers(1, &m_items);
+	glGenBuffers(1, &m_asset_ranges);
+
+	return true;
+}
+
+void GpuCuller::CollectShaderPrograms(std::vector<ShaderProgram*>& programs)
+{
+	programs.push_back(&m_cull_program);
+	programs.push_back(&m_command_program);
+	programs.push_back(&m_pyramid_program);
+}
+
+void GpuCuller::SetItems(const std::vector<Item>& items, GLsizei node_count, GLuint asset_count)
+{
+	m_item_count = static_cast<GLsizei>(items.size());
+	m_node_count = node_count;
+
+	// every asset gets as many visible slots as it has items, so the appends never overflow
+	m_asset_first.assign(asset_count + 1, 0);
+	for (auto& item : items)
+	{
+		m_asset_first[item.asset + 1]++;
+	}
+	for (GLuint i = 0; i < asset_count; i++)
+	{
+		m_asset_first[i + 1] += m_asset_first[i];
+	}
+
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_items);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, std::max<size_t>(items.size(), 1) * sizeof(Item), items.data(), GL_DYNAMIC_DRAW);
+
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_asset_ranges);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, m_asset_first.size() * sizeof(GLuint), m_asset_first.data(), GL_STATIC_DRAW);
+
+	for (auto& view : m_views)
+	{
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, view.visible);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, std::max<size_t>(items.size(), 1) * sizeof(GLuint), NULL, GL_DYNAMIC_COPY);
+
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, view.counters);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, asset_count * sizeof(GLuint), NULL, GL_DYNAMIC_COPY);
+	}
+
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+void GpuCuller::UpdateItem(GLsizei index, const Item& item)
+{
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_items);
+	glBufferSubData(GL_SHADER_STORAGE_BUFFER, index * sizeof(Item), sizeof(Item), &item);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+void GpuCuller::SetCommands(int view, const std::vector<DrawPart>& parts)
+{
+	// the instance counts are written by the command pass every frame
+	std::vector<DrawArraysCommand> commands;
+	std::vector<GLuint> command_assets;
+	for (auto& part : parts)
+	{
+		commands.push_back({ part.count, 0, part.first, m_asset_first[part.asset] });
+		command_assets.push_back(part.asset);
+	}
+
+	View& target = m_views[view];
+	target.command_count = static_cast<GLsizei>(commands.size());
+
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, target.commands);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, std::max<size_t>(commands.size(), 1) * sizeof(DrawArraysCommand), commands.data(), GL_DYNAMIC_COPY);
+
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, target.command_assets);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, std::max<size_t>(command_assets.size(), 1) * sizeof(GLuint), command_assets.data(), GL_STATIC_DRAW);
+
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+GLsizei GpuCuller::GetCommandCount(int view) const
+{
+	return m_views[view].command_count;
+}
+
+void GpuCuller::Cull(int view, const glm::vec4* planes, GLuint required_flags, bool occlusion, const FrustumCuller::Cone* cone)
+{
+	View& target = m_views[view];
+	if (target.command_count == 0 || m_item_count == 0) return;
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, ITEM_STORAGE, m_items);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, VISIBLE_STORAGE, target.visible);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, COUNTER_STORAGE, target.counters);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, COMMAND_STORAGE, target.commands);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, COMMAND_ASSET_STORAGE, target.command_assets);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, ASSET_RANGE_STORAGE, m_asset_ranges);
+
+	// a NULL clear value fills the counters with zeros
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, target.counters);
+	glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	occlusion = occlusion && m_pyramid_valid;
+
+	m_cull_program.Bind();
+	glUniform4fv(m_cull_program.Location(Uniforms::planes), 6, glm::value_ptr(planes[0]));
+	m_cull_program.loadInt(Uniforms::item_count, m_item_count);
+	m_cull_program.loadInt(Uniforms::node_count, m_node_count);
+	m_cull_program.loadInt(Uniforms::required_flags, static_cast<int>(required_flags));
+	m_cull_program.loadInt(Uniforms::cone, cone ? 1 : 0);
+	if (cone)
+	{
+		m_cull_program.loadVec3(Uniforms::cone_apex, cone->apex);
+		m_cull_program.loadVec3(Uniforms::cone_direction, cone->direction);
+		m_cull_program.loadFloat(Uniforms::cone_angle, cone->angle);
+		m_cull_program.loadFloat(Uniforms::cone_range, cone->range);
+	}
+	m_cull_program.loadInt(Uniforms::occlusion, occlusion ? 1 : 0);
+	if (occlusion)
+	{
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, m_depth_pyramid);
+		m_cull_program.loadInt(Uniforms::depth_pyramid, 0);
+		m_cull_program.loadMat4(Uniforms::pyramid_view_projection, m_pyramid_view_projection);
+	}
+	glDispatchCompute((m_item_count + 63) / 64, 1, 1);
+
+	// the counters are final once every item has been tested
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+	m_command_program.Bind();
+	m_command_program.loadInt(Uniforms::command_count, target.command_count);
+	glDispatchCompute((target.command_count + 63) / 64, 1, 1);
+
+	// the draws read the commands as indirect parameters and the visible list from the vertex shader
+	glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+
+	m_command_program.Unbind();
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+void GpuCuller::Bind(int view)
+{
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, ITEM_STORAGE, m_items);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, VISIBLE_STORAGE, m_views[view].visible);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, m_views[view].commands);
+}
+
+GLuint GpuCuller::GetItemBuffer() const
+{
+	return m_items;
+}
+
+void GpuCuller::BuildDepthPyramid(GLuint depth_texture, int width, int height, const glm::mat4& view_projection)
+{
+	int pyramid_width = std::max(width / 2, 1);
+	int pyramid_height = std::max(height / 2, 1);
+
+	if (m_depth_pyramid == 0 || pyramid_width != m_pyramid_width || pyramid_height != m_pyramid_height)
+	{
+		// immutable storage, a new size needs a new texture
+		glDeleteTextures(1, &m_depth_pyramid);
+
+		m_pyramid_width = pyramid_width;
+		m_pyramid_height = pyramid_height;
+		m_pyramid_levels = 1;
+		while ((std::max(m_pyramid_width, m_pyramid_height) >> m_pyramid_levels) > 0) m_pyramid_levels++;
+
+		glGenTextures(1, &m_depth_pyramid);
+		glBindTexture(GL_TEXTURE_2D, m_depth_pyramid);
+		glTexStorage2D(GL_TEXTURE_2D, m_pyramid_levels, GL_R32F, m_pyramid_width, m_pyramid_height);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	}
+
+	m_pyramid_program.Bind();
+	m_pyramid_program.loadInt(Uniforms::source, 0);
+	glActiveTexture(GL_TEXTURE0);
+
+	// every level keeps the farthest depth of the 2x2 texels below it
+	for (int level = 0; level < m_pyramid_levels; level++)
+	{
+		glBindTexture(GL_TEXTURE_2D, level == 0 ? depth_texture : m_depth_pyramid);
+		m_pyramid_program.loadInt(Uniforms::source_level, level == 0 ? 0 : level - 1);
+		glBindImageTexture(0, m_depth_pyramid, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+
+		int level_width = std::max(m_pyramid_width >> level, 1);
+		int level_height = std::max(m_pyramid_height >> level, 1);
+		glDispatchCompute((level_width + 7) / 8, (level_height + 7) / 8, 1);
+		glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+	}
+
+	m_pyramid_program.Unbind();
+	glBindImageTexture(0, 0, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	m_pyramid_view_projection = view_projection;
+	m_pyramid_valid = true;
+}
+
+void GpuCuller::InvalidateDepthPyramid()
+{
+	m_pyramid_valid = false;
+}
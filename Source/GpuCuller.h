@@ -0,0 +1,123 @@
+#ifndef GPU_CULLER_H
+#define GPU_CULLER_H
+
+#include <vector>
+#include "GLEW\glew.h"
+#include "glm\glm.hpp"
+#include "ShaderProgram.h"
+#include "FrustumCuller.h"
+
+// Visibility of the scene decided on the GPU. The bounds and transforms of every
+// node stay in a storage buffer, each view runs a compute pass that tests them
+// against its frustum (and the depth pyramid of the previous frame) and appends
+// the survivors to the range of their asset in a visible list. A second dispatch
+// writes the visible count of every asset into the indirect commands drawing it.
+class GpuCuller
+{
+public:
+	enum ITEM_FLAGS
+	{
+		CASTS_SHADOW = 1,
+	};
+
+	enum VIEWS
+	{
+		CAMERA_VIEW = 0,
+		LIGHT_VIEW,
+		VIEW_COUNT
+	};
+
+	// shader storage binding points, the vertex shaders read the items and the visible list too
+	enum STORAGE_BLOCKS
+	{
+		ITEM_STORAGE = 0,
+		VISIBLE_STORAGE = 3,
+		COUNTER_STORAGE,
+		COMMAND_STORAGE,
+		COMMAND_ASSET_STORAGE,
+		ASSET_RANGE_STORAGE,
+	};
+
+	// std430 layout of the CullItems buffer, bounds are world space
+	struct Item
+	{
+		glm::mat4 world_matrix;
+		glm::mat4 normal_matrix;
+		glm::vec3 bounds_min;
+		GLuint asset;
+		glm::vec3 bounds_max;
+		GLuint flags;
+	};
+
+	// a range of vertices drawn once per visible item of the asset
+	struct DrawPart
+	{
+		GLuint first;
+		GLuint count;
+		GLuint asset;
+	};
+
+private:
+	// layout of glMultiDrawArraysIndirect commands
+	struct DrawArraysCommand
+	{
+		GLuint count;
+		GLuint instance_count;
+		GLuint first;
+		GLuint base_instance;
+	};
+
+	struct View
+	{
+		GLuint commands;
+		GLuint command_assets;
+		GLuint visible;
+		GLuint counters;
+		GLsizei command_count;
+	};
+
+	View m_views[VIEW_COUNT];
+	GLuint m_items;
+	GLuint m_asset_ranges;
+	// first slot of every asset in the visible lists
+	std::vector<GLuint> m_asset_first;
+	GLsizei m_item_count;
+	GLsizei m_node_count;
+
+	ShaderProgram m_cull_program;
+	ShaderProgram m_command_program;
+	ShaderProgram m_pyramid_program;
+
+	// max depth of the last geometry pass, mip 0 is half the screen
+	GLuint m_depth_pyramid;
+	int m_pyramid_width, m_pyramid_height, m_pyramid_levels;
+	bool m_pyramid_valid;
+	glm::mat4 m_pyramid_view_projection;
+
+public:
+	GpuCuller();
+	~GpuCuller();
+
+	bool Init();
+	// the programs of the culling passes, reloaded with the renderer's
+	void CollectShaderPrograms(std::vector<ShaderProgram*>& programs);
+
+	// the nodes followed by their hulls, the hull of node i is item node_count + i
+	void SetItems(const std::vector<Item>& items, GLsizei node_count, GLuint asset_count);
+	void UpdateItem(GLsizei index, const Item& item);
+	// commands drawn by a view, the asset ranges have to be set first
+	void SetCommands(int view, const std::vector<DrawPart>& parts);
+	GLsizei GetCommandCount(int view) const;
+
+	// planes as extracted by FrustumCuller, only items with all required flags are tested,
+	// a spot light view can pass its cone to reject the corners of its square frustum
+	void Cull(int view, const glm::vec4* planes, GLuint required_flags, bool occlusion, const FrustumCuller::Cone* cone = nullptr);
+	// items, visible list and indirect commands of the view for the draws
+	void Bind(int view);
+	GLuint GetItemBuffer() const;
+
+	void BuildDepthPyramid(GLuint depth_texture, int width, int height, const glm::mat4& view_projection);
+	void InvalidateDepthPyramid();
+};
+
+#endif
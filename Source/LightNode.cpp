@@ -1,6 +1,8 @@
 #include "LightNode.h"
 #include "glm\gtc\matrix_transform.hpp"
 #include "Tools.h"
+#include <algorithm>
+#include <cmath>
 
 // Spot Light
 LightNode::LightNode()
@@ -18,12 +20,25 @@ LightNode::LightNode()
 	m_shadow_map_bias = 0.001;
 	m_shadow_map_texture = 0;
 	m_shadow_map_fbo = 0;
+	m_shadow_filter = SHADOW_FILTER_PCF;
+	for (int i = 0; i < 2; i++)
+	{
+		m_shadow_moments_texture[i] = 0;
+		m_shadow_moments_fbo[i] = 0;
+	}
 }
 
 LightNode::~LightNode()
 {
 	glDeleteFramebuffers(1, &m_shadow_map_fbo);
 	glDeleteTextures(1, &m_shadow_map_texture);
+	glDeleteFramebuffers(2, m_shadow_moments_fbo);
+	glDeleteTextures(2, m_shadow_moments_texture);
+}
+
+void LightNode::SetShadowMapResolution(int resolution)
+{
+	m_shadow_map_resolution = resolution;
 }
 
 void LightNode::CastShadow(bool cast)
@@ -58,6 +73,36 @@ void LightNode::CastShadow(bool cast)
 			return;
 		}
 
+		// both filters stay available so they can be switched at runtime
+		int moments_resolution = GetShadowMomentsResolution();
+		for (int i = 0; i < 2; i++)
+		{
+			if (m_shadow_moments_texture[i] == 0)
+				glGenTextures(1, &m_shadow_moments_texture[i]);
+			glBindTexture(GL_TEXTURE_2D, m_shadow_moments_texture[i]);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32F, moments_resolution, moments_resolution, 0, GL_RG, GL_FLOAT, NULL);
+			// the blur reads texels directly, the lighting filters the last one through its mipmaps
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, (i == 1) ? GL_LINEAR_MIPMAP_LINEAR : GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, (i == 1) ? GL_LINEAR : GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+			if (i == 1) glGenerateMipmap(GL_TEXTURE_2D);
+
+			if (m_shadow_moments_fbo[i] == 0)
+				glGenFramebuffers(1, &m_shadow_moments_fbo[i]);
+			glBindFramebuffer(GL_FRAMEBUFFER, m_shadow_moments_fbo[i]);
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_shadow_moments_texture[i], 0);
+			glDrawBuffer(GL_COLOR_ATTACHMENT0);
+
+			status = Tools::CheckFramebufferStatus(m_shadow_moments_fbo[i]);
+			if (status != GL_FRAMEBUFFER_COMPLETE)
+			{
+				printf("Error in Spotlight shadow moments FB generation.\n");
+				return;
+			}
+		}
+		glBindTexture(GL_TEXTURE_2D, 0);
+
 		glBindFramebuffer(GL_FRAMEBUFFER, 0);
 	}
 }
@@ -70,27 +115,35 @@ void LightNode::SetColor(const glm::vec3& color)
 void LightNode::SetPosition(const glm::vec3& pos)
 {
 	m_light_position = pos + GetLightOffset();
-	m_light_direction = glm::normalize(m_light_target - m_light_position);
-	m_view_matrix = glm::lookAt(m_light_position, m_light_target, glm::vec3(0, 1, 0));
-	m_view_inverse_matrix = glm::inverse(m_view_matrix);
+	UpdateViewMatrix();
 }
 
 void LightNode::SetTarget(const glm::vec3& target)
 {
 	m_light_target = target + GetLightOffset();
+	UpdateViewMatrix();
+}
+
+void LightNode::UpdateViewMatrix()
+{
 	m_light_direction = glm::normalize(m_light_target - m_light_position);
-	m_view_matrix = glm::lookAt(m_light_position, m_light_target, glm::vec3(0, 1, 0));
+	// lights pointing straight up or down need another up vector
+	glm::vec3 up = (std::abs(m_light_direction.y) > 0.99f) ? glm::vec3(0, 0, 1) : glm::vec3(0, 1, 0);
+	m_view_matrix = glm::lookAt(m_light_position, m_light_target, up);
 	m_view_inverse_matrix = glm::inverse(m_view_matrix);
 }
 
-void LightNode::SetConeSize(float umbra, float penumbra)
+void LightNode::SetConeSize(float umbra, float penumbra, float range)
 {
 	m_umbra = umbra;
 	m_penumbra = penumbra;
 
 	float near_clipping_range = 0.1f;
-	float far_clipping_range = 100.f;
+	float far_clipping_range = range;
 	
+	m_near = near_clipping_range;
+	m_range = far_clipping_range;
+
 	float h = near_clipping_range * glm::tan(glm::radians(m_penumbra * 0.5f));
 	m_projection_matrix = glm::frustum(-h, h, -h, h, near_clipping_range, far_clipping_range);
 	m_projection_inverse_matrix = glm::inverse(m_projection_matrix);
@@ -136,6 +189,16 @@ float LightNode::GetPenumbra()
 	return m_penumbra;
 }
 
+float LightNode::GetNear()
+{
+	return m_near;
+}
+
+float LightNode::GetRange()
+{
+	return m_range;
+}
+
 bool LightNode::GetCastShadowsStatus()
 {
 	return m_cast_shadow;
@@ -156,6 +219,31 @@ int LightNode::GetShadowMapResolution()
 	return m_shadow_map_resolution;;
 }
 
+void LightNode::SetShadowFilter(int filter)
+{
+	m_shadow_filter = filter;
+}
+
+int LightNode::GetShadowFilter()
+{
+	return m_shadow_filter;
+}
+
+GLuint LightNode::GetShadowMomentsTexture(int index)
+{
+	return m_shadow_moments_texture[index];
+}
+
+GLuint LightNode::GetShadowMomentsFBO(int index)
+{
+	return m_shadow_moments_fbo[index];
+}
+
+int LightNode::GetShadowMomentsResolution()
+{
+	return std::max(m_shadow_map_resolution / 2, 1);
+}
+
 glm::mat4 LightNode::GetProjectionMatrix()
 {
 	return m_projection_matrix;
@@ -8,6 +8,20 @@
 
 class LightNode
 {
+public:
+	// how the lighting filters the shadow map
+	enum SHADOW_FILTER
+	{
+		// 2x2 comparisons against the depth map
+		SHADOW_FILTER_PCF = 0,
+		// one trilinear fetch of blurred exponential moments
+		SHADOW_FILTER_EVSM,
+	};
+
+	// depth in [0, 1] is warped by exp(EVSM_EXPONENT * depth), 40 keeps the squares inside 32 bit floats
+	static constexpr float EVSM_EXPONENT = 40.f;
+
+private:
 	std::string m_name;
 	glm::vec3 m_light_direction;
 	glm::vec3 m_light_position;
@@ -17,18 +31,26 @@ class LightNode
 
 	float m_umbra;
 	float m_penumbra;
+	float m_near;
+	float m_range;
 
 	bool m_cast_shadow;
 	int m_shadow_map_resolution;
 	float m_shadow_map_bias;
 	GLuint m_shadow_map_texture;
 	GLuint m_shadow_map_fbo;
+	int m_shadow_filter;
+	// half resolution moments, horizontally blurred and then the final mipmapped ones
+	GLuint m_shadow_moments_texture[2];
+	GLuint m_shadow_moments_fbo[2];
 
 	glm::mat4 m_projection_matrix;
 	glm::mat4 m_projection_inverse_matrix;
 	glm::mat4 m_view_matrix;
 	glm::mat4 m_view_inverse_matrix;
 
+	void UpdateViewMatrix();
+
 public:
 	LightNode();
 	~LightNode();
@@ -36,7 +58,7 @@ public:
 	void SetPosition(const glm::vec3& pos);
 	void SetColor(const glm::vec3& color);
 	void SetTarget(const glm::vec3& target);
-	void SetConeSize(float umbra, float penumbra);
+	void SetConeSize(float umbra, float penumbra, float range = 100.f);
 	void SetLightOffset(const glm::vec3 offset);
 
 	glm::vec3 GetPosition();
@@ -47,12 +69,22 @@ public:
 
 	float GetUmbra();
 	float GetPenumbra();
+	// near and far plane of the shadow projection
+	float GetNear();
+	float GetRange();
 
+	// takes effect on the next CastShadow(true)
+	void SetShadowMapResolution(int resolution);
 	void CastShadow(bool enable);
 	bool GetCastShadowsStatus();
 	GLuint GetShadowMapFBO();
 	GLuint GetShadowMapDepthTexture();
 	int GetShadowMapResolution();
+	void SetShadowFilter(int filter);
+	int GetShadowFilter();
+	GLuint GetShadowMomentsTexture(int index);
+	GLuint GetShadowMomentsFBO(int index);
+	int GetShadowMomentsResolution();
 
 	glm::mat4 GetProjectionMatrix();
 	glm::mat4 GetViewMatrix();
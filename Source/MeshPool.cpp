@@ -0,0 +1,141 @@
+#include "MeshPool.h"
+#include "GeometricMesh.h"
+#include <cstdio>
+
+MeshPool::MeshPool()
+{
+	m_vao = 0;
+	m_vao_positions = 0;
+	m_vbo_positions = 0;
+	m_vbo_normals = 0;
+	m_vbo_texcoords = 0;
+	m_vbo_tangents = 0;
+	m_vbo_bitangents = 0;
+}
+
+MeshPool::~MeshPool()
+{
+	glDeleteVertexArrays(1, &m_vao);
+	glDeleteVertexArrays(1, &m_vao_positions);
+	glDeleteBuffers(1, &m_vbo_positions);
+	glDeleteBuffers(1, &m_vbo_normals);
+	glDeleteBuffers(1, &m_vbo_texcoords);
+	glDeleteBuffers(1, &m_vbo_tangents);
+	glDeleteBuffers(1, &m_vbo_bitangents);
+}
+
+GLint MeshPool::Append(GeometricMesh* mesh)
+{
+	GLint first = static_cast<GLint>(m_positions.size());
+	size_t count = mesh->vertices.size();
+
+	m_positions.insert(m_positions.end(), mesh->vertices.begin(), mesh->vertices.end());
+	m_normals.insert(m_normals.end(), mesh->normals.begin(), mesh->normals.end());
+	m_normals.resize(first + count, glm::vec3(0.f));
+
+	// the streams must stay aligned, meshes without texture coordinates or tangents get zeros
+	// which is what a disabled attribute used to read
+	if (mesh->textureCoord.size() == count)
+		m_texcoords.insert(m_texcoords.end(), mesh->textureCoord.begin(), mesh->textureCoord.end());
+	else
+		m_texcoords.resize(first + count, glm::vec2(0.f));
+
+	if (mesh->tangents.size() == count && mesh->bitangents.size() == count)
+	{
+		m_tangents.insert(m_tangents.end(), mesh->tangents.begin(), mesh->tangents.end());
+		m_bitangents.insert(m_bitangents.end(), mesh->bitangents.begin(), mesh->bitangents.end());
+	}
+	else
+	{
+		m_tangents.resize(first + count, glm::vec3(0.f));
+		m_bitangents.resize(first + count, glm::vec3(0.f));
+	}
+
+	return first;
+}
+
+bool MeshPool::Upload()
+{
+	if (m_positions.empty()) return false;
+
+	glGenVertexArrays(1, &m_vao);
+	glBindVertexArray(m_vao);
+
+	glGenBuffers(1, &m_vbo_positions);
+	glBindBuffer(GL_ARRAY_BUFFER, m_vbo_positions);
+	glBufferData(GL_ARRAY_BUFFER, m_positions.size() * sizeof(glm::vec3), m_positions.data(), GL_STATIC_DRAW);
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
+
+	glGenBuffers(1, &m_vbo_normals);
+	glBindBuffer(GL_ARRAY_BUFFER, m_vbo_normals);
+	glBufferData(GL_ARRAY_BUFFER, m_normals.size() * sizeof(glm::vec3), m_normals.data(), GL_STATIC_DRAW);
+	glEnableVertexAttribArray(1);
+	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, 0);
+
+	glGenBuffers(1, &m_vbo_texcoords);
+	glBindBuffer(GL_ARRAY_BUFFER, m_vbo_texcoords);
+	glBufferData(GL_ARRAY_BUFFER, m_texcoords.size() * sizeof(glm::vec2), m_texcoords.data(), GL_STATIC_DRAW);
+	glEnableVertexAttribArray(2);
+	glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 0, 0);
+
+	glGenBuffers(1, &m_vbo_tangents);
+	glBindBuffer(GL_ARRAY_BUFFER, m_vbo_tangents);
+	glBufferData(GL_ARRAY_BUFFER, m_tangents.size() * sizeof(glm::vec3), m_tangents.data(), GL_STATIC_DRAW);
+	glEnableVertexAttribArray(3);
+	glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, 0, 0);
+
+	glGenBuffers(1, &m_vbo_bitangents);
+	glBindBuffer(GL_ARRAY_BUFFER, m_vbo_bitangents);
+	glBufferData(GL_ARRAY_BUFFER, m_bitangents.size() * sizeof(glm::vec3), m_bitangents.data(), GL_STATIC_DRAW);
+	glEnableVertexAttribArray(4);
+	glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, 0, 0);
+
+	// the shadow pass fetches nothing but the positions
+	glGenVertexArrays(1, &m_vao_positions);
+	glBindVertexArray(m_vao_positions);
+	glBindBuffer(GL_ARRAY_BUFFER, m_vbo_positions);
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
+
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	printf("mesh pool: %u vertices\n", static_cast<unsigned int>(m_positions.size()));
+
+	std::vector<glm::vec3>().swap(m_normals);
+	std::vector<glm::vec2>().swap(m_texcoords);
+	std::vector<glm::vec3>().swap(m_tangents);
+	std::vector<glm::vec3>().swap(m_bitangents);
+
+	return true;
+}
+
+GLuint MeshPool::GetVAO()
+{
+	return m_vao;
+}
+
+GLuint MeshPool::GetPositionsVAO()
+{
+	return m_vao_positions;
+}
+
+GLuint MeshPool::GetPositionsVBO()
+{
+	return m_vbo_positions;
+}
+
+void MeshPool::BindStorageBuffers(GLuint first_binding)
+{
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, first_binding, m_vbo_positions);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, first_binding + 1, m_vbo_normals);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, first_binding + 2, m_vbo_texcoords);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, first_binding + 3, m_vbo_tangents);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, first_binding + 4, m_vbo_bitangents);
+}
+
+GLsizei MeshPool::GetVertexCount()
+{
+	return static_cast<GLsizei>(m_positions.size());
+}
@@ -0,0 +1,44 @@
+#ifndef MESH_POOL_H
+#define MESH_POOL_H
+
+#include <vector>
+#include "GLEW\glew.h"
+#include "glm\glm.hpp"
+
+// All static meshes packed into one set of vertex streams behind a single VAO,
+// every mesh is addressed by the first vertex it got in the pool
+class MeshPool
+{
+	std::vector<glm::vec3> m_positions;
+	std::vector<glm::vec3> m_normals;
+	std::vector<glm::vec2> m_texcoords;
+	std::vector<glm::vec3> m_tangents;
+	std::vector<glm::vec3> m_bitangents;
+
+	GLuint m_vao;
+	// positions only, for the depth only passes
+	GLuint m_vao_positions;
+	GLuint m_vbo_positions;
+	GLuint m_vbo_normals;
+	GLuint m_vbo_texcoords;
+	GLuint m_vbo_tangents;
+	GLuint m_vbo_bitangents;
+
+public:
+	MeshPool();
+	~MeshPool();
+
+	// copy the vertex streams of the mesh to the end of the pool and return its first vertex
+	GLint Append(class GeometricMesh* mesh);
+	// create the GL buffers, only the positions are kept on the CPU
+	bool Upload();
+
+	GLuint GetVAO();
+	GLuint GetPositionsVAO();
+	GLuint GetPositionsVBO();
+	// the five streams as shader storage blocks from first_binding on, read as float arrays
+	void BindStorageBuffers(GLuint first_binding);
+	GLsizei GetVertexCount();
+};
+
+#endif
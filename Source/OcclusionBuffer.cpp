@@ -0,0 +1,214 @@
+#include "OcclusionBuffer.h"
+#include <algorithm>
+#include <cmath>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define OCCLUSION_BUFFER_SSE
+#endif
+
+OcclusionBuffer::OcclusionBuffer()
+{
+	m_depth.assign(WIDTH * HEIGHT, 1.f);
+	m_tile_max.assign(TILES_X * TILES_Y, 1.f);
+	m_view_projection = glm::mat4(1.f);
+}
+
+void OcclusionBuffer::Clear(const glm::mat4& view_projection)
+{
+	m_view_projection = view_projection;
+	std::fill(m_depth.begin(), m_depth.end(), 1.f);
+}
+
+void OcclusionBuffer::RasterizeTriangles(const glm::vec3* vertices, size_t vertex_count, const glm::mat4& model)
+{
+	glm::mat4 transform = m_view_projection * model;
+
+	for (size_t t = 0; t + 2 < vertex_count; t += 3)
+	{
+		glm::vec4 clip[3];
+		float near_distance[3];
+		int inside = 0;
+		for (int i = 0; i < 3; i++)
+		{
+			clip[i] = transform * glm::vec4(vertices[t + i], 1.f);
+			near_distance[i] = clip[i].z + clip[i].w;
+			if (near_distance[i] >= 0.f) inside++;
+		}
+		if (inside == 0) continue;
+
+		// clip against the near plane, a triangle becomes at most a quad
+		glm::vec4 polygon[4];
+		int count = 0;
+		for (int i = 0; i < 3; i++)
+		{
+			int j = (i + 1) % 3;
+			if (near_distance[i] >= 0.f) polygon[count++] = clip[i];
+			if ((near_distance[i] >= 0.f) != (near_distance[j] >= 0.f))
+			{
+				float s = near_distance[i] / (near_distance[i] - near_distance[j]);
+				polygon[count++] = clip[i] + (clip[j] - clip[i]) * s;
+			}
+		}
+
+		glm::vec3 screen[4];
+		for (int i = 0; i < count; i++)
+		{
+			float w = std::max(polygon[i].w, 1e-6f);
+			screen[i] = glm::vec3(
+				(polygon[i].x / w * 0.5f + 0.5f) * WIDTH,
+				(polygon[i].y / w * 0.5f + 0.5f) * HEIGHT,
+				polygon[i].z / w);
+		}
+
+		RasterizeTriangle(screen[0], screen[1], screen[2]);
+		if (count == 4) RasterizeTriangle(screen[0], screen[2], screen[3]);
+	}
+}
+
+void OcclusionBuffer::RasterizeTriangle(const glm::vec3& v0, const glm::vec3& a, const glm::vec3& b)
+{
+	float area = (a.x - v0.x) * (b.y - v0.y) - (b.x - v0.x) * (a.y - v0.y);
+	if (std::fabs(area) < 1e-8f) return;
+
+	// both faces of the hulls occlude, flip the clockwise ones
+	glm::vec3 v1 = area > 0.f ? a : b;
+	glm::vec3 v2 = area > 0.f ? b : a;
+	area = std::fabs(area);
+
+	int x0 = std::max(0, static_cast<int>(std::floor(std::min(v0.x, std::min(v1.x, v2.x)))));
+	int x1 = std::min(WIDTH - 1, static_cast<int>(std::ceil(std::max(v0.x, std::max(v1.x, v2.x)))));
+	int y0 = std::max(0, static_cast<int>(std::floor(std::min(v0.y, std::min(v1.y, v2.y)))));
+	int y1 = std::min(HEIGHT - 1, static_cast<int>(std::ceil(std::max(v0.y, std::max(v1.y, v2.y)))));
+	if (x0 > x1 || y0 > y1) return;
+
+	// edge functions e = A * x + B * y + C, positive inside
+	float A[3] = { v0.y - v1.y, v1.y - v2.y, v2.y - v0.y };
+	float B[3] = { v1.x - v0.x, v2.x - v1.x, v0.x - v2.x };
+	float C[3] = {
+		(v1.y - v0.y) * v0.x - (v1.x - v0.x) * v0.y,
+		(v2.y - v1.y) * v1.x - (v2.x - v1.x) * v1.y,
+		(v0.y - v2.y) * v2.x - (v0.x - v2.x) * v2.y };
+
+	// device depth is linear in screen space
+	float zA = ((v1.z - v0.z) * (v2.y - v0.y) - (v2.z - v0.z) * (v1.y - v0.y)) / area;
+	float zB = ((v1.x - v0.x) * (v2.z - v0.z) - (v2.x - v0.x) * (v1.z - v0.z)) / area;
+	float zC = v0.z - zA * v0.x - zB * v0.y;
+
+#if defined(OCCLUSION_BUFFER_SSE)
+	// four pixels of a row per step, the rows of the buffer are a multiple of 4 wide
+	x0 &= ~3;
+	const __m128 offsets = _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f);
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 a0 = _mm_set1_ps(A[0]), a1 = _mm_set1_ps(A[1]), a2 = _mm_set1_ps(A[2]), az = _mm_set1_ps(zA);
+
+	for (int y = y0; y <= y1; y++)
+	{
+		float py = y + 0.5f;
+		float* row = &m_depth[y * WIDTH];
+
+		for (int x = x0; x <= x1; x += 4)
+		{
+			__m128 px = _mm_add_ps(_mm_set1_ps(static_cast<float>(x)), offsets);
+
+			__m128 e0 = _mm_add_ps(_mm_mul_ps(a0, px), _mm_set1_ps(B[0] * py + C[0]));
+			__m128 e1 = _mm_add_ps(_mm_mul_ps(a1, px), _mm_set1_ps(B[1] * py + C[1]));
+			__m128 e2 = _mm_add_ps(_mm_mul_ps(a2, px), _mm_set1_ps(B[2] * py + C[2]));
+
+			__m128 covered = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(e0, zero), _mm_cmpge_ps(e1, zero)), _mm_cmpge_ps(e2, zero));
+			if (_mm_movemask_ps(covered) == 0) continue;
+
+			__m128 z = _mm_add_ps(_mm_mul_ps(az, px), _mm_set1_ps(zB * py + zC));
+			__m128 old_depth = _mm_loadu_ps(row + x);
+			__m128 new_depth = _mm_min_ps(old_depth, z);
+			_mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(covered, new_depth), _mm_andnot_ps(covered, old_depth)));
+		}
+	}
+#else
+	for (int y = y0; y <= y1; y++)
+	{
+		float py = y + 0.5f;
+		float* row = &m_depth[y * WIDTH];
+
+		for (int x = x0; x <= x1; x++)
+		{
+			float px = x + 0.5f;
+			if (A[0] * px + B[0] * py + C[0] < 0.f) continue;
+			if (A[1] * px + B[1] * py + C[1] < 0.f) continue;
+			if (A[2] * px + B[2] * py + C[2] < 0.f) continue;
+
+			row[x] = std::min(row[x], zA * px + zB * py + zC);
+		}
+	}
+#endif
+}
+
+void OcclusionBuffer::BuildHierarchy()
+{
+	for (int ty = 0; ty < TILES_Y; ty++)
+	{
+		for (int tx = 0; tx < TILES_X; tx++)
+		{
+			float farthest = -1.f;
+			for (int y = ty * TILE_SIZE; y < (ty + 1) * TILE_SIZE; y++)
+			{
+				const float* row = &m_depth[y * WIDTH + tx * TILE_SIZE];
+				for (int x = 0; x < TILE_SIZE; x++) farthest = std::max(farthest, row[x]);
+			}
+			m_tile_max[ty * TILES_X + tx] = farthest;
+		}
+	}
+}
+
+bool OcclusionBuffer::TestBox(const glm::vec3& min, const glm::vec3& max) const
+{
+	glm::vec2 rect_min = glm::vec2(WIDTH, HEIGHT);
+	glm::vec2 rect_max = glm::vec2(0.f);
+	float nearest = 1.f;
+
+	for (int i = 0; i < 8; i++)
+	{
+		glm::vec3 corner = glm::vec3((i & 1) ? max.x : min.x, (i & 2) ? max.y : min.y, (i & 4) ? max.z : min.z);
+		glm::vec4 clip = m_view_projection * glm::vec4(corner, 1.f);
+
+		// a box reaching the near plane may cover the whole screen
+		if (clip.z + clip.w <= 0.f || clip.w <= 1e-6f) return true;
+
+		glm::vec3 ndc = glm::vec3(clip) / clip.w;
+		glm::vec2 screen = (glm::vec2(ndc) * 0.5f + 0.5f) * glm::vec2(WIDTH, HEIGHT);
+		rect_min = glm::min(rect_min, screen);
+		rect_max = glm::max(rect_max, screen);
+		nearest = std::min(nearest, ndc.z);
+	}
+
+	int px0 = std::max(0, static_cast<int>(std::floor(rect_min.x)));
+	int px1 = std::min(WIDTH - 1, static_cast<int>(std::floor(rect_max.x)));
+	int py0 = std::max(0, static_cast<int>(std::floor(rect_min.y)));
+	int py1 = std::min(HEIGHT - 1, static_cast<int>(std::floor(rect_max.y)));
+
+	// off screen, the frustum test has the final word
+	if (px0 > px1 || py0 > py1) return true;
+
+	for (int ty = py0 / TILE_SIZE; ty <= py1 / TILE_SIZE; ty++)
+	{
+		for (int tx = px0 / TILE_SIZE; tx <= px1 / TILE_SIZE; tx++)
+		{
+			if (nearest > m_tile_max[ty * TILES_X + tx]) continue;
+
+			// tiles the box only partly covers are checked against the pixels it covers
+			int x0 = std::max(px0, tx * TILE_SIZE), x1 = std::min(px1, tx * TILE_SIZE + TILE_SIZE - 1);
+			int y0 = std::max(py0, ty * TILE_SIZE), y1 = std::min(py1, ty * TILE_SIZE + TILE_SIZE - 1);
+			if (x1 - x0 == TILE_SIZE - 1 && y1 - y0 == TILE_SIZE - 1) return true;
+
+			for (int y = y0; y <= y1; y++)
+			{
+				for (int x = x0; x <= x1; x++)
+				{
+					if (nearest <= m_depth[y * WIDTH + x]) return true;
+				}
+			}
+		}
+	}
+
+	return false;
+}
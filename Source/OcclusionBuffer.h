@@ -0,0 +1,41 @@
+#ifndef OCCLUSION_BUFFER_H
+#define OCCLUSION_BUFFER_H
+
+#include <vector>
+#include <cstdint>
+#include "glm\glm.hpp"
+
+// Small CPU depth buffer the occluders are rasterized into every frame, with a
+// second level holding the farthest depth of every 8x8 tile. A box is hidden when
+// its nearest point lies behind the farthest occluder of every tile it covers.
+// Depths are normalized device z, the buffer is cleared to the far plane.
+class OcclusionBuffer
+{
+public:
+	static const int WIDTH = 256;
+	static const int HEIGHT = 128;
+	static const int TILE_SIZE = 8;
+	static const int TILES_X = WIDTH / TILE_SIZE;
+	static const int TILES_Y = HEIGHT / TILE_SIZE;
+
+private:
+	std::vector<float> m_depth;
+	std::vector<float> m_tile_max;
+	glm::mat4 m_view_projection;
+
+	void RasterizeTriangle(const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2);
+
+public:
+	OcclusionBuffer();
+
+	void Clear(const glm::mat4& view_projection);
+	// triangle list in object space, three vertices per triangle, both faces are drawn
+	void RasterizeTriangles(const glm::vec3* vertices, size_t vertex_count, const glm::mat4& model);
+	// update the tile level, call once after the last occluder
+	void BuildHierarchy();
+
+	// false when the world box is hidden behind the occluders
+	bool TestBox(const glm::vec3& min, const glm::vec3& max) const;
+};
+
+#endif
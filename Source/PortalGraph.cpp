@@ -0,0 +1,211 @@
+#include "PortalGraph.h"
+#include <algorithm>
+#include <limits>
+
+// longest chain of portals followed from the camera cell
+static const int MAX_PORTAL_DEPTH = 64;
+
+PortalGraph::PortalGraph()
+{
+	m_view_projection = glm::mat4(1.f);
+	m_active = false;
+}
+
+void PortalGraph::Clear()
+{
+	m_cells.clear();
+	m_portals.clear();
+	m_item_first.clear();
+	m_item_cells.clear();
+	m_cell_rects.clear();
+	m_visible.clear();
+	m_active = false;
+}
+
+int PortalGraph::AddCell(const glm::vec3& min, const glm::vec3& max)
+{
+	Cell cell;
+	cell.min = min;
+	cell.max = max;
+	m_cells.push_back(cell);
+	return static_cast<int>(m_cells.size()) - 1;
+}
+
+void PortalGraph::Connect(float epsilon)
+{
+	m_portals.clear();
+	for (auto& cell : m_cells) cell.portals.clear();
+
+	for (int a = 0; a < static_cast<int>(m_cells.size()); a++)
+	{
+		for (int b = a + 1; b < static_cast<int>(m_cells.size()); b++)
+		{
+			// the pieces are placed by hand, so openings that meet may leave a small gap
+			glm::vec3 min = glm::max(m_cells[a].min, m_cells[b].min) - glm::vec3(epsilon);
+			glm::vec3 max = glm::min(m_cells[a].max, m_cells[b].max) + glm::vec3(epsilon);
+			if (glm::any(glm::greaterThan(min, max))) continue;
+
+			Portal portal;
+			portal.min = min;
+			portal.max = max;
+			portal.cells[0] = a;
+			portal.cells[1] = b;
+			m_portals.push_back(portal);
+
+			m_cells[a].portals.push_back(static_cast<int>(m_portals.size()) - 1);
+			m_cells[b].portals.push_back(static_cast<int>(m_portals.size()) - 1);
+		}
+	}
+
+	m_cell_rects.assign(m_cells.size(), std::vector<glm::vec4>());
+	m_visible.assign(m_cells.size(), 0);
+}
+
+void PortalGraph::SetItems(const std::vector<glm::vec3>& centers, const std::vector<glm::vec3>& extents)
+{
+	m_item_first.clear();
+	m_item_cells.clear();
+
+	for (size_t i = 0; i < centers.size(); i++)
+	{
+		m_item_first.push_back(static_cast<uint32_t>(m_item_cells.size()));
+
+		glm::vec3 min = centers[i] - extents[i];
+		glm::vec3 max = centers[i] + extents[i];
+		for (int c = 0; c < static_cast<int>(m_cells.size()); c++)
+		{
+			if (glm::any(glm::greaterThan(min, m_cells[c].max)) || glm::any(glm::lessThan(max, m_cells[c].min))) continue;
+			m_item_cells.push_back(c);
+		}
+	}
+	m_item_first.push_back(static_cast<uint32_t>(m_item_cells.size()));
+}
+
+bool PortalGraph::Update(const glm::vec3& camera_position, const glm::mat4& view_projection)
+{
+	m_view_projection = view_projection;
+	for (auto& rects : m_cell_rects) rects.clear();
+	std::fill(m_visible.begin(), m_visible.end(), 0);
+
+	// the boxes of neighbouring pieces overlap, start from every one around the camera
+	m_active = false;
+	for (int i = 0; i < static_cast<int>(m_cells.size()); i++)
+	{
+		const Cell& cell = m_cells[i];
+		if (glm::any(glm::lessThan(camera_position, cell.min)) || glm::any(glm::greaterThan(camera_position, cell.max))) continue;
+
+		Visit(i, glm::vec4(-1.f, -1.f, 1.f, 1.f), 0);
+		m_active = true;
+	}
+
+	return m_active;
+}
+
+void PortalGraph::Visit(int cell, const glm::vec4& rect, int depth)
+{
+	m_visible[cell] = 1;
+	m_cell_rects[cell].push_back(rect);
+
+	if (depth >= MAX_PORTAL_DEPTH) return;
+
+	for (int index : m_cells[cell].portals)
+	{
+		const Portal& portal = m_portals[index];
+		int next = (portal.cells[0] == cell) ? portal.cells[1] : portal.cells[0];
+
+		glm::vec4 portal_rect;
+		PROJECTION projection = ProjectBox(portal.min, portal.max, portal_rect);
+		if (projection == BEHIND_CAMERA) continue;
+
+		glm::vec4 clipped = glm::vec4(glm::max(glm::vec2(rect), glm::vec2(portal_rect)), glm::min(glm::vec2(rect.z, rect.w), glm::vec2(portal_rect.z, portal_rect.w)));
+		if (clipped.x >= clipped.z || clipped.y >= clipped.w) continue;
+
+		// nothing new to see when the cell was already reached through a larger opening
+		bool covered = false;
+		for (auto& seen : m_cell_rects[next])
+		{
+			if (seen.x <= clipped.x && seen.y <= clipped.y && seen.z >= clipped.z && seen.w >= clipped.w)
+			{
+				covered = true;
+				break;
+			}
+		}
+		if (covered) continue;
+
+		Visit(next, clipped, depth + 1);
+	}
+}
+
+PortalGraph::PROJECTION PortalGraph::ProjectBox(const glm::vec3& min, const glm::vec3& max, glm::vec4& rect) const
+{
+	const float near_w = 1e-3f;
+
+	rect = glm::vec4(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(),
+		-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max());
+
+	glm::vec4 corners[8];
+	int behind = 0;
+	for (int i = 0; i < 8; i++)
+	{
+		glm::vec3 corner = glm::vec3((i & 1) ? max.x : min.x, (i & 2) ? max.y : min.y, (i & 4) ? max.z : min.z);
+		corners[i] = m_view_projection * glm::vec4(corner, 1.f);
+
+		if (corners[i].w <= near_w)
+		{
+			behind++;
+			continue;
+		}
+
+		glm::vec2 ndc = glm::vec2(corners[i]) / corners[i].w;
+		rect = glm::vec4(glm::min(glm::vec2(rect), ndc), glm::max(glm::vec2(rect.z, rect.w), ndc));
+	}
+
+	if (behind == 8) return BEHIND_CAMERA;
+	if (behind == 0) return ON_SCREEN;
+
+	// edges crossing the camera plane are cut there, the cut points project far out
+	// towards the side the box extends to and bound the rectangle on that side
+	for (int i = 0; i < 8; i++)
+	{
+		for (int axis = 1; axis < 8; axis <<= 1)
+		{
+			int j = i | axis;
+			if (j == i) continue;
+
+			const glm::vec4& a = corners[i];
+			const glm::vec4& b = corners[j];
+			if ((a.w <= near_w) == (b.w <= near_w)) continue;
+
+			glm::vec4 cut = a + (b - a) * ((near_w - a.w) / (b.w - a.w));
+			glm::vec2 ndc = glm::vec2(cut) / near_w;
+			rect = glm::vec4(glm::min(glm::vec2(rect), ndc), glm::max(glm::vec2(rect.z, rect.w), ndc));
+		}
+	}
+
+	return CROSSES_NEAR_PLANE;
+}
+
+bool PortalGraph::IsItemVisible(uint32_t item) const
+{
+	if (!m_active || item + 1 >= m_item_first.size()) return true;
+
+	uint32_t first = m_item_first[item];
+	uint32_t last = m_item_first[item + 1];
+	if (first == last) return true;
+
+	for (uint32_t i = first; i < last; i++)
+	{
+		if (m_visible[m_item_cells[i]]) return true;
+	}
+	return false;
+}
+
+size_t PortalGraph::GetCellCount() const
+{
+	return m_cells.size();
+}
+
+size_t PortalGraph::GetPortalCount() const
+{
+	return m_portals.size();
+}
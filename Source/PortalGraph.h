@@ -0,0 +1,72 @@
+#ifndef PORTAL_GRAPH_H
+#define PORTAL_GRAPH_H
+
+#include <vector>
+#include <cstdint>
+#include "glm\glm.hpp"
+
+// Cells and portals of the corridor network. Every corridor piece is a cell
+// bounded by its world box, two cells whose boxes touch are joined by a portal
+// covering the overlap of the boxes. Each frame the cells are flooded from the
+// one holding the camera, a portal is only crossed when its screen rectangle
+// overlaps the rectangle the previous portals left open.
+class PortalGraph
+{
+	struct Cell
+	{
+		glm::vec3 min;
+		glm::vec3 max;
+		std::vector<int> portals;
+	};
+
+	struct Portal
+	{
+		glm::vec3 min;
+		glm::vec3 max;
+		int cells[2];
+	};
+
+	std::vector<Cell> m_cells;
+	std::vector<Portal> m_portals;
+	// cells overlapped by item i are m_item_cells[m_item_first[i] .. m_item_first[i + 1]),
+	// an item overlapping none is never rejected
+	std::vector<uint32_t> m_item_first;
+	std::vector<int> m_item_cells;
+
+	// per frame: the parts of the screen (ndc min xy, max xy) each cell was reached through
+	std::vector<std::vector<glm::vec4>> m_cell_rects;
+	std::vector<uint8_t> m_visible;
+	glm::mat4 m_view_projection;
+	bool m_active;
+
+	enum PROJECTION
+	{
+		BEHIND_CAMERA = 0,
+		ON_SCREEN,
+		CROSSES_NEAR_PLANE,
+	};
+
+	void Visit(int cell, const glm::vec4& rect, int depth);
+	PROJECTION ProjectBox(const glm::vec3& min, const glm::vec3& max, glm::vec4& rect) const;
+
+public:
+	PortalGraph();
+
+	void Clear();
+	int AddCell(const glm::vec3& min, const glm::vec3& max);
+	// join every pair of cells whose boxes are closer than epsilon
+	void Connect(float epsilon);
+	// world boxes of the items tested with IsItemVisible, an item is visible
+	// when any cell its box overlaps was reached
+	void SetItems(const std::vector<glm::vec3>& centers, const std::vector<glm::vec3>& extents);
+
+	// flood the graph from the cells around the camera, false when the camera
+	// is outside every cell and nothing can be rejected
+	bool Update(const glm::vec3& camera_position, const glm::mat4& view_projection);
+	bool IsItemVisible(uint32_t item) const;
+
+	size_t GetCellCount() const;
+	size_t GetPortalCount() const;
+};
+
+#endif
@@ -0,0 +1,90 @@
+#include "RenderQueue.h"
+#include <algorithm>
+#include <cmath>
+
+RenderQueue::RenderQueue()
+{
+}
+
+RenderQueue::~RenderQueue()
+{
+}
+
+uint64_t RenderQueue::MakeKey(int pass, int program, int texture_set, int material, float depth)
+{
+	depth = std::min(std::max(depth, 0.f), 1.f);
+
+	// the square root gives the buckets close to the camera a finer spacing
+	uint64_t coarse_depth = static_cast<uint64_t>(std::sqrt(depth) * 15.f);
+	uint64_t fine_depth = static_cast<uint64_t>(depth * 0xFFFFF);
+
+	return (static_cast<uint64_t>(pass & 0xF) << 60) |
+		(static_cast<uint64_t>(program & 0xF) << 56) |
+		(coarse_depth << 52) |
+		(static_cast<uint64_t>(texture_set & 0xFFFF) << 36) |
+		(static_cast<uint64_t>(material & 0xFFFF) << 20) |
+		fine_depth;
+}
+
+int RenderQueue::GetPass(uint64_t key)
+{
+	return static_cast<int>(key >> 60);
+}
+
+int RenderQueue::GetProgram(uint64_t key)
+{
+	return static_cast<int>((key >> 56) & 0xF);
+}
+
+void RenderQueue::Clear()
+{
+	m_items.clear();
+}
+
+void RenderQueue::Push(uint64_t key, uint32_t batch, uint32_t part)
+{
+	m_items.push_back({ key, batch, part });
+}
+
+void RenderQueue::Sort()
+{
+	m_scratch.resize(m_items.size());
+
+	for (int shift = 0; shift < 64; shift += 8)
+	{
+		size_t count[257] = {};
+		for (auto& item : m_items)
+		{
+			count[((item.key >> shift) & 0xFF) + 1]++;
+		}
+
+		// every key has the same byte here, the order would not change
+		bool skip = false;
+		for (int i = 1; i < 257; i++)
+		{
+			if (count[i] == m_items.size())
+			{
+				skip = true;
+				break;
+			}
+		}
+		if (skip) continue;
+
+		for (int i = 0; i < 256; i++)
+		{
+			count[i + 1] += count[i];
+		}
+
+		for (auto& item : m_items)
+		{
+			m_scratch[count[(item.key >> shift) & 0xFF]++] = item;
+		}
+
+		m_items.swap(m_scratch);
+	}
+}
+
+const std::vector<RenderQueue::DrawItem>& RenderQueue::Items() const
+{
+	return m_items;
+}
@@ -0,0 +1,50 @@
+#ifndef RENDER_QUEUE_H
+#define RENDER_QUEUE_H
+
+#include <vector>
+#include <cstdint>
+
+// Per frame list of draws ordered by a packed 64-bit state key
+//
+//  63      60 59    56 55     52 51          36 35        20 19          0
+// [  pass   ][program][ depth  ][ texture set  ][ material  ][ fine depth ]
+//
+// Sorting the keys groups draws by pass and program, goes roughly front to back
+// through the coarse depth buckets, and inside a bucket keeps draws that share
+// textures and materials next to each other.
+class RenderQueue
+{
+public:
+	enum PASS
+	{
+		PASS_OPAQUE = 0,
+	};
+
+	struct DrawItem
+	{
+		uint64_t key;
+		uint32_t batch;
+		uint32_t part;
+	};
+
+	RenderQueue();
+	~RenderQueue();
+
+	// depth is the view space distance normalized to [0, 1] by the far plane
+	static uint64_t MakeKey(int pass, int program, int texture_set, int material, float depth);
+	static int GetPass(uint64_t key);
+	static int GetProgram(uint64_t key);
+
+	void Clear();
+	void Push(uint64_t key, uint32_t batch, uint32_t part);
+	// LSD radix sort, 8 bits per pass
+	void Sort();
+
+	const std::vector<DrawItem>& Items() const;
+
+private:
+	std::vector<DrawItem> m_items;
+	std::vector<DrawItem> m_scratch;
+};
+
+#endif
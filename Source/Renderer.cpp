@@ -2,12 +2,15 @@
 #include "GeometryNode.h"
 #include "Tools.h"
 #include "ShaderProgram.h"
+#include "ShaderUniforms.h"
 #include "glm/gtc/type_ptr.hpp"
 #include "glm/gtc/matrix_transform.hpp"
 #include "OBJLoader.h"
 
 #include <algorithm>
 #include <array>
+#include <climits>
+#include <cstddef>
 #include <iostream>
 #include <math.h>
 
@@ -16,12 +19,52 @@ Renderer::Renderer()
 	this->m_nodes = {};
 	this->m_collidables_nodes = {};
 	this->m_continous_time = 0.0;
+	this->m_asset_meshes.fill(nullptr);
+	this->m_vbo_instances = 0;
+	this->m_instance_buffer_size = 0;
+	this->m_ubo_frame = 0;
+	this->m_light_buffer = 0;
+	this->m_max_spot_lights = MAX_SPOT_LIGHTS;
+	this->m_shadow_atlas_frame = 0;
+	this->m_ubo_materials = 0;
+	this->m_material_stride = 0;
+	this->m_use_indirect = false;
+	this->m_indirect_buffer = 0;
+	this->m_ssbo_draw_materials = 0;
+	this->m_ssbo_materials = 0;
+	this->m_vao_box = 0;
+	this->m_vbo_box = 0;
+	this->m_frame_index = 0;
+	this->m_gpu_culling_supported = false;
+	this->m_use_gpu_culling = false;
+	this->m_use_depth_pyramid = true;
+	this->m_ssbo_gpu_draw_materials = 0;
+	this->m_visibility_supported = false;
+	this->m_use_visibility_buffer = false;
+	this->m_ssbo_triangle_materials = 0;
+	this->m_fbo_visibility = 0;
+	this->m_fbo_visibility_texture = 0;
+	this->m_use_depth_prepass = true;
+	this->m_use_geometry_shader = false;
+	this->m_overdraw_query = 0;
+	this->m_overdraw_pending = false;
+	this->m_overdraw_query_prepass = false;
+	this->m_overdraw_report = true;
+	this->m_overdraw[0] = this->m_overdraw[1] = 0.f;
+	this->m_shader_watch_time = 0.f;
+	this->m_use_light_clusters = false;
+	this->m_light_cluster_texture = 0;
+	this->m_shadow_light_hash = 0;
+	this->m_caster_generation = 0;
+	this->m_shadow_caster_generation = 0;
+	this->m_shadow_valid = false;
+	this->m_shadow_update = SHADOW_FULL;
+	this->m_shadow_scissor = glm::ivec4(0);
 }
 
 Renderer::~Renderer()
 {
 	glDeleteTextures(1, &m_fbo_depth_texture);
-	glDeleteTextures(1, &m_fbo_pos_texture);
 	glDeleteTextures(1, &m_fbo_normal_texture);
 	glDeleteTextures(1, &m_fbo_albedo_texture);
 	glDeleteTextures(1, &m_fbo_mask_texture);
@@ -30,6 +73,22 @@ Renderer::~Renderer()
 
 	glDeleteVertexArrays(1, &m_vao_fbo);
 	glDeleteBuffers(1, &m_vbo_fbo_vertices);
+	glDeleteBuffers(1, &m_vbo_instances);
+	glDeleteBuffers(1, &m_ubo_frame);
+	glDeleteBuffers(1, &m_light_buffer);
+	glDeleteBuffers(1, &m_ubo_materials);
+	glDeleteBuffers(1, &m_indirect_buffer);
+	glDeleteBuffers(1, &m_ssbo_draw_materials);
+	glDeleteBuffers(1, &m_ssbo_materials);
+	glDeleteVertexArrays(1, &m_vao_box);
+	glDeleteBuffers(1, &m_vbo_box);
+	glDeleteBuffers(1, &m_ssbo_gpu_draw_materials);
+	glDeleteBuffers(1, &m_ssbo_triangle_materials);
+	glDeleteTextures(1, &m_fbo_visibility_texture);
+	glDeleteFramebuffers(1, &m_fbo_visibility);
+	glDeleteTextures(1, &m_light_cluster_texture);
+	glDeleteQueries(1, &m_overdraw_query);
+	for (auto& query : m_node_queries) glDeleteQueries(1, &query.query);
 }
 
 bool Renderer::Init(int SCREEN_WIDTH, int SCREEN_HEIGHT)
@@ -37,6 +96,33 @@ bool Renderer::Init(int SCREEN_WIDTH, int SCREEN_HEIGHT)
 	this->m_screen_width = SCREEN_WIDTH;
 	this->m_screen_height = SCREEN_HEIGHT;
 
+	// multi draw indirect needs the draw id and base instance in the vertex shader
+	this->m_use_indirect = GLEW_VERSION_4_3 && GLEW_ARB_shader_draw_parameters;
+	printf("multi draw indirect: %s\n", m_use_indirect ? "enabled" : "not supported");
+
+	// the culling pass writes the commands drawn by the indirect path
+	this->m_gpu_culling_supported = m_use_indirect && GLEW_ARB_compute_shader;
+	this->m_use_gpu_culling = m_gpu_culling_supported;
+	printf("gpu culling: %s\n", m_gpu_culling_supported ? "enabled" : "not supported");
+
+	// the lights are binned by a compute pass writing an image, without it every pixel loops over all of them
+	this->m_use_light_clusters = GLEW_VERSION_4_3 && GLEW_ARB_compute_shader;
+	printf("light clusters: %s\n", m_use_light_clusters ? "enabled" : "not supported");
+
+	// without storage buffers the lights have to fit a uniform block, 16 KB on the smallest drivers
+	if (!m_use_light_clusters)
+	{
+		GLint max_block_size = 0;
+		glGetIntegerv(GL_MAX_UNIFORM_BLOCK_SIZE, &max_block_size);
+		GLint fit = static_cast<GLint>((max_block_size - offsetof(LightUniforms, lights)) / sizeof(SpotLightUniforms));
+		m_max_spot_lights = std::min(static_cast<int>(fit), static_cast<int>(MAX_SPOT_LIGHTS));
+	}
+	printf("map lights: up to %d\n", m_max_spot_lights);
+
+	// reloads are compiled by driver threads and swapped in once they are done
+	if (GLEW_ARB_parallel_shader_compile) glMaxShaderCompilerThreadsARB(0xFFFFFFFF);
+	printf("parallel shader compile: %s\n", GLEW_ARB_parallel_shader_compile ? "enabled" : "not supported");
+
 	bool techniques_initialization = InitShaders();
 
 	bool meshes_initialization = InitGeometricMeshes();
@@ -44,6 +130,7 @@ bool Renderer::Init(int SCREEN_WIDTH, int SCREEN_HEIGHT)
 
 	bool common_initialization = InitCommonItems();
 	bool inter_buffers_initialization = InitIntermediateBuffers();
+	bool uniform_buffers_initialization = InitUniformBuffers();
 
 	//If there was any errors
 	if (Tools::CheckGLError() != GL_NO_ERROR)
@@ -56,7 +143,7 @@ bool Renderer::Init(int SCREEN_WIDTH, int SCREEN_HEIGHT)
 
 	//If everything initialized
 	return techniques_initialization && meshes_initialization &&
-		common_initialization && inter_buffers_initialization;
+		common_initialization && inter_buffers_initialization && uniform_buffers_initialization;
 }
 
 void Renderer::InitCamera()
@@ -82,9 +169,12 @@ bool Renderer::InitLights()
 	this->m_light.SetPosition(this->m_camera_position);
 	this->m_light.SetTarget(this->m_camera_target_position);
 	this->m_light.SetConeSize(150, 150);
+	// the projection is fitted to the visible receivers, a quarter of the texels cover them as well as the full cone did
+	this->m_light.SetShadowMapResolution(512);
 	this->m_light.CastShadow(true);
 
-	return true;
+	// the map lights were placed with the map, only their shadow tiles are left to hand out
+	return m_shadow_atlas.Init(SHADOW_ATLAS_SIZE, SHADOW_TILE_MIN);
 }
 
 bool Renderer::InitShaders()
@@ -94,16 +184,41 @@ bool Renderer::InitShaders()
 	std::string fragment_shader_path = "Assets/Shaders/geometry pass.frag";
 
 	m_geometry_program.LoadVertexShaderFromFile(vertex_shader_path.c_str());
-	m_geometry_program.LoadGeometryShaderFromFile(geometry_shader_path.c_str());
 	m_geometry_program.LoadFragmentShaderFromFile(fragment_shader_path.c_str());
 	m_geometry_program.CreateProgram();
-
-	vertex_shader_path = "Assets/Shaders/deferred pass.vert";
+	m_geometry_program.BindUniformBlock("FrameData", FRAME_BLOCK);
+	m_geometry_program.BindUniformBlock("MaterialData", MATERIAL_BLOCK);
+
+	// same pass with the triangles going through a geometry stage, only for comparison
+	m_geometry_gs_program.LoadVertexShaderFromFile(vertex_shader_path.c_str());
+	m_geometry_gs_program.LoadGeometryShaderFromFile(geometry_shader_path.c_str());
+	m_geometry_gs_program.LoadFragmentShaderFromFile(fragment_shader_path.c_str());
+	m_geometry_gs_program.CreateProgram();
+	m_geometry_gs_program.BindUniformBlock("FrameData", FRAME_BLOCK);
+	m_geometry_gs_program.BindUniformBlock("MaterialData", MATERIAL_BLOCK);
+	SetGeometrySamplers(m_geometry_program);
+	SetGeometrySamplers(m_geometry_gs_program);
+
+	// the vertex shader of the geometry pass keeps the depth equal, everything but the position is dropped at link time
+	vertex_shader_path = "Assets/Shaders/geometry pass.vert";
+	fragment_shader_path = "Assets/Shaders/depth prepass.frag";
+
+	m_depth_prepass_program.LoadVertexShaderFromFile(vertex_shader_path.c_str());
+	m_depth_prepass_program.LoadFragmentShaderFromFile(fragment_shader_path.c_str());
+	m_depth_prepass_program.CreateProgram();
+	m_depth_prepass_program.BindUniformBlock("FrameData", FRAME_BLOCK);
+
+	// the full screen quad and the light volume share the program
+	vertex_shader_path = "Assets/Shaders/light volume.vert";
 	fragment_shader_path = "Assets/Shaders/deferred pass.frag";
 
+	m_deferred_program.SetDefines(GetLightDefines());
 	m_deferred_program.LoadVertexShaderFromFile(vertex_shader_path.c_str());
 	m_deferred_program.LoadFragmentShaderFromFile(fragment_shader_path.c_str());
 	m_deferred_program.CreateProgram();
+	m_deferred_program.BindUniformBlock("FrameData", FRAME_BLOCK);
+	if (m_use_light_clusters) m_deferred_program.BindStorageBlock("LightData", LIGHT_STORAGE);
+	else m_deferred_program.BindUniformBlock("LightData", LIGHT_BLOCK);
 
 	vertex_shader_path = "Assets/Shaders/post_process.vert";
 	fragment_shader_path = "Assets/Shaders/post_process.frag";
@@ -118,14 +233,199 @@ bool Renderer::InitShaders()
 	m_spot_light_shadow_map_program.LoadVertexShaderFromFile(vertex_shader_path.c_str());
 	m_spot_light_shadow_map_program.LoadFragmentShaderFromFile(fragment_shader_path.c_str());
 	m_spot_light_shadow_map_program.CreateProgram();
+	m_spot_light_shadow_map_program.BindUniformBlock("FrameData", FRAME_BLOCK);
+
+	vertex_shader_path = "Assets/Shaders/deferred pass.vert";
+	fragment_shader_path = "Assets/Shaders/shadow moments.frag";
+
+	m_shadow_moments_program.LoadVertexShaderFromFile(vertex_shader_path.c_str());
+	m_shadow_moments_program.LoadFragmentShaderFromFile(fragment_shader_path.c_str());
+	m_shadow_moments_program.CreateProgram();
+
+	fragment_shader_path = "Assets/Shaders/shadow blur.frag";
+
+	m_shadow_blur_program.LoadVertexShaderFromFile(vertex_shader_path.c_str());
+	m_shadow_blur_program.LoadFragmentShaderFromFile(fragment_shader_path.c_str());
+	m_shadow_blur_program.CreateProgram();
+
+	vertex_shader_path = "Assets/Shaders/occlusion box.vert";
+	fragment_shader_path = "Assets/Shaders/occlusion box.frag";
+
+	m_occlusion_box_program.LoadVertexShaderFromFile(vertex_shader_path.c_str());
+	m_occlusion_box_program.LoadFragmentShaderFromFile(fragment_shader_path.c_str());
+	m_occlusion_box_program.CreateProgram();
+	m_occlusion_box_program.BindUniformBlock("FrameData", FRAME_BLOCK);
+
+	if (m_use_light_clusters)
+	{
+		m_light_cluster_program.SetDefines(GetLightDefines());
+		m_light_cluster_program.LoadComputeShaderFromFile("Assets/Shaders/light clusters.comp");
+		m_light_cluster_program.CreateProgram();
+		m_light_cluster_program.BindUniformBlock("FrameData", FRAME_BLOCK);
+		m_light_cluster_program.BindStorageBlock("LightData", LIGHT_STORAGE);
+	}
+
+	if (m_use_indirect)
+	{
+		vertex_shader_path = "Assets/Shaders/geometry pass mdi.vert";
+		fragment_shader_path = "Assets/Shaders/geometry pass mdi.frag";
+
+		m_geometry_indirect_program.LoadVertexShaderFromFile(vertex_shader_path.c_str());
+		m_geometry_indirect_program.LoadFragmentShaderFromFile(fragment_shader_path.c_str());
+		m_geometry_indirect_program.CreateProgram();
+		m_geometry_indirect_program.BindUniformBlock("FrameData", FRAME_BLOCK);
+
+		vertex_shader_path = "Assets/Shaders/shadow_map_rendering mdi.vert";
+		fragment_shader_path = "Assets/Shaders/shadow_map_rendering.frag";
+
+		m_shadow_indirect_program.LoadVertexShaderFromFile(vertex_shader_path.c_str());
+		m_shadow_indirect_program.LoadFragmentShaderFromFile(fragment_shader_path.c_str());
+		m_shadow_indirect_program.CreateProgram();
+		m_shadow_indirect_program.BindUniformBlock("FrameData", FRAME_BLOCK);
+	}
+
+	if (m_gpu_culling_supported)
+	{
+		vertex_shader_path = "Assets/Shaders/geometry pass gpu.vert";
+		fragment_shader_path = "Assets/Shaders/geometry pass mdi.frag";
+
+		m_geometry_gpu_program.LoadVertexShaderFromFile(vertex_shader_path.c_str());
+		m_geometry_gpu_program.LoadFragmentShaderFromFile(fragment_shader_path.c_str());
+		m_geometry_gpu_program.CreateProgram();
+		m_geometry_gpu_program.BindUniformBlock("FrameData", FRAME_BLOCK);
+
+		vertex_shader_path = "Assets/Shaders/geometry pass gpu.vert";
+		fragment_shader_path = "Assets/Shaders/depth prepass.frag";
+
+		m_depth_prepass_gpu_program.LoadVertexShaderFromFile(vertex_shader_path.c_str());
+		m_depth_prepass_gpu_program.LoadFragmentShaderFromFile(fragment_shader_path.c_str());
+		m_depth_prepass_gpu_program.CreateProgram();
+		m_depth_prepass_gpu_program.BindUniformBlock("FrameData", FRAME_BLOCK);
+
+		vertex_shader_path = "Assets/Shaders/shadow_map_rendering gpu.vert";
+		fragment_shader_path = "Assets/Shaders/shadow_map_rendering.frag";
+
+		m_shadow_gpu_program.LoadVertexShaderFromFile(vertex_shader_path.c_str());
+		m_shadow_gpu_program.LoadFragmentShaderFromFile(fragment_shader_path.c_str());
+		m_shadow_gpu_program.CreateProgram();
+		m_shadow_gpu_program.BindUniformBlock("FrameData", FRAME_BLOCK);
+
+		vertex_shader_path = "Assets/Shaders/visibility pass.vert";
+		fragment_shader_path = "Assets/Shaders/visibility pass.frag";
+
+		m_visibility_program.LoadVertexShaderFromFile(vertex_shader_path.c_str());
+		m_visibility_program.LoadFragmentShaderFromFile(fragment_shader_path.c_str());
+		m_visibility_program.CreateProgram();
+		m_visibility_program.BindUniformBlock("FrameData", FRAME_BLOCK);
+
+		vertex_shader_path = "Assets/Shaders/deferred pass.vert";
+		fragment_shader_path = "Assets/Shaders/visibility resolve.frag";
+
+		m_visibility_resolve_program.LoadVertexShaderFromFile(vertex_shader_path.c_str());
+		m_visibility_resolve_program.LoadFragmentShaderFromFile(fragment_shader_path.c_str());
+		m_visibility_resolve_program.CreateProgram();
+		m_visibility_resolve_program.BindUniformBlock("FrameData", FRAME_BLOCK);
+
+		m_gpu_culler.Init();
+	}
+
+	return true;
+}
+
+bool Renderer::InitUniformBuffers()
+{
+	glGenBuffers(1, &m_ubo_frame);
+	glBindBuffer(GL_UNIFORM_BUFFER, m_ubo_frame);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameUniforms), NULL, GL_DYNAMIC_DRAW);
+	glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_BLOCK, m_ubo_frame);
+
+	// the storage buffer is bound by the passes reading it, its binding point is shared
+	GLsizeiptr light_buffer_size = offsetof(LightUniforms, lights) + m_max_spot_lights * sizeof(SpotLightUniforms);
+	glGenBuffers(1, &m_light_buffer);
+	if (m_use_light_clusters)
+	{
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_light_buffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, light_buffer_size, NULL, GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	}
+	else
+	{
+		glBindBuffer(GL_UNIFORM_BUFFER, m_light_buffer);
+		glBufferData(GL_UNIFORM_BUFFER, light_buffer_size, NULL, GL_DYNAMIC_DRAW);
+		glBindBufferBase(GL_UNIFORM_BUFFER, LIGHT_BLOCK, m_light_buffer);
+	}
+
+	// every material starts at an offset the driver accepts for glBindBufferRange
+	GLint alignment = 256;
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+	m_material_stride = ((sizeof(MaterialUniforms) + alignment - 1) / alignment) * alignment;
+
+	std::vector<unsigned char> materials(std::max<size_t>(m_materials.size(), 1) * m_material_stride, 0);
+	std::vector<MaterialUniforms> packed_materials(std::max<size_t>(m_materials.size(), 1));
+	for (size_t i = 0; i < m_materials.size(); i++)
+	{
+		const GeometryNode::Objects& part = m_materials[i];
+		MaterialUniforms material;
+		material.diffuse = part.diffuse;
+		material.shininess = part.shininess;
+		material.ambient = part.ambient;
+		material.specular = part.specular;
+		material.has_tex_diffuse = (part.diffuse_textureID > 0) ? 1 : 0;
+		material.has_tex_mask = (part.mask_textureID > 0) ? 1 : 0;
+		material.has_tex_normal = (part.bump_textureID > 0 || part.normal_textureID > 0) ? 1 : 0;
+		material.has_tex_emissive = (part.emissive_textureID > 0) ? 1 : 0;
+		material.is_tex_bumb = (part.bump_textureID > 0) ? 1 : 0;
+		material.padding = 0;
+		memcpy(&materials[i * m_material_stride], &material, sizeof(MaterialUniforms));
+		packed_materials[i] = material;
+	}
+
+	glGenBuffers(1, &m_ubo_materials);
+	glBindBuffer(GL_UNIFORM_BUFFER, m_ubo_materials);
+	glBufferData(GL_UNIFORM_BUFFER, materials.size(), materials.data(), GL_STATIC_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+	if (m_use_indirect)
+	{
+		// the std430 layout of the material struct is the same as std140, no padding between them
+		glGenBuffers(1, &m_ssbo_materials);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_ssbo_materials);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, packed_materials.size() * sizeof(MaterialUniforms), packed_materials.data(), GL_STATIC_DRAW);
+
+		glGenBuffers(1, &m_ssbo_draw_materials);
+		glGenBuffers(1, &m_indirect_buffer);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	}
 
 	return true;
 }
 
+void Renderer::UpdateFrameUniforms()
+{
+	FrameUniforms frame;
+	frame.view_matrix = m_view_matrix;
+	frame.projection_matrix = m_projection_matrix;
+	frame.view_projection_matrix = m_projection_matrix * m_view_matrix;
+	frame.light_projection_view = m_shadow_projection_view;
+	frame.camera_pos = m_camera_position;
+	frame.time = m_continous_time;
+	frame.camera_dir = glm::normalize(m_camera_target_position - m_camera_position);
+	frame.cast_shadows = m_light.GetCastShadowsStatus() ? 1 : 0;
+	frame.light_pos = m_light.GetPosition();
+	frame.light_umbra = m_light.GetUmbra();
+	frame.light_dir = m_light.GetDirection();
+	frame.light_penumbra = m_light.GetPenumbra();
+	frame.light_color = m_light.GetColor();
+	frame.padding = 0.f;
+
+	glBindBuffer(GL_UNIFORM_BUFFER, m_ubo_frame);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameUniforms), &frame);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
 bool Renderer::InitIntermediateBuffers()
 {
 	glGenTextures(1, &m_fbo_depth_texture);
-	glGenTextures(1, &m_fbo_pos_texture);
 	glGenTextures(1, &m_fbo_normal_texture);
 	glGenTextures(1, &m_fbo_albedo_texture);
 	glGenTextures(1, &m_fbo_mask_texture);
@@ -133,6 +433,14 @@ bool Renderer::InitIntermediateBuffers()
 
 	glGenFramebuffers(1, &m_fbo);
 
+	if (m_use_light_clusters) glGenTextures(1, &m_light_cluster_texture);
+
+	if (m_gpu_culling_supported)
+	{
+		glGenTextures(1, &m_fbo_visibility_texture);
+		glGenFramebuffers(1, &m_fbo_visibility);
+	}
+
 	return ResizeBuffers(m_screen_width, m_screen_height);
 }
 
@@ -141,41 +449,37 @@ bool Renderer::ResizeBuffers(int width, int height)
 	m_screen_width = width;
 	m_screen_height = height;
 
-	// texture
+	// lit result, the positive half floats of R11G11B10F cover the HDR range at a quarter of RGBA32F
 	glBindTexture(GL_TEXTURE_2D, m_fbo_texture);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, m_screen_width, m_screen_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
-
-	glBindTexture(GL_TEXTURE_2D, m_fbo_pos_texture);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, m_screen_width, m_screen_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R11F_G11F_B10F, m_screen_width, m_screen_height, 0, GL_RGB, GL_FLOAT, NULL);
 
+	// octahedral normal and encoded gloss
 	glBindTexture(GL_TEXTURE_2D, m_fbo_normal_texture);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, m_screen_width, m_screen_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB10_A2, m_screen_width, m_screen_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
 
+	// albedo and metallic
 	glBindTexture(GL_TEXTURE_2D, m_fbo_albedo_texture);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, m_screen_width, m_screen_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, m_screen_width, m_screen_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
 
+	// emission and reflectance
 	glBindTexture(GL_TEXTURE_2D, m_fbo_mask_texture);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, m_screen_width, m_screen_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, m_screen_width, m_screen_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
 
 	glBindTexture(GL_TEXTURE_2D, m_fbo_depth_texture);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
@@ -184,9 +488,9 @@ bool Renderer::ResizeBuffers(int width, int height)
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, m_screen_width, m_screen_height, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
 
-	// framebuffer to link to everything together
+	// framebuffer to link to everything together, the position comes back from the depth
 	glBindFramebuffer(GL_FRAMEBUFFER, m_fbo);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_fbo_pos_texture, 0);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_fbo_texture, 0);
 	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, m_fbo_normal_texture, 0);
 	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, GL_TEXTURE_2D, m_fbo_albedo_texture, 0);
 	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT3, GL_TEXTURE_2D, m_fbo_mask_texture, 0);
@@ -198,6 +502,42 @@ bool Renderer::ResizeBuffers(int width, int height)
 		return false;
 	}
 
+	if (m_light_cluster_texture != 0)
+	{
+		// one column of MAX_CLUSTER_LIGHTS + 1 texels per slice of every tile, the last tiles may stick out of the screen
+		glBindTexture(GL_TEXTURE_3D, m_light_cluster_texture);
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAX_LEVEL, 0);
+		glTexImage3D(GL_TEXTURE_3D, 0, GL_R16UI,
+			(m_screen_width + LIGHT_TILE_SIZE - 1) / LIGHT_TILE_SIZE,
+			(m_screen_height + LIGHT_TILE_SIZE - 1) / LIGHT_TILE_SIZE,
+			LIGHT_SLICES * (MAX_CLUSTER_LIGHTS + 1), 0, GL_RED_INTEGER, GL_UNSIGNED_SHORT, NULL);
+		glBindTexture(GL_TEXTURE_3D, 0);
+	}
+
+	if (m_fbo_visibility != 0)
+	{
+		// ids are never filtered
+		glBindTexture(GL_TEXTURE_2D, m_fbo_visibility_texture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_R32UI, m_screen_width, m_screen_height, 0, GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
+
+		// the depth is shared, the lighting and the depth pyramid read it the same way in both paths
+		glBindFramebuffer(GL_FRAMEBUFFER, m_fbo_visibility);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_fbo_visibility_texture, 0);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, m_fbo_depth_texture, 0);
+
+		status = Tools::CheckFramebufferStatus(m_fbo_visibility);
+		if (status != GL_FRAMEBUFFER_COMPLETE)
+		{
+			return false;
+		}
+	}
+
 	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
 	return true;
@@ -222,6 +562,34 @@ bool Renderer::InitCommonItems()
 	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, 0);
 
 	glBindVertexArray(0);
+
+	// per frame instance data of the geometry and shadow passes
+	glGenBuffers(1, &m_vbo_instances);
+
+	// unit cube as 12 triangles, scaled to the node bounds for the occlusion queries
+	std::vector<glm::vec3> box_vertices;
+	const glm::vec3 corners[8] = {
+		glm::vec3(-1, -1, -1), glm::vec3(1, -1, -1), glm::vec3(1, 1, -1), glm::vec3(-1, 1, -1),
+		glm::vec3(-1, -1, 1), glm::vec3(1, -1, 1), glm::vec3(1, 1, 1), glm::vec3(-1, 1, 1) };
+	const int faces[6][4] = { { 0, 3, 2, 1 }, { 4, 5, 6, 7 }, { 0, 4, 7, 3 }, { 1, 2, 6, 5 }, { 0, 1, 5, 4 }, { 3, 7, 6, 2 } };
+	for (auto& face : faces)
+	{
+		const int triangles[6] = { face[0], face[1], face[2], face[0], face[2], face[3] };
+		for (int corner : triangles) box_vertices.push_back(corners[corner]);
+	}
+
+	glGenVertexArrays(1, &m_vao_box);
+	glBindVertexArray(m_vao_box);
+	glGenBuffers(1, &m_vbo_box);
+	glBindBuffer(GL_ARRAY_BUFFER, m_vbo_box);
+	glBufferData(GL_ARRAY_BUFFER, box_vertices.size() * sizeof(glm::vec3), box_vertices.data(), GL_STATIC_DRAW);
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	glGenQueries(1, &m_overdraw_query);
+
 	return true;
 }
 
@@ -266,6 +634,25 @@ bool Renderer::InitGeometricMeshes()
 	bool initialized = true;
 
 	BuildMap(initialized, mapAssets);
+	initialized = initialized && m_mesh_pool.Upload();
+	InitGeometryVariants();
+	BuildSceneBounds();
+	if (m_gpu_culling_supported)
+	{
+		BuildVisibilityTriangles();
+		BuildGpuCulling();
+	}
+
+	m_node_queries.resize(m_nodes.size());
+	for (auto& query : m_node_queries)
+	{
+		glGenQueries(1, &query.query);
+		query.pending = false;
+		query.visible = false;
+		query.last_frame = 0;
+	}
+
+	std::cout << "portal graph: " << m_portal_graph.GetCellCount() << " cells, " << m_portal_graph.GetPortalCount() << " portals" << std::endl;
 	std::cout << "geometry nodes length = " << this->m_nodes.size() << std::endl;
 	std::cout << "collidable nodes length = " << this->m_collidables_nodes.size() << std::endl;
 
@@ -276,18 +663,56 @@ void Renderer::Update(float dt)
 {
 	this->UpdateGeometry(dt);
 	this->UpdateCamera(dt);
+	this->UpdateShaders(dt);
 	m_continous_time += dt;
 }
 
 void Renderer::UpdateGeometry(float dt)
 {
-	for (auto& node : this->m_nodes)
+	glm::vec3 center, extent;
+	GpuCuller::Item item;
+	const GLsizei node_count = static_cast<GLsizei>(m_nodes.size());
+
+	for (size_t i = 0; i < m_nodes.size(); i++)
 	{
+		GeometryNode* node = m_nodes[i];
 		node->app_model_matrix = node->model_matrix;
+
+		if (node->m_bounds_dirty)
+		{
+			// the shadow map has to be rendered again where the caster was and where it is now
+			glm::vec3 old_min, old_max;
+			m_node_bvh.GetItemBounds(static_cast<uint32_t>(i), old_min, old_max);
+			GetWorldBounds(*node, center, extent);
+			m_shadow_dirty_bounds.push_back({ old_min, old_max });
+			m_shadow_dirty_bounds.push_back({ center - extent, center + extent });
+			m_caster_generation++;
+
+			m_node_bvh.Refit(static_cast<uint32_t>(i), center, extent);
+			if (m_gpu_culling_supported)
+			{
+				GetGpuCullItem(*node, GpuCuller::CASTS_SHADOW, item);
+				m_gpu_culler.UpdateItem(static_cast<GLsizei>(i), item);
+			}
+			node->m_bounds_dirty = false;
+		}
 	}
-	for (auto& node : this->m_collidables_nodes)
+	for (size_t i = 0; i < m_collidables_nodes.size(); i++)
 	{
+		CollidableNode* node = m_collidables_nodes[i];
 		node->app_model_matrix = node->model_matrix;
+
+		if (node->m_bounds_dirty)
+		{
+			GetWorldBounds(*node, center, extent);
+			m_collidable_bvh.Refit(static_cast<uint32_t>(i), center, extent);
+			if (m_gpu_culling_supported)
+			{
+				GetGpuCullItem(*node, 0, item);
+				m_gpu_culler.UpdateItem(node_count + static_cast<GLsizei>(i), item);
+			}
+			node->m_bounds_dirty = false;
+		}
 	}
 }
 
@@ -321,16 +746,121 @@ void Renderer::UpdateCamera(float dt)
 
 bool Renderer::ReloadShaders()
 {
-	m_geometry_program.ReloadProgram();
-	m_post_program.ReloadProgram();
-	m_deferred_program.ReloadProgram();
-	m_spot_light_shadow_map_program.ReloadProgram();
+	// the programs in use keep rendering until all their replacements link
+	m_reload_programs.clear();
+	CollectShaderPrograms(m_reload_programs);
+	BeginShaderReload();
 	return true;
 }
 
+void Renderer::CollectShaderPrograms(std::vector<ShaderProgram*>& programs)
+{
+	programs.push_back(&m_geometry_program);
+	programs.push_back(&m_geometry_gs_program);
+	for (auto& variant : m_geometry_variants) programs.push_back(&variant.second);
+	programs.push_back(&m_post_program);
+	programs.push_back(&m_deferred_program);
+	programs.push_back(&m_depth_prepass_program);
+	programs.push_back(&m_spot_light_shadow_map_program);
+	programs.push_back(&m_shadow_moments_program);
+	programs.push_back(&m_shadow_blur_program);
+	programs.push_back(&m_occlusion_box_program);
+	if (m_use_light_clusters) programs.push_back(&m_light_cluster_program);
+	if (m_use_indirect)
+	{
+		programs.push_back(&m_geometry_indirect_program);
+		programs.push_back(&m_shadow_indirect_program);
+	}
+	if (m_gpu_culling_supported)
+	{
+		programs.push_back(&m_geometry_gpu_program);
+		programs.push_back(&m_depth_prepass_gpu_program);
+		programs.push_back(&m_shadow_gpu_program);
+		programs.push_back(&m_visibility_program);
+		programs.push_back(&m_visibility_resolve_program);
+		m_gpu_culler.CollectShaderPrograms(programs);
+	}
+}
+
+void Renderer::UpdateShaders(float dt)
+{
+	if (!m_reload_programs.empty())
+	{
+		EndShaderReload();
+		return;
+	}
+
+	// a few stat calls, the programs reading the edited files under Assets/Shaders are reloaded together
+	m_shader_watch_time += dt;
+	if (m_shader_watch_time < SHADER_WATCH_INTERVAL) return;
+	m_shader_watch_time = 0.f;
+
+	// refilled on every check, the optional programs follow the current paths
+	m_shader_programs.clear();
+	CollectShaderPrograms(m_shader_programs);
+
+	for (auto program : m_shader_programs)
+	{
+		if (program->SourcesChanged()) m_reload_programs.push_back(program);
+	}
+	BeginShaderReload();
+}
+
+void Renderer::BeginShaderReload()
+{
+	bool started = true;
+	for (auto program : m_reload_programs)
+	{
+		if (!program->BeginReload()) started = false;
+	}
+	if (started) return;
+
+	// a file could not be read, none of the programs change
+	for (auto program : m_reload_programs) program->EndReload(false);
+	m_reload_programs.clear();
+}
+
+void Renderer::EndShaderReload()
+{
+	// programs sharing a stage, like the depth prepass and the geometry pass, must never mix old and new
+	for (auto program : m_reload_programs)
+	{
+		if (!program->IsReloadReady()) return;
+	}
+
+	// every log is printed before deciding
+	bool linked = true;
+	for (auto program : m_reload_programs)
+	{
+		if (!program->CheckReload()) linked = false;
+	}
+	for (auto program : m_reload_programs) program->EndReload(linked);
+	m_reload_programs.clear();
+
+	if (!linked)
+	{
+		printf("shader reload failed, the current programs stay in use\n");
+		return;
+	}
+
+	// the shadow shaders may have changed
+	m_shadow_valid = false;
+	for (auto& map_light : m_map_lights) map_light.shadow_valid = false;
+	// a new program starts with its samplers on unit 0
+	SetGeometrySamplers(m_geometry_program);
+	SetGeometrySamplers(m_geometry_gs_program);
+	for (auto& variant : m_geometry_variants) SetGeometrySamplers(variant.second);
+}
+
 void Renderer::Render()
 {
+	PrepareShadowMap();
+	UpdateFrameUniforms();
 	RenderShadowMaps();
+	UpdateShadowAtlas();
+	RenderShadowAtlas();
+	UpdateLightUniforms();
+	BuildLightClusters();
 	RenderGeometry();
 	RenderDeferredShading();
 	RenderPostProcess();
@@ -355,37 +885,33 @@ void Renderer::RenderPostProcess()
 
 	glActiveTexture(GL_TEXTURE0);
 	glBindTexture(GL_TEXTURE_2D, m_fbo_texture);
-	m_post_program.loadInt("uniform_texture", 0);
+	m_post_program.loadInt(Uniforms::texture, 0);
 
 	glActiveTexture(GL_TEXTURE1);
 	glBindTexture(GL_TEXTURE_2D, m_light.GetShadowMapDepthTexture());
-	m_post_program.loadInt("uniform_shadow_map", 1);
-
-	glActiveTexture(GL_TEXTURE2);
-	glBindTexture(GL_TEXTURE_2D, m_fbo_pos_texture);
-	m_post_program.loadInt("uniform_tex_pos", 2);
+	m_post_program.loadInt(Uniforms::shadow_map, 1);
 
 	glActiveTexture(GL_TEXTURE3);
 	glBindTexture(GL_TEXTURE_2D, m_fbo_normal_texture);
-	m_post_program.loadInt("uniform_tex_normal", 3);
+	m_post_program.loadInt(Uniforms::tex_normal, 3);
 
 	glActiveTexture(GL_TEXTURE4);
 	glBindTexture(GL_TEXTURE_2D, m_fbo_albedo_texture);
-	m_post_program.loadInt("uniform_tex_albedo", 4);
+	m_post_program.loadInt(Uniforms::tex_albedo, 4);
 
 	glActiveTexture(GL_TEXTURE5);
 	glBindTexture(GL_TEXTURE_2D, m_fbo_mask_texture);
-	m_post_program.loadInt("uniform_tex_mask", 5);
+	m_post_program.loadInt(Uniforms::tex_mask, 5);
 
 	glActiveTexture(GL_TEXTURE6);
 	glBindTexture(GL_TEXTURE_2D, m_fbo_depth_texture);
-	m_post_program.loadInt("uniform_tex_depth", 6);
+	m_post_program.loadInt(Uniforms::tex_depth, 6);
 
 	shoot_flag = m_continous_time - last_shoot < 0.15;
-	m_post_program.loadInt("shoot_flag", shoot_flag);
+	m_post_program.loadInt(Uniforms::shoot_flag, shoot_flag);
 
 	hit_flag = m_continous_time - last_hit < 0.15;
-	m_post_program.loadInt("hit_flag", hit_flag);
+	m_post_program.loadInt(Uniforms::hit_flag, hit_flag);
 
 	glBindVertexArray(m_vao_fbo);
 
@@ -398,302 +924,1721 @@ void Renderer::RenderPostProcess()
 	m_post_program.Unbind();
 }
 
-void Renderer::RenderStaticGeometry()
+void Renderer::BuildRenderQueue()
+{
+	glm::vec3 camera_dir = glm::normalize(m_camera_target_position - m_camera_position);
+
+	CullVisibleNodes();
+
+	// front to back, the instances of every batch keep this order
+	auto view_depth = [&](GeometryNode* node) { return glm::dot(node->m_aabb.center - m_camera_position, camera_dir); };
+	std::sort(m_visible_nodes.begin(), m_visible_nodes.end(),
+		[&](GeometryNode* a, GeometryNode* b) { return view_depth(a) < view_depth(b); });
+
+	std::array<float, MAP_ASSETS::SIZE_ALL> nearest;
+	nearest.fill(farPlane);
+	for (auto& node : m_visible_nodes)
+	{
+		nearest[node->GetType()] = std::min(nearest[node->GetType()], view_depth(node));
+	}
+
+	m_instance_data.clear();
+	BuildInstanceBatches(m_visible_nodes, m_instance_batches);
+
+	// every node waiting on its occlusion query is drawn on its own
+	m_uncertain_batches.clear();
+	for (uint32_t index : m_uncertain_nodes)
+	{
+		GeometryNode* node = m_nodes[index];
+		m_uncertain_batches.push_back({ m_asset_meshes[node->GetType()], node->GetType(), static_cast<GLint>(m_instance_data.size()), 1 });
+
+		glm::mat4 world = m_world_matrix * node->app_model_matrix;
+		InstanceData instance;
+		instance.world_matrix = world;
+		instance.normal_matrix = glm::transpose(glm::inverse(world));
+		m_instance_data.push_back(instance);
+	}
+
+	UploadInstanceData();
+
+	m_render_queue.Clear();
+	for (uint32_t i = 0; i < m_instance_batches.size(); i++)
+	{
+		const InstanceBatch& batch = m_instance_batches[i];
+		// the indirect path merges every run of draws sharing textures into one call,
+		// so there the depth buckets would only split the runs
+		float depth = m_use_indirect ? 0.f : nearest[batch.type] / farPlane;
+
+		for (uint32_t j = 0; j < batch.mesh->parts.size(); j++)
+		{
+			const GeometryNode::Objects& part = batch.mesh->parts[j];
+			// the program field groups the parts by geometry pass variant
+			int program = m_use_geometry_shader ? 0 : static_cast<int>(m_texture_sets[part.texture_set_id].features);
+			m_render_queue.Push(RenderQueue::MakeKey(RenderQueue::PASS_OPAQUE, program, part.texture_set_id, part.material_id, depth), i, j);
+		}
+	}
+
+	m_render_queue.Sort();
+}
+
+void Renderer::CullVisibleNodes()
+{
+	glm::mat4 view_projection = m_projection_matrix * m_view_matrix;
+	m_frustum_culler.ExtractPlanes(view_projection);
+	m_portal_graph.Update(m_camera_position, view_projection);
+
+	m_node_bvh.QueryFrustum(m_frustum_culler.GetPlanes(), m_candidate_nodes);
+	m_candidate_nodes.erase(std::remove_if(m_candidate_nodes.begin(), m_candidate_nodes.end(),
+		[&](uint32_t index) { return !m_portal_graph.IsItemVisible(index); }), m_candidate_nodes.end());
+
+	// hull i encases node i, its box is tested with the node's and the walls among them are the occluders
+	m_collidable_bvh.QueryFrustum(m_frustum_culler.GetPlanes(), m_candidate_hulls);
+	m_candidate_hulls.erase(std::remove_if(m_candidate_hulls.begin(), m_candidate_hulls.end(),
+		[&](uint32_t index) { return !m_portal_graph.IsItemVisible(index); }), m_candidate_hulls.end());
+
+	// the walls and corridor hulls left are the occluders, the thin props hide too little to pay for themselves
+	m_occlusion_buffer.Clear(view_projection);
+	for (uint32_t index : m_candidate_hulls)
+	{
+		CollidableNode* hull = m_collidables_nodes[index];
+		switch (hull->GetType())
+		{
+		case MAP_ASSETS::CH_CORRIDOR_FORK:
+		case MAP_ASSETS::CH_CORRIDOR_STRAIGHT:
+		case MAP_ASSETS::CH_CORRIDOR_LEFT:
+		case MAP_ASSETS::CH_CORRIDOR_RIGHT:
+		case MAP_ASSETS::CH_CORRIDOR_CURVE:
+		case MAP_ASSETS::CH_WALL:
+			m_occlusion_buffer.RasterizeTriangles(hull->GetTriangleVertices(), hull->GetTriangleCount() * 3, m_world_matrix * hull->app_model_matrix);
+			break;
+		default:
+			break;
+		}
+	}
+	m_occlusion_buffer.BuildHierarchy();
+
+	// node and hull are tested with the box around both, so a node is never hidden by its own hull
+	auto occluded = [&](uint32_t index)
+	{
+		glm::vec3 node_min, node_max, hull_min, hull_max;
+		m_node_bvh.GetItemBounds(index, node_min, node_max);
+		m_collidable_bvh.GetItemBounds(index, hull_min, hull_max);
+		return !m_occlusion_buffer.TestBox(glm::min(node_min, hull_min), glm::max(node_max, hull_max));
+	};
+
+	// the hardware queries decide between the nodes the CPU tests left, from results a frame old
+	ReadOcclusionQueries();
+	m_frame_index++;
+
+	m_visible_nodes.clear();
+	m_retest_nodes.clear();
+	m_uncertain_nodes.clear();
+	for (uint32_t index : m_candidate_nodes)
+	{
+		if (occluded(index)) continue;
+
+		OcclusionQuery& query = m_node_queries[index];
+		// a node that was not a candidate last frame has no recent result
+		bool known = query.visible && query.last_frame + 1 == m_frame_index;
+		query.last_frame = m_frame_index;
+
+		glm::vec3 min, max;
+		m_node_bvh.GetItemBounds(index, min, max);
+		// a box around the camera has its front faces clipped away, the query could miss it
+		bool around_camera = glm::all(glm::greaterThan(m_camera_position, min - glm::vec3(nearPlane * 2.f))) &&
+			glm::all(glm::lessThan(m_camera_position, max + glm::vec3(nearPlane * 2.f)));
+
+		if (around_camera || known || query.pending)
+		{
+			// visible last frame, drawn right away and tested again every few frames
+			query.visible = true;
+			m_visible_nodes.push_back(m_nodes[index]);
+			if (!around_camera && !query.pending && (m_frame_index + index) % OCCLUSION_RETEST_INTERVAL == 0)
+			{
+				m_retest_nodes.push_back(index);
+			}
+		}
+		else
+		{
+			m_uncertain_nodes.push_back(index);
+		}
+	}
+}
+
+void Renderer::ReadOcclusionQueries()
+{
+	for (auto& query : m_node_queries)
+	{
+		if (!query.pending) continue;
+
+		GLuint available = GL_FALSE;
+		glGetQueryObjectuiv(query.query, GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available) continue;
+
+		GLuint samples_passed = 0;
+		glGetQueryObjectuiv(query.query, GL_QUERY_RESULT, &samples_passed);
+		query.visible = samples_passed != 0;
+		query.pending = false;
+	}
+}
+
+void Renderer::RenderOcclusionQueries()
 {
-	glm::mat4 proj = m_projection_matrix * m_view_matrix * m_world_matrix;
+	if (m_retest_nodes.empty() && m_uncertain_nodes.empty()) return;
+
+	// the boxes are tested against the depth of everything drawn so far without touching it
+	m_occlusion_box_program.Bind();
+	glBindVertexArray(m_vao_box);
+	glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+	glDepthMask(GL_FALSE);
+	glDisable(GL_CULL_FACE);
 
+	auto issue = [&](uint32_t index)
+	{
+		glm::vec3 min, max;
+		m_node_bvh.GetItemBounds(index, min, max);
+		m_occlusion_box_program.loadVec3(Uniforms::box_center, (min + max) * 0.5f);
+		m_occlusion_box_program.loadVec3(Uniforms::box_extent, (max - min) * 0.5f);
+
+		OcclusionQuery& query = m_node_queries[index];
+		glBeginQuery(GL_ANY_SAMPLES_PASSED, query.query);
+		glDrawArrays(GL_TRIANGLES, 0, 36);
+		glEndQuery(GL_ANY_SAMPLES_PASSED);
+		query.pending = true;
+	};
+
+	for (uint32_t index : m_retest_nodes) issue(index);
+	for (uint32_t index : m_uncertain_nodes) issue(index);
+
+	glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+	glDepthMask(GL_TRUE);
+	glBindVertexArray(0);
+
+	// the nodes hidden last frame are drawn only if their box passed, the GPU waits
+	// for the result so nothing comes back to the CPU and nothing pops in a frame late
 	glEnable(GL_CULL_FACE);
 	glCullFace(GL_BACK);
 	glFrontFace(GL_CCW);
 
-	for (auto& node : this->m_nodes)
+	for (size_t i = 0; i < m_uncertain_nodes.size(); i++)
+	{
+		const InstanceBatch& batch = m_uncertain_batches[i];
+		if (batch.type == MAP_ASSETS::PIPE) glDisable(GL_CULL_FACE);
+
+		glBeginConditionalRender(m_node_queries[m_uncertain_nodes[i]].query, GL_QUERY_WAIT);
+		BindInstanceAttributes(batch.first_instance, m_mesh_pool.GetVAO());
+		for (auto& part : batch.mesh->parts)
+		{
+			const TextureSet& set = m_texture_sets[part.texture_set_id];
+			GetGeometryProgram(set.features).Bind();
+			glBindBufferRange(GL_UNIFORM_BUFFER, MATERIAL_BLOCK, m_ubo_materials, part.material_id * m_material_stride, sizeof(MaterialUniforms));
+			BindTextureSet(set);
+			glDrawArraysInstanced(GL_TRIANGLES, part.start_offset, part.count, 1);
+		}
+		glEndConditionalRender();
+
+		if (batch.type == MAP_ASSETS::PIPE) glEnable(GL_CULL_FACE);
+	}
+
+	glBindVertexArray(0);
+	glDisable(GL_CULL_FACE);
+}
+
+void Renderer::BuildSceneBounds()
+{
+	std::vector<glm::vec3> centers(m_nodes.size()), extents(m_nodes.size());
+	for (size_t i = 0; i < m_nodes.size(); i++)
+	{
+		GetWorldBounds(*m_nodes[i], centers[i], extents[i]);
+		m_nodes[i]->m_bounds_dirty = false;
+	}
+	m_node_bvh.Build(centers, extents);
+
+	// the corridor pieces are the cells, every node belongs to the cells its box overlaps.
+	// nodes only ever move out of the map, so the cells they belong to are not refit
+	m_portal_graph.Clear();
+	for (size_t i = 0; i < m_nodes.size(); i++)
+	{
+		switch (m_nodes[i]->GetType())
+		{
+		case MAP_ASSETS::CORRIDOR_FORK:
+		case MAP_ASSETS::CORRIDOR_STRAIGHT:
+		case MAP_ASSETS::CORRIDOR_LEFT:
+		case MAP_ASSETS::CORRIDOR_RIGHT:
+		case MAP_ASSETS::CORRIDOR_CURVE:
+			m_portal_graph.AddCell(centers[i] - extents[i], centers[i] + extents[i]);
+			break;
+		default:
+			break;
+		}
+	}
+	m_portal_graph.Connect(0.25f);
+	m_portal_graph.SetItems(centers, extents);
+
+	centers.resize(m_collidables_nodes.size());
+	extents.resize(m_collidables_nodes.size());
+	for (size_t i = 0; i < m_collidables_nodes.size(); i++)
+	{
+		GetWorldBounds(*m_collidables_nodes[i], centers[i], extents[i]);
+		m_collidables_nodes[i]->m_bounds_dirty = false;
+	}
+	m_collidable_bvh.Build(centers, extents);
+}
+
+void Renderer::GetWorldBounds(const GeometryNode& node, glm::vec3& center, glm::vec3& extent)
+{
+	FrustumCuller::TransformBox(node.m_aabb.min, node.m_aabb.max, m_world_matrix * node.model_matrix, center, extent);
+}
+
+void Renderer::SubmitRenderQueue()
+{
+	glCullFace(GL_BACK);
+	glFrontFace(GL_CCW);
+
+	// only touch the state that differs from the previous draw
+	int current_batch = -1;
+	int current_material = -1;
+	int current_texture_set = -1;
+	ShaderProgram* current_program = nullptr;
+
+	for (auto& item : m_render_queue.Items())
+	{
+		const InstanceBatch& batch = m_instance_batches[item.batch];
+		const GeometryNode::Objects& part = batch.mesh->parts[item.part];
+
+		if (static_cast<int>(item.batch) != current_batch)
+		{
+			if (batch.type == MAP_ASSETS::PIPE) // pipes disappear for some reason if you look at them from the back
+			{
+				glDisable(GL_CULL_FACE); // disabling back face culling doesn't seem to fix it
+			}
+			else
+			{
+				glEnable(GL_CULL_FACE);
+			}
+
+			BindInstanceAttributes(batch.first_instance, m_mesh_pool.GetVAO());
+			current_batch = item.batch;
+		}
+
+		if (part.material_id != current_material)
+		{
+			glBindBufferRange(GL_UNIFORM_BUFFER, MATERIAL_BLOCK, m_ubo_materials,
+				part.material_id * m_material_stride, sizeof(MaterialUniforms));
+			current_material = part.material_id;
+		}
+
+		if (part.texture_set_id != current_texture_set)
+		{
+			// the queue is sorted by variant, the program changes at most once per combination of textures
+			ShaderProgram& program = GetGeometryProgram(m_texture_sets[part.texture_set_id].features);
+			if (&program != current_program)
+			{
+				program.Bind();
+				current_program = &program;
+			}
+
+			BindTextureSet(m_texture_sets[part.texture_set_id]);
+			current_texture_set = part.texture_set_id;
+		}
+
+		glDrawArraysInstanced(GL_TRIANGLES, part.start_offset, part.count, batch.instance_count);
+	}
+
+	glBindVertexArray(0);
+	glDisable(GL_CULL_FACE);
+}
+
+void Renderer::SubmitRenderQueueIndirect()
+{
+	// one command per queue item, consecutive items with the same textures and
+	// raster state become a single glMultiDrawArraysIndirect
+	std::vector<DrawRun> runs;
+
+	m_draw_commands.clear();
+	m_draw_materials.clear();
+
+	for (auto& item : m_render_queue.Items())
+	{
+		const InstanceBatch& batch = m_instance_batches[item.batch];
+		const GeometryNode::Objects& part = batch.mesh->parts[item.part];
+
+		bool cull = (batch.type != MAP_ASSETS::PIPE);
+
+		if (runs.empty() || runs.back().cull != cull || runs.back().texture_set != part.texture_set_id)
+		{
+			runs.push_back({ cull, part.texture_set_id, static_cast<GLsizei>(m_draw_commands.size()), 0 });
+		}
+		runs.back().count++;
+
+		m_draw_commands.push_back({ part.count, static_cast<GLuint>(batch.instance_count), part.start_offset, static_cast<GLuint>(batch.first_instance) });
+		m_draw_materials.push_back(part.material_id);
+	}
+
+	if (m_draw_commands.empty()) return;
+
+	UploadIndirectCommands();
+
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_ssbo_draw_materials);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, m_draw_materials.size() * sizeof(GLuint), m_draw_materials.data(), GL_STREAM_DRAW);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, INSTANCE_STORAGE, m_vbo_instances);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, DRAW_STORAGE, m_ssbo_draw_materials);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, MATERIAL_STORAGE, m_ssbo_materials);
+
+	m_geometry_indirect_program.Bind();
+	m_geometry_indirect_program.loadInt(Uniforms::tex_diffuse, 0);
+	m_geometry_indirect_program.loadInt(Uniforms::tex_mask, 1);
+	m_geometry_indirect_program.loadInt(Uniforms::tex_normal, 2);
+	m_geometry_indirect_program.loadInt(Uniforms::tex_emissive, 3);
+
+	glCullFace(GL_BACK);
+	glFrontFace(GL_CCW);
+	glBindVertexArray(m_mesh_pool.GetVAO());
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, m_indirect_buffer);
+
+	for (auto& run : runs)
+	{
+		if (run.cull) glEnable(GL_CULL_FACE);
+		else glDisable(GL_CULL_FACE);
+
+		BindTextureSet(m_texture_sets[run.texture_set]);
+
+		// gl_DrawID restarts at zero for every call
+		m_geometry_indirect_program.loadInt(Uniforms::draw_offset, run.first);
+		glMultiDrawArraysIndirect(GL_TRIANGLES, (void*)(run.first * sizeof(DrawArraysCommand)), run.count, 0);
+	}
+
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	glBindVertexArray(0);
+	glDisable(GL_CULL_FACE);
+}
+
+void Renderer::GetGpuCullItem(GeometryNode& node, GLuint flags, GpuCuller::Item& item)
+{
+	glm::vec3 center, extent;
+	GetWorldBounds(node, center, extent);
+
+	item.world_matrix = m_world_matrix * node.model_matrix;
+	item.normal_matrix = glm::transpose(glm::inverse(item.world_matrix));
+	item.bounds_min = center - extent;
+	item.asset = static_cast<GLuint>(node.GetType());
+	item.bounds_max = center + extent;
+	item.flags = flags;
+}
+
+void Renderer::BuildGpuCulling()
+{
+	const GLsizei node_count = static_cast<GLsizei>(m_nodes.size());
+
+	std::vector<GpuCuller::Item> items(m_nodes.size() + m_collidables_nodes.size());
+	for (size_t i = 0; i < m_nodes.size(); i++)
+	{
+		GetGpuCullItem(*m_nodes[i], GpuCuller::CASTS_SHADOW, items[i]);
+	}
+	for (size_t i = 0; i < m_collidables_nodes.size(); i++)
+	{
+		GetGpuCullItem(*m_collidables_nodes[i], 0, items[node_count + i]);
+	}
+	m_gpu_culler.SetItems(items, node_count, MAP_ASSETS::SIZE_ALL);
+
+	if (m_visibility_supported && items.size() >= (VISIBILITY_EMPTY >> VISIBILITY_TRIANGLE_BITS))
+	{
+		printf("visibility buffer: %u items do not fit its ids\n", static_cast<unsigned int>(items.size()));
+		m_visibility_supported = false;
+		m_use_visibility_buffer = false;
+	}
+
+	// one command per part of every node asset still placed, in the order the render queue sorts them,
+	// the hulls only widen the occlusion boxes of their nodes
+	std::array<bool, MAP_ASSETS::SIZE_ALL> placed;
+	placed.fill(false);
+	for (auto& item : items) placed[item.asset] = true;
+
+	RenderQueue queue;
+	for (uint32_t i = 0; i < MAP_ASSETS::SIZE_ALL; i += 2)
+	{
+		if (!placed[i]) continue;
+
+		for (uint32_t j = 0; j < m_asset_meshes[i]->parts.size(); j++)
+		{
+			const GeometryNode::Objects& part = m_asset_meshes[i]->parts[j];
+			queue.Push(RenderQueue::MakeKey(RenderQueue::PASS_OPAQUE, 0, part.texture_set_id, part.material_id, 0.f), i, j);
+		}
+	}
+	queue.Sort();
+
+	std::vector<GpuCuller::DrawPart> parts;
+	std::vector<GpuCuller::DrawPart> shadow_parts;
+	std::vector<GLuint> draw_materials;
+	m_gpu_runs.clear();
+
+	for (auto& entry : queue.Items())
+	{
+		const GeometryNode::Objects& part = m_asset_meshes[entry.batch]->parts[entry.part];
+
+		bool cull = (entry.batch != MAP_ASSETS::PIPE);
+
+		if (m_gpu_runs.empty() || m_gpu_runs.back().cull != cull || m_gpu_runs.back().texture_set != part.texture_set_id)
+		{
+			m_gpu_runs.push_back({ cull, part.texture_set_id, static_cast<GLsizei>(parts.size()), 0 });
+		}
+		m_gpu_runs.back().count++;
+
+		parts.push_back({ static_cast<GLuint>(part.start_offset), static_cast<GLuint>(part.count), entry.batch });
+		draw_materials.push_back(part.material_id);
+	}
+
+	// the shadow pass has no materials, one command draws the whole mesh of every node asset
+	for (uint32_t i = 0; i < MAP_ASSETS::SIZE_ALL; i += 2)
+	{
+		if (!placed[i]) continue;
+		shadow_parts.push_back({ static_cast<GLuint>(m_asset_meshes[i]->m_first_vertex), static_cast<GLuint>(m_asset_meshes[i]->m_vertex_count), i });
+	}
+
+	m_gpu_culler.SetCommands(GpuCuller::CAMERA_VIEW, parts);
+	m_gpu_culler.SetCommands(GpuCuller::LIGHT_VIEW, shadow_parts);
+
+	if (m_ssbo_gpu_draw_materials == 0) glGenBuffers(1, &m_ssbo_gpu_draw_materials);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_ssbo_gpu_draw_materials);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, std::max<size_t>(draw_materials.size(), 1) * sizeof(GLuint), draw_materials.data(), GL_STATIC_DRAW);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	// the last depth may still hold nodes that are gone
+	m_gpu_culler.InvalidateDepthPyramid();
+}
+
+void Renderer::SubmitGpuCulledGeometry()
+{
+	m_gpu_culler.Bind(GpuCuller::CAMERA_VIEW);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, DRAW_STORAGE, m_ssbo_gpu_draw_materials);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, MATERIAL_STORAGE, m_ssbo_materials);
+
+	m_geometry_gpu_program.Bind();
+	m_geometry_gpu_program.loadInt(Uniforms::tex_diffuse, 0);
+	m_geometry_gpu_program.loadInt(Uniforms::tex_mask, 1);
+	m_geometry_gpu_program.loadInt(Uniforms::tex_normal, 2);
+	m_geometry_gpu_program.loadInt(Uniforms::tex_emissive, 3);
+
+	glCullFace(GL_BACK);
+	glFrontFace(GL_CCW);
+	glBindVertexArray(m_mesh_pool.GetVAO());
+
+	// the commands of hidden assets are still issued, with no instances
+	for (auto& run : m_gpu_runs)
+	{
+		if (run.cull) glEnable(GL_CULL_FACE);
+		else glDisable(GL_CULL_FACE);
+
+		BindTextureSet(m_texture_sets[run.texture_set]);
+
+		m_geometry_gpu_program.loadInt(Uniforms::draw_offset, run.first);
+		glMultiDrawArraysIndirect(GL_TRIANGLES, (void*)(run.first * sizeof(DrawArraysCommand)), run.count, 0);
+	}
+
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	glBindVertexArray(0);
+	glDisable(GL_CULL_FACE);
+}
+
+void Renderer::BuildVisibilityTriangles()
+{
+	GLuint triangle_count = static_cast<GLuint>(m_mesh_pool.GetVertexCount() / 3);
+	if (triangle_count > (1u << VISIBILITY_TRIANGLE_BITS))
+	{
+		printf("visibility buffer: %u triangles do not fit its ids\n", triangle_count);
+		m_visibility_supported = false;
+		return;
+	}
+
+	// the resolve finds the material and textures of a pixel from its triangle alone
+	std::vector<GLuint> triangle_materials(std::max<GLuint>(triangle_count, 1), 0);
+	for (auto mesh : m_asset_meshes)
+	{
+		if (mesh == nullptr) continue;
+		for (auto& part : mesh->parts)
+		{
+			GLuint value = static_cast<GLuint>(part.material_id) | (static_cast<GLuint>(part.texture_set_id) << 16);
+			for (unsigned int i = part.start_offset / 3; i < (part.start_offset + part.count) / 3; i++)
+			{
+				triangle_materials[i] = value;
+			}
+		}
+	}
+
+	if (m_ssbo_triangle_materials == 0) glGenBuffers(1, &m_ssbo_triangle_materials);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_ssbo_triangle_materials);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, triangle_materials.size() * sizeof(GLuint), triangle_materials.data(), GL_STATIC_DRAW);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	m_visibility_supported = true;
+}
+
+void Renderer::RenderVisibilityBuffer()
+{
+	m_frustum_culler.ExtractPlanes(m_projection_matrix * m_view_matrix);
+	m_gpu_culler.Cull(GpuCuller::CAMERA_VIEW, m_frustum_culler.GetPlanes(), 0, m_use_depth_pyramid);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, m_fbo_visibility);
+	glViewport(0, 0, m_screen_width, m_screen_height);
+	glClearDepth(1.f);
+	glDepthFunc(GL_LEQUAL);
+	glDepthMask(GL_TRUE);
+	glEnable(GL_DEPTH_TEST);
+
+	const GLuint empty[4] = { VISIBILITY_EMPTY, 0, 0, 0 };
+	glClearBufferuiv(GL_COLOR, 0, empty);
+	glClear(GL_DEPTH_BUFFER_BIT);
+
+	m_gpu_culler.Bind(GpuCuller::CAMERA_VIEW);
+	m_visibility_program.Bind();
+
+	glCullFace(GL_BACK);
+	glFrontFace(GL_CCW);
+	glBindVertexArray(m_mesh_pool.GetPositionsVAO());
+
+	// same commands as the G-buffer path, without textures nothing but the raster state tells the runs apart
+	for (auto& run : m_gpu_runs)
+	{
+		if (run.cull) glEnable(GL_CULL_FACE);
+		else glDisable(GL_CULL_FACE);
+
+		glMultiDrawArraysIndirect(GL_TRIANGLES, (void*)(run.first * sizeof(DrawArraysCommand)), run.count, 0);
+	}
+
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	glBindVertexArray(0);
+	glDisable(GL_CULL_FACE);
+	m_visibility_program.Unbind();
+}
+
+void Renderer::ResolveVisibilityBuffer()
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, m_fbo);
+
+	GLenum drawbuffers[4] = {
+		GL_NONE,
+		GL_COLOR_ATTACHMENT1,
+		GL_COLOR_ATTACHMENT2,
+		GL_COLOR_ATTACHMENT3 };
+
+	glDrawBuffers(4, drawbuffers);
+	glDisable(GL_DEPTH_TEST);
+	glDepthMask(GL_FALSE);
+
+	// the ids name the items directly, the visible list is not needed here
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, GpuCuller::ITEM_STORAGE, m_gpu_culler.GetItemBuffer());
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, TRIANGLE_STORAGE, m_ssbo_triangle_materials);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, MATERIAL_STORAGE, m_ssbo_materials);
+	m_mesh_pool.BindStorageBuffers(VERTEX_STORAGE);
+
+	m_visibility_resolve_program.Bind();
+	m_visibility_resolve_program.loadInt(Uniforms::tex_diffuse, 0);
+	m_visibility_resolve_program.loadInt(Uniforms::tex_mask, 1);
+	m_visibility_resolve_program.loadInt(Uniforms::tex_normal, 2);
+	m_visibility_resolve_program.loadInt(Uniforms::tex_emissive, 3);
+
+	glActiveTexture(GL_TEXTURE4);
+	glBindTexture(GL_TEXTURE_2D, m_fbo_visibility_texture);
+	m_visibility_resolve_program.loadInt(Uniforms::visibility, 4);
+
+	glBindVertexArray(m_vao_fbo);
+
+	// without bindless textures a pass covers the pixels of one texture set, the others are
+	// discarded after reading their id, so every pixel is still shaded once
+	std::vector<bool> resolved(m_texture_sets.size(), false);
+	for (auto& run : m_gpu_runs)
+	{
+		if (resolved[run.texture_set]) continue;
+		resolved[run.texture_set] = true;
+
+		BindTextureSet(m_texture_sets[run.texture_set]);
+		m_visibility_resolve_program.loadInt(Uniforms::texture_set, run.texture_set);
+		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	}
+
+	glBindVertexArray(0);
+	glActiveTexture(GL_TEXTURE4);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glActiveTexture(GL_TEXTURE0);
+	m_visibility_resolve_program.Unbind();
+}
+
+void Renderer::UploadIndirectCommands()
+{
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, m_indirect_buffer);
+	glBufferData(GL_DRAW_INDIRECT_BUFFER, m_draw_commands.size() * sizeof(DrawArraysCommand), m_draw_commands.data(), GL_STREAM_DRAW);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
+
+void Renderer::BindTextureSet(const TextureSet& set)
+{
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, set.diffuse);
+
+	if (set.mask > 0)
+	{
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, set.mask);
+	}
+
+	if (set.normal > 0)
+	{
+		glActiveTexture(GL_TEXTURE2);
+		glBindTexture(GL_TEXTURE_2D, set.normal);
+	}
+
+	if (set.emissive > 0)
+	{
+		glActiveTexture(GL_TEXTURE3);
+		glBindTexture(GL_TEXTURE_2D, set.emissive);
+	}
+}
+
+void Renderer::RegisterMaterials(GeometryNode& node)
+{
+	for (auto& part : node.parts)
+	{
+		TextureSet set = {
+			part.diffuse_textureID,
+			part.mask_textureID,
+			part.bump_textureID > 0 ? part.bump_textureID : part.normal_textureID,
+			part.emissive_textureID,
+			0 };
+		if (set.diffuse > 0) set.features |= FEATURE_TEX_DIFFUSE;
+		if (set.mask > 0) set.features |= FEATURE_TEX_MASK;
+		if (set.normal > 0) set.features |= FEATURE_TEX_NORMAL;
+		if (set.emissive > 0) set.features |= FEATURE_TEX_EMISSIVE;
+
+		auto same_set = [&](const TextureSet& other) {
+			return other.diffuse == set.diffuse && other.mask == set.mask &&
+				other.normal == set.normal && other.emissive == set.emissive;
+		};
+		auto it_set = std::find_if(m_texture_sets.begin(), m_texture_sets.end(), same_set);
+		part.texture_set_id = static_cast<int>(it_set - m_texture_sets.begin());
+		if (it_set == m_texture_sets.end()) m_texture_sets.push_back(set);
+
+		// the shader only sees the colors and which textures exist
+		auto same_material = [&](const GeometryNode::Objects& other) {
+			return other.diffuse == part.diffuse && other.ambient == part.ambient &&
+				other.specular == part.specular && other.shininess == part.shininess &&
+				(other.diffuse_textureID > 0) == (part.diffuse_textureID > 0) &&
+				(other.mask_textureID > 0) == (part.mask_textureID > 0) &&
+				(other.emissive_textureID > 0) == (part.emissive_textureID > 0) &&
+				(other.normal_textureID > 0) == (part.normal_textureID > 0) &&
+				(other.bump_textureID > 0) == (part.bump_textureID > 0);
+		};
+		auto it_material = std::find_if(m_materials.begin(), m_materials.end(), same_material);
+		part.material_id = static_cast<int>(it_material - m_materials.begin());
+		if (it_material == m_materials.end()) m_materials.push_back(part);
+	}
+}
+
+void Renderer::InitGeometryVariants()
+{
+	static const char* feature_names[FEATURE_COUNT] = { "HAS_TEX_DIFFUSE", "HAS_TEX_MASK", "HAS_TEX_NORMAL", "HAS_TEX_EMISSIVE" };
+
+	// only the combinations some loaded part uses
+	for (auto& set : m_texture_sets)
+	{
+		if (m_geometry_variants.count(set.features)) continue;
+
+		std::string defines;
+		for (int i = 0; i < FEATURE_COUNT; i++)
+		{
+			defines += std::string("#define ") + feature_names[i] + ((set.features & (1 << i)) ? " true\n" : " false\n");
+		}
+
+		ShaderProgram& program = m_geometry_variants[set.features];
+		program.SetDefines(defines);
+		program.LoadVertexShaderFromFile("Assets/Shaders/geometry pass.vert");
+		program.LoadFragmentShaderFromFile("Assets/Shaders/geometry pass.frag");
+		program.CreateProgram();
+		program.BindUniformBlock("FrameData", FRAME_BLOCK);
+		program.BindUniformBlock("MaterialData", MATERIAL_BLOCK);
+		SetGeometrySamplers(program);
+	}
+
+	printf("geometry pass: %u material variants\n", static_cast<unsigned int>(m_geometry_variants.size()));
+}
+
+void Renderer::SetGeometrySamplers(ShaderProgram& program)
+{
+	// kept by the program until it is linked again
+	program.Bind();
+	program.loadInt(Uniforms::prim_id, -1);
+	program.loadInt(Uniforms::tex_diffuse, 0);
+	program.loadInt(Uniforms::tex_mask, 1);
+	program.loadInt(Uniforms::tex_normal, 2);
+	program.loadInt(Uniforms::tex_emissive, 3);
+	program.Unbind();
+}
+
+ShaderProgram& Renderer::GetGeometryProgram(GLuint features)
+{
+	// the geometry shader program is only there for comparison and keeps the branches
+	if (m_use_geometry_shader) return m_geometry_gs_program;
+
+	auto it = m_geometry_variants.find(features);
+	return (it != m_geometry_variants.end()) ? it->second : m_geometry_program;
+}
+
+void Renderer::BuildInstanceBatches(const std::vector<GeometryNode*>& nodes, std::vector<InstanceBatch>& batches)
+{
+	// the batches go after the instances already collected this pass
+	const GLint base = static_cast<GLint>(m_instance_data.size());
+
+	// count the instances of every asset, then scatter the nodes so each asset is contiguous
+	std::array<GLint, MAP_ASSETS::SIZE_ALL + 1> first = {};
+	first[0] = base;
+	for (auto& node : nodes)
+	{
+		first[node->GetType() + 1]++;
+	}
+	for (int i = 0; i < MAP_ASSETS::SIZE_ALL; i++)
+	{
+		first[i + 1] += first[i];
+	}
+
+	batches.clear();
+	for (int i = 0; i < MAP_ASSETS::SIZE_ALL; i++)
+	{
+		if (first[i + 1] == first[i]) continue;
+		batches.push_back({ m_asset_meshes[i], i, first[i], first[i + 1] - first[i] });
+	}
+
+	m_instance_data.resize(base + nodes.size());
+	for (auto& node : nodes)
+	{
+		glm::mat4 world = m_world_matrix * node->app_model_matrix;
+		InstanceData& instance = m_instance_data[first[node->GetType()]++];
+		instance.world_matrix = world;
+		instance.normal_matrix = glm::transpose(glm::inverse(world));
+	}
+}
+
+void Renderer::UploadInstanceData()
+{
+	GLsizeiptr size = m_instance_data.size() * sizeof(InstanceData);
+	if (size == 0) return;
+
+	glBindBuffer(GL_ARRAY_BUFFER, m_vbo_instances);
+	if (size > m_instance_buffer_size)
+	{
+		m_instance_buffer_size = size;
+	}
+	// orphan the previous contents so the driver does not wait for draws still reading them
+	glBufferData(GL_ARRAY_BUFFER, m_instance_buffer_size, NULL, GL_STREAM_DRAW);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, size, m_instance_data.data());
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void Renderer::BindInstanceAttributes(GLint first_instance, GLuint vao)
+{
+	glBindVertexArray(vao);
+	glBindBuffer(GL_ARRAY_BUFFER, m_vbo_instances);
+
+	const GLsizei stride = sizeof(InstanceData);
+	const size_t offset = first_instance * sizeof(InstanceData);
+
+	// a mat4 attribute takes four consecutive locations, one per column
+	for (int i = 0; i < 4; i++)
+	{
+		glEnableVertexAttribArray(5 + i);
+		glVertexAttribPointer(5 + i, 4, GL_FLOAT, GL_FALSE, stride,
+			(void*)(offset + offsetof(InstanceData, world_matrix) + i * sizeof(glm::vec4)));
+		glVertexAttribDivisor(5 + i, 1);
+
+		glEnableVertexAttribArray(9 + i);
+		glVertexAttribPointer(9 + i, 4, GL_FLOAT, GL_FALSE, stride,
+			(void*)(offset + offsetof(InstanceData, normal_matrix) + i * sizeof(glm::vec4)));
+		glVertexAttribDivisor(9 + i, 1);
+	}
+
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void Renderer::RenderDeferredShading()
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, m_fbo);
+
+	GLenum drawbuffers[1] = { GL_COLOR_ATTACHMENT0 };
+
+	glDrawBuffers(1, drawbuffers);
+
+	glViewport(0, 0, m_screen_width, m_screen_height);
+
+	glDisable(GL_DEPTH_TEST);
+	glDepthMask(GL_FALSE);
+
+	glClear(GL_COLOR_BUFFER_BIT);
+
+	m_deferred_program.Bind();
+	if (m_use_light_clusters) glBindBufferBase(GL_SHADER_STORAGE_BUFFER, LIGHT_STORAGE, m_light_buffer);
+
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, m_fbo_normal_texture);
+	m_deferred_program.loadInt(Uniforms::tex_normal, 1);
+
+	glActiveTexture(GL_TEXTURE2);
+	glBindTexture(GL_TEXTURE_2D, m_fbo_albedo_texture);
+	m_deferred_program.loadInt(Uniforms::tex_albedo, 2);
+
+	glActiveTexture(GL_TEXTURE3);
+	glBindTexture(GL_TEXTURE_2D, m_fbo_mask_texture);
+	m_deferred_program.loadInt(Uniforms::tex_mask, 3);
+
+	glActiveTexture(GL_TEXTURE4);
+	glBindTexture(GL_TEXTURE_2D, m_fbo_depth_texture);
+	m_deferred_program.loadInt(Uniforms::tex_depth, 4);
+	m_deferred_program.loadMat4(Uniforms::inverse_view_projection, glm::inverse(m_projection_matrix * m_view_matrix));
+
+	glActiveTexture(GL_TEXTURE10);
+	glBindTexture(GL_TEXTURE_2D, m_light.GetShadowMapDepthTexture());
+	m_deferred_program.loadInt(Uniforms::shadow_map, 10);
+
+	glActiveTexture(GL_TEXTURE12);
+	glBindTexture(GL_TEXTURE_2D, m_shadow_atlas.GetTexture());
+	m_deferred_program.loadInt(Uniforms::shadow_atlas, 12);
+
+	glActiveTexture(GL_TEXTURE11);
+	glBindTexture(GL_TEXTURE_2D, m_light.GetShadowMomentsTexture(1));
+	m_deferred_program.loadInt(Uniforms::shadow_moments, 11);
+	m_deferred_program.loadInt(Uniforms::shadow_filter, m_light.GetShadowFilter());
+	m_deferred_program.loadFloat(Uniforms::light_far, m_light.GetRange());
+	m_deferred_program.loadFloat(Uniforms::shadow_exponent, LightNode::EVSM_EXPONENT);
+
+	m_deferred_program.loadInt(Uniforms::light_clusters, m_use_light_clusters ? 1 : 0);
+	// set even when unused, an unsigned sampler must not share unit 0 with the float ones
+	m_deferred_program.loadInt(Uniforms::light_clusters_texture, 13);
+	if (m_use_light_clusters)
+	{
+		glActiveTexture(GL_TEXTURE13);
+		glBindTexture(GL_TEXTURE_3D, m_light_cluster_texture);
+		m_deferred_program.loadVec2(Uniforms::cluster_depth, glm::vec2(nearPlane, farPlane));
+	}
+
+	// the map lights are spread over the whole screen, the clusters bound them
+	m_deferred_program.loadInt(Uniforms::light_pass, 0);
+	m_deferred_program.loadMat4(Uniforms::light_volume, glm::mat4(1.f));
+	glBindVertexArray(m_vao_fbo);
+	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+
+	// the main light is added where its shadow frustum covers the screen, its shadow is zero outside,
+	// a light without shadow has no far plane and still takes the quad
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_ONE, GL_ONE);
+	m_deferred_program.loadInt(Uniforms::light_pass, 1);
+	if (m_light.GetCastShadowsStatus())
+	{
+		// the box of the light clip space taken to the camera clip space, only its far side is drawn so the
+		// pixels are shaded once even with the camera inside, and the depth clamp keeps it past the far plane
+		glm::mat4 light_projection_view = m_light.GetProjectionMatrix() * m_light.GetViewMatrix();
+		m_deferred_program.loadMat4(Uniforms::light_volume, m_projection_matrix * m_view_matrix * glm::inverse(light_projection_view));
+
+		glEnable(GL_CULL_FACE);
+		glCullFace(GL_BACK);
+		glFrontFace(GL_CCW);
+		glEnable(GL_DEPTH_CLAMP);
+		glBindVertexArray(m_vao_box);
+		glDrawArrays(GL_TRIANGLES, 0, 36);
+		glDisable(GL_DEPTH_CLAMP);
+		glDisable(GL_CULL_FACE);
+	}
+	else
+	{
+		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	}
+	glDisable(GL_BLEND);
+	glBindVertexArray(0);
+
+	m_deferred_program.Unbind();
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glDepthMask(GL_TRUE);
+}
+
+void Renderer::RenderGeometry()
+{
+	if (m_use_visibility_buffer && m_use_gpu_culling)
+	{
+		// ids and depth first, the G-buffer is written once per pixel from them
+		RenderVisibilityBuffer();
+		ResolveVisibilityBuffer();
+	}
+	else
+	{
+		glBindFramebuffer(GL_FRAMEBUFFER, m_fbo);
+
+		// the lit target stays untouched until the deferred pass
+		GLenum drawbuffers[4] = {
+			GL_NONE,
+			GL_COLOR_ATTACHMENT1,
+			GL_COLOR_ATTACHMENT2,
+			GL_COLOR_ATTACHMENT3 };
+
+		glDrawBuffers(4, drawbuffers);
+
+		glViewport(0, 0, m_screen_width, m_screen_height);
+		glClearColor(0.f, 0.8f, 1.f, 1.f);
+		glClearDepth(1.f);
+		glDepthFunc(GL_LEQUAL);
+		glDepthMask(GL_TRUE);
+		glEnable(GL_DEPTH_TEST);
+
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+		if (m_use_gpu_culling)
+		{
+			m_frustum_culler.ExtractPlanes(m_projection_matrix * m_view_matrix);
+			m_gpu_culler.Cull(GpuCuller::CAMERA_VIEW, m_frustum_culler.GetPlanes(), 0, m_use_depth_pyramid);
+		}
+		else
+		{
+			BuildRenderQueue();
+		}
+
+		if (m_use_depth_prepass)
+		{
+			RenderDepthPrepass();
+
+			// every pixel is written once, by the surface that is left in the depth buffer
+			glDepthFunc(GL_EQUAL);
+			glDepthMask(GL_FALSE);
+		}
+
+		ReadOverdrawQuery();
+		if (!m_overdraw_pending)
+		{
+			glBeginQuery(GL_SAMPLES_PASSED, m_overdraw_query);
+			m_overdraw_query_prepass = m_use_depth_prepass;
+		}
+
+		if (m_use_gpu_culling)
+		{
+			SubmitGpuCulledGeometry();
+		}
+		else
+		{
+			if (m_use_indirect) SubmitRenderQueueIndirect();
+			else SubmitRenderQueue();
+		}
+
+		if (!m_overdraw_pending)
+		{
+			glEndQuery(GL_SAMPLES_PASSED);
+			m_overdraw_pending = true;
+		}
+
+		// the nodes under conditional rendering are not in the prepass
+		glDepthFunc(GL_LEQUAL);
+		glDepthMask(GL_TRUE);
+		if (!m_use_gpu_culling) RenderOcclusionQueries();
+
+		m_geometry_program.Unbind();
+	}
+
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glDisable(GL_DEPTH_TEST);
+	glDepthMask(GL_FALSE);
+
+	// the next frame tests its nodes against this depth
+	if (m_use_gpu_culling && m_use_depth_pyramid)
+	{
+		m_gpu_culler.BuildDepthPyramid(m_fbo_depth_texture, m_screen_width, m_screen_height, m_projection_matrix * m_view_matrix);
+	}
+}
+
+void Renderer::RenderDepthPrepass()
+{
+	// the attachments keep their clear color until the G-buffer pass
+	glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+	glCullFace(GL_BACK);
+	glFrontFace(GL_CCW);
+
+	if (m_use_gpu_culling)
+	{
+		m_gpu_culler.Bind(GpuCuller::CAMERA_VIEW);
+		m_depth_prepass_gpu_program.Bind();
+		glBindVertexArray(m_mesh_pool.GetPositionsVAO());
+
+		// the same runs as the G-buffer pass, only the raster state tells them apart
+		for (auto& run : m_gpu_runs)
+		{
+			if (run.cull) glEnable(GL_CULL_FACE);
+			else glDisable(GL_CULL_FACE);
+
+			glMultiDrawArraysIndirect(GL_TRIANGLES, (void*)(run.first * sizeof(DrawArraysCommand)), run.count, 0);
+		}
+
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+		m_depth_prepass_gpu_program.Unbind();
+	}
+	else
+	{
+		m_depth_prepass_program.Bind();
+		m_depth_prepass_program.loadInt(Uniforms::prim_id, -1);
+
+		// one draw per batch, the parts of a mesh are contiguous in the pool and the batches are already front to back
+		for (auto& batch : m_instance_batches)
+		{
+			if (batch.type != MAP_ASSETS::PIPE) glEnable(GL_CULL_FACE);
+			else glDisable(GL_CULL_FACE);
+
+			BindInstanceAttributes(batch.first_instance, m_mesh_pool.GetPositionsVAO());
+			glDrawArraysInstanced(GL_TRIANGLES, batch.mesh->m_first_vertex, batch.mesh->m_vertex_count, batch.instance_count);
+		}
+
+		m_depth_prepass_program.Unbind();
+	}
+
+	glBindVertexArray(0);
+	glDisable(GL_CULL_FACE);
+	glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+}
+
+void Renderer::ReadOverdrawQuery()
+{
+	if (!m_overdraw_pending) return;
+
+	// never waits, the query of a frame still in flight is left for the next one
+	GLuint available = 0;
+	glGetQueryObjectuiv(m_overdraw_query, GL_QUERY_RESULT_AVAILABLE, &available);
+	if (!available) return;
+
+	GLuint samples = 0;
+	glGetQueryObjectuiv(m_overdraw_query, GL_QUERY_RESULT, &samples);
+	m_overdraw_pending = false;
+
+	int mode = m_overdraw_query_prepass ? 1 : 0;
+	m_overdraw[mode] = samples / float(m_screen_width * m_screen_height);
+	// the query in flight at a toggle still measures the old mode
+	if (!m_overdraw_report || m_overdraw_query_prepass != m_use_depth_prepass) return;
+
+	m_overdraw_report = false;
+	if (m_overdraw[0] > 0.f && m_overdraw[1] > 0.f)
+	{
+		printf("G-buffer fragments per pixel: %.2f without depth prepass, %.2f with it\n", m_overdraw[0], m_overdraw[1]);
+	}
+	else
+	{
+		printf("G-buffer fragments per pixel: %.2f\n", m_overdraw[mode]);
+	}
+}
+
+void Renderer::RenderShadowMaps()
+{
+	if (m_light.GetCastShadowsStatus())
+	{
+		// the map from the last frame is still right
+		if (m_shadow_update == SHADOW_SKIP) return;
+
+		int m_depth_texture_resolution = m_light.GetShadowMapResolution();
+
+		glm::mat4 cull_projection_view = m_shadow_projection_view;
+		if (m_shadow_update == SHADOW_PARTIAL)
+		{
+			// only the texels under the changed casters are cleared and drawn again,
+			// the casters are culled against the frustum through that rectangle
+			glEnable(GL_SCISSOR_TEST);
+			glScissor(m_shadow_scissor.x, m_shadow_scissor.y, m_shadow_scissor.z, m_shadow_scissor.w);
+
+			glm::vec2 ndc_min = glm::vec2(m_shadow_scissor.x, m_shadow_scissor.y) / float(m_depth_texture_resolution) * 2.f - 1.f;
+			glm::vec2 ndc_max = glm::vec2(m_shadow_scissor.x + m_shadow_scissor.z, m_shadow_scissor.y + m_shadow_scissor.w) / float(m_depth_texture_resolution) * 2.f - 1.f;
+			cull_projection_view = CropMatrix(ndc_min, ndc_max) * cull_projection_view;
+		}
+
+		glBindFramebuffer(GL_FRAMEBUFFER, m_light.GetShadowMapFBO());
+		glViewport(0, 0, m_depth_texture_resolution, m_depth_texture_resolution);
+		glEnable(GL_DEPTH_TEST);
+		glClear(GL_DEPTH_BUFFER_BIT);
+
+		DrawShadowCasters(cull_projection_view, GetLightCone(m_light));
+
+		glDisable(GL_SCISSOR_TEST);
+		glDisable(GL_DEPTH_TEST);
+
+		if (m_light.GetShadowFilter() == LightNode::SHADOW_FILTER_EVSM) FilterShadowMap();
+
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+}
+
+void Renderer::DrawShadowCasters(const glm::mat4& cull_projection_view, const FrustumCuller::Cone& cone)
+{
+	// only the nodes inside the light frustum and its cone can cast into the shadow map
+	m_light_frustum_culler.ExtractPlanes(cull_projection_view);
+
+	if (m_use_gpu_culling)
+	{
+		// the hulls cast no shadow, the culling pass skips them
+		m_gpu_culler.Cull(GpuCuller::LIGHT_VIEW, m_light_frustum_culler.GetPlanes(), GpuCuller::CASTS_SHADOW, false, &cone);
+		m_gpu_culler.Bind(GpuCuller::LIGHT_VIEW);
+		m_shadow_gpu_program.Bind();
+
+		glBindVertexArray(m_mesh_pool.GetPositionsVAO());
+		glMultiDrawArraysIndirect(GL_TRIANGLES, 0, m_gpu_culler.GetCommandCount(GpuCuller::LIGHT_VIEW), 0);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+		glBindVertexArray(0);
+
+		m_shadow_gpu_program.Unbind();
+		return;
+	}
+
+	m_node_bvh.QueryFrustum(m_light_frustum_culler.GetPlanes(), m_visible_indices);
+
+	m_shadow_casters.clear();
+	for (uint32_t index : m_visible_indices)
+	{
+		glm::vec3 min, max;
+		m_node_bvh.GetItemBounds(index, min, max);
+		if (!FrustumCuller::ConeIntersectsBox(cone, (min + max) * 0.5f, (max - min) * 0.5f)) continue;
+
+		m_shadow_casters.push_back(m_nodes[index]);
+	}
+
+	m_instance_data.clear();
+	BuildInstanceBatches(m_shadow_casters, m_instance_batches);
+	UploadInstanceData();
+
+	if (m_use_indirect)
 	{
-		if (node->GetType() != MAP_ASSETS::PIPE)
+		// the whole pass is one call, the shader fetches the matrices by instance
+		m_draw_commands.clear();
+		for (auto& batch : m_instance_batches)
 		{
-			if (!FrustumClipping(proj, *node)) continue;
+			m_draw_commands.push_back({ static_cast<GLuint>(batch.mesh->m_vertex_count), static_cast<GLuint>(batch.instance_count),
+				static_cast<GLuint>(batch.mesh->m_first_vertex), static_cast<GLuint>(batch.first_instance) });
 		}
+		UploadIndirectCommands();
 
-		glEnable(GL_CULL_FACE);
-		if (node->GetType() == MAP_ASSETS::PIPE) // pipes disappear for some reason if you look at them from the back
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, INSTANCE_STORAGE, m_vbo_instances);
+		m_shadow_indirect_program.Bind();
+
+		glBindVertexArray(m_mesh_pool.GetPositionsVAO());
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, m_indirect_buffer);
+		glMultiDrawArraysIndirect(GL_TRIANGLES, 0, static_cast<GLsizei>(m_draw_commands.size()), 0);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+		glBindVertexArray(0);
+	}
+	else
+	{
+		m_spot_light_shadow_map_program.Bind();
+
+		// depth only, the parts of a mesh are contiguous in the pool and drawn as one
+		for (auto& batch : m_instance_batches)
 		{
-			glDisable(GL_CULL_FACE); // disabling back face culling doesn't seem to fix it
+			BindInstanceAttributes(batch.first_instance, m_mesh_pool.GetPositionsVAO());
+			glDrawArraysInstanced(GL_TRIANGLES, batch.mesh->m_first_vertex, batch.mesh->m_vertex_count, batch.instance_count);
+			glBindVertexArray(0);
 		}
+	}
+
+	// seems unnecessary since it just makes a shadow of the collision hull encasing the actual shadow sometimes
+	/*glm::vec3 camera_dir = normalize(m_camera_target_position - m_camera_position);
+	float_t isectT = 0.f;
+	int32_t primID;
+
+	for (auto& node : this->m_collidables_nodes)
+	{
+		node->intersectRay(m_camera_position, camera_dir, m_world_matrix, isectT, primID);
 
 		glBindVertexArray(node->m_vao);
 
-		m_geometry_program.loadMat4("uniform_projection_matrix", proj * node->app_model_matrix);
-		m_geometry_program.loadMat4("uniform_normal_matrix", glm::transpose(glm::inverse(m_world_matrix * node->app_model_matrix)));
-		m_geometry_program.loadMat4("uniform_world_matrix", m_world_matrix * node->app_model_matrix);
+		m_spot_light_shadow_map_program.loadMat4("uniform_projection_matrix", proj * node->app_model_matrix);
 
 		for (int j = 0; j < node->parts.size(); ++j)
 		{
-			m_geometry_program.loadVec3("uniform_diffuse", node->parts[j].diffuse);
-			m_geometry_program.loadVec3("uniform_ambient", node->parts[j].ambient);
-			m_geometry_program.loadVec3("uniform_specular", node->parts[j].specular);
-			m_geometry_program.loadFloat("uniform_shininess", node->parts[j].shininess);
-			m_geometry_program.loadInt("uniform_has_tex_diffuse", (node->parts[j].diffuse_textureID > 0) ? 1 : 0);
-			m_geometry_program.loadInt("uniform_has_tex_emissive", (node->parts[j].emissive_textureID > 0) ? 1 : 0);
-			m_geometry_program.loadInt("uniform_has_tex_mask", (node->parts[j].mask_textureID > 0) ? 1 : 0);
-			m_geometry_program.loadInt("uniform_has_tex_normal", (node->parts[j].bump_textureID > 0 || node->parts[j].normal_textureID > 0) ? 1 : 0);
-			m_geometry_program.loadInt("uniform_is_tex_bumb", (node->parts[j].bump_textureID > 0) ? 1 : 0);
-
-			glActiveTexture(GL_TEXTURE0);
-			m_geometry_program.loadInt("uniform_tex_diffuse", 0);
-			glBindTexture(GL_TEXTURE_2D, node->parts[j].diffuse_textureID);
-
-			if (node->parts[j].mask_textureID > 0)
-			{
-				glActiveTexture(GL_TEXTURE1);
-				m_geometry_program.loadInt("uniform_tex_mask", 1);
-				glBindTexture(GL_TEXTURE_2D, node->parts[j].mask_textureID);
-			}
-
-			if ((node->parts[j].bump_textureID > 0 || node->parts[j].normal_textureID > 0))
-			{
-				glActiveTexture(GL_TEXTURE2);
-				m_geometry_program.loadInt("uniform_tex_normal", 2);
-				glBindTexture(GL_TEXTURE_2D, node->parts[j].bump_textureID > 0 ?
-					node->parts[j].bump_textureID : node->parts[j].normal_textureID);
-			}
-
-			if (node->parts[j].emissive_textureID > 0)
-			{
-				glActiveTexture(GL_TEXTURE3);
-				m_geometry_program.loadInt("uniform_tex_emissive", 3);
-				glBindTexture(GL_TEXTURE_2D, node->parts[j].emissive_textureID);
-			}
-
 			glDrawArrays(GL_TRIANGLES, node->parts[j].start_offset, node->parts[j].count);
 		}
 
 		glBindVertexArray(0);
-	}
+	}*/
 
-	glDisable(GL_CULL_FACE);
+	m_spot_light_shadow_map_program.Unbind();
 }
 
-void Renderer::RenderCollidableGeometry()
+void Renderer::FilterShadowMap()
 {
-	glm::mat4 proj = m_projection_matrix * m_view_matrix * m_world_matrix;
+	// the whole map is small at half resolution, a partial update filters all of it again
+	int resolution = m_light.GetShadowMomentsResolution();
+	glViewport(0, 0, resolution, resolution);
+	glBindVertexArray(m_vao_fbo);
 
-	glm::vec3 camera_dir = normalize(m_camera_target_position - m_camera_position);
+	// depth to warped moments, downsampled and blurred along x
+	glBindFramebuffer(GL_FRAMEBUFFER, m_light.GetShadowMomentsFBO(0));
+	m_shadow_moments_program.Bind();
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, m_light.GetShadowMapDepthTexture());
+	m_shadow_moments_program.loadInt(Uniforms::shadow_map, 0);
+	m_shadow_moments_program.loadFloat(Uniforms::light_near, m_light.GetNear());
+	m_shadow_moments_program.loadFloat(Uniforms::light_far, m_light.GetRange());
+	m_shadow_moments_program.loadFloat(Uniforms::shadow_exponent, LightNode::EVSM_EXPONENT);
+	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
 
-	glEnable(GL_BLEND);
-	glBlendFunc(GL_ZERO, GL_ONE);
+	// blurred along y into the texture the lighting reads
+	glBindFramebuffer(GL_FRAMEBUFFER, m_light.GetShadowMomentsFBO(1));
+	m_shadow_blur_program.Bind();
+	glBindTexture(GL_TEXTURE_2D, m_light.GetShadowMomentsTexture(0));
+	m_shadow_blur_program.loadInt(Uniforms::source, 0);
+	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	m_shadow_blur_program.Unbind();
 
-	for (auto& node : this->m_collidables_nodes)
+	// wider footprints read the coarser levels
+	glBindTexture(GL_TEXTURE_2D, m_light.GetShadowMomentsTexture(1));
+	glGenerateMipmap(GL_TEXTURE_2D);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glBindVertexArray(0);
+}
+
+void Renderer::UpdateShadowAtlas()
+{
+	m_shadow_atlas_frame++;
+
+	glm::mat4 camera_projection_view = m_projection_matrix * m_view_matrix;
+	m_frustum_culler.ExtractPlanes(camera_projection_view);
+
+	// lights that reach the screen get a tile sized by their coverage, the rest give theirs back
+	for (auto& map_light : m_map_lights)
 	{
-		int32_t primID = -1;
-		int32_t totalRenderedPrims = 0;
+		if (map_light.point)
+		{
+			// no tile, the priority only orders the lights a full cluster keeps
+			glm::vec3 position = map_light.light.GetPosition();
+			float range = map_light.light.GetRange();
+			bool visible = FrustumCuller::IntersectsBox(m_frustum_culler.GetPlanes(), position, glm::vec3(range));
+			map_light.priority = visible ? GetScreenCoverage(position, range) : 0.f;
+			continue;
+		}
 
-		glBindVertexArray(node->m_vao);
+		glm::vec3 corners[8];
+		FrustumCuller::GetCorners(map_light.light.GetProjectionMatrix() * map_light.light.GetViewMatrix(), corners);
+		glm::vec3 min = corners[0], max = corners[0];
+		for (int i = 1; i < 8; i++)
+		{
+			min = glm::min(min, corners[i]);
+			max = glm::max(max, corners[i]);
+		}
+		glm::vec3 center = (min + max) * 0.5f;
+		glm::vec3 extent = (max - min) * 0.5f;
+
+		int size = 0;
+		map_light.priority = 0.f;
+		if (FrustumCuller::IntersectsBox(m_frustum_culler.GetPlanes(), center, extent))
+		{
+			map_light.priority = std::min(GetScreenCoverage(center, glm::length(extent)) * map_light.importance, 1.f);
 
-		m_geometry_program.loadMat4("uniform_projection_matrix", proj * node->app_model_matrix);
-		m_geometry_program.loadMat4("uniform_normal_matrix", glm::transpose(glm::inverse(m_world_matrix * node->app_model_matrix)));
-		m_geometry_program.loadMat4("uniform_world_matrix", m_world_matrix * node->app_model_matrix);
-		m_geometry_program.loadFloat("uniform_time", m_continous_time);
+			// the side follows the square root of the covered area
+			size = SHADOW_TILE_MAX;
+			float wanted = SHADOW_TILE_MAX * std::sqrt(map_light.priority);
+			while (size > SHADOW_TILE_MIN && size / 2 >= wanted) size /= 2;
 
+			// small lights wait longer between refreshes
+			map_light.update_interval = map_light.priority > 0.25f ? 1 : map_light.priority > 0.05f ? 2 : map_light.priority > 0.01f ? 4 : 8;
+		}
 
-		for (int j = 0; j < node->parts.size(); ++j)
+		if (size != map_light.requested_size)
 		{
-			m_geometry_program.loadVec3("uniform_diffuse", node->parts[j].diffuse);
-			m_geometry_program.loadVec3("uniform_ambient", node->parts[j].ambient);
-			m_geometry_program.loadVec3("uniform_specular", node->parts[j].specular);
-			m_geometry_program.loadFloat("uniform_shininess", node->parts[j].shininess);
-			m_geometry_program.loadInt("uniform_has_tex_diffuse", (node->parts[j].diffuse_textureID > 0) ? 1 : 0);
-			m_geometry_program.loadInt("uniform_has_tex_mask", (node->parts[j].mask_textureID > 0) ? 1 : 0);
-			m_geometry_program.loadInt("uniform_has_tex_emissive", (node->parts[j].emissive_textureID > 0) ? 1 : 0);
-			m_geometry_program.loadInt("uniform_has_tex_normal", (node->parts[j].bump_textureID > 0 || node->parts[j].normal_textureID > 0) ? 1 : 0);
-			m_geometry_program.loadInt("uniform_is_tex_bumb", (node->parts[j].bump_textureID > 0) ? 1 : 0);
-			m_geometry_program.loadInt("uniform_prim_id", primID - totalRenderedPrims);
-
-			glActiveTexture(GL_TEXTURE0);
-			m_geometry_program.loadInt("uniform_tex_diffuse", 0);
-			glBindTexture(GL_TEXTURE_2D, node->parts[j].diffuse_textureID);
-
-			if (node->parts[j].mask_textureID > 0)
-			{
-				glActiveTexture(GL_TEXTURE1);
-				m_geometry_program.loadInt("uniform_tex_mask", 1);
-				glBindTexture(GL_TEXTURE_2D, node->parts[j].mask_textureID);
-			}
+			// a tile for the previous request is given back before it was used
+			m_shadow_atlas.Free(map_light.next_tile);
+			map_light.requested_size = size;
 
-			if ((node->parts[j].bump_textureID > 0 || node->parts[j].normal_textureID > 0))
+			// nothing the light reaches is on screen
+			if (size == 0)
 			{
-				glActiveTexture(GL_TEXTURE2);
-				m_geometry_program.loadInt("uniform_tex_normal", 2);
-				glBindTexture(GL_TEXTURE_2D, node->parts[j].bump_textureID > 0 ?
-					node->parts[j].bump_textureID : node->parts[j].normal_textureID);
+				m_shadow_atlas.Free(map_light.tile);
+				map_light.shadow_valid = false;
+				map_light.shadow_rendered = false;
 			}
+		}
+	}
 
-			if (node->parts[j].emissive_textureID > 0)
-			{
-				glActiveTexture(GL_TEXTURE3);
-				m_geometry_program.loadInt("uniform_tex_emissive", 3);
-				glBindTexture(GL_TEXTURE_2D, node->parts[j].emissive_textureID);
-			}
+	m_map_light_order.resize(m_map_lights.size());
+	for (size_t i = 0; i < m_map_lights.size(); i++) m_map_light_order[i] = i;
+	std::sort(m_map_light_order.begin(), m_map_light_order.end(),
+		[&](size_t a, size_t b) { return m_map_lights[a].priority > m_map_lights[b].priority; });
 
-			glDrawArrays(GL_TRIANGLES, node->parts[j].start_offset, node->parts[j].count);
-			totalRenderedPrims += node->parts[j].count;
+	// the important lights pick first, when the atlas is full the others settle for smaller tiles
+	for (size_t index : m_map_light_order)
+	{
+		MapLight& map_light = m_map_lights[index];
+		if (map_light.requested_size == 0 || map_light.tile.size == map_light.requested_size || map_light.next_tile.size != 0) continue;
+
+		// a light with a tile only moves to a larger one, or to one no larger than it asks for
+		bool first = (map_light.tile.size == 0);
+		int smallest = (first || map_light.tile.size > map_light.requested_size) ? SHADOW_TILE_MIN : map_light.tile.size * 2;
+		ShadowAtlas::Tile& tile = first ? map_light.tile : map_light.next_tile;
+		for (int size = map_light.requested_size; size >= smallest; size /= 2)
+		{
+			if (m_shadow_atlas.Allocate(size, tile)) break;
 		}
-
-		glBindVertexArray(0);
 	}
-
-	glDisable(GL_BLEND);
 }
 
-void Renderer::RenderDeferredShading()
+void Renderer::RenderShadowAtlas()
 {
-	glBindFramebuffer(GL_FRAMEBUFFER, m_fbo);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_fbo_texture, 0);
+	bool bound = false;
+	int updates = 0;
 
-	GLenum drawbuffers[1] = { GL_COLOR_ATTACHMENT0 };
+	for (size_t index : m_map_light_order)
+	{
+		if (updates == SHADOW_ATLAS_UPDATES) break;
 
-	glDrawBuffers(1, drawbuffers);
+		MapLight& map_light = m_map_lights[index];
+		if (map_light.tile.size == 0) continue;
 
-	glViewport(0, 0, m_screen_width, m_screen_height);
+		// a tile without a shadow or a new tile is drawn first chance, changed casters wait for the turn of the light
+		bool resized = (map_light.next_tile.size != 0);
+		if (map_light.shadow_valid && !resized)
+		{
+			if (map_light.caster_generation == m_caster_generation) continue;
+			if (m_shadow_atlas_frame - map_light.last_update < map_light.update_interval) continue;
+		}
 
-	glDisable(GL_DEPTH_TEST);
-	glDepthMask(GL_FALSE);
+		if (!bound)
+		{
+			glBindFramebuffer(GL_FRAMEBUFFER, m_shadow_atlas.GetFBO());
+			glEnable(GL_DEPTH_TEST);
+			glEnable(GL_SCISSOR_TEST);
+			bound = true;
+		}
 
-	glClear(GL_COLOR_BUFFER_BIT);
+		const ShadowAtlas::Tile& tile = resized ? map_light.next_tile : map_light.tile;
+		glViewport(tile.x, tile.y, tile.size, tile.size);
+		glScissor(tile.x, tile.y, tile.size, tile.size);
+		glClear(GL_DEPTH_BUFFER_BIT);
 
-	m_deferred_program.Bind();
+		// the shadow shaders read the light matrix from the frame block
+		glm::mat4 projection_view = map_light.light.GetProjectionMatrix() * map_light.light.GetViewMatrix();
+		glBindBuffer(GL_UNIFORM_BUFFER, m_ubo_frame);
+		glBufferSubData(GL_UNIFORM_BUFFER, offsetof(FrameUniforms, light_projection_view), sizeof(glm::mat4), &projection_view);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
 
-	m_deferred_program.loadVec3("uniform_light_color", m_light.GetColor());
-	m_deferred_program.loadVec3("uniform_light_dir", m_light.GetDirection());
-	m_deferred_program.loadVec3("uniform_light_pos", m_light.GetPosition());
+		DrawShadowCasters(projection_view, GetLightCone(map_light.light));
 
-	m_deferred_program.loadFloat("uniform_light_umbra", m_light.GetUmbra());
-	m_deferred_program.loadFloat("uniform_light_penumbra", m_light.GetPenumbra());
+		// the old tile was read until this frame, the uniforms switch to the new one below
+		if (resized)
+		{
+			m_shadow_atlas.Free(map_light.tile);
+			map_light.tile = map_light.next_tile;
+			map_light.next_tile = { 0, 0, 0 };
+		}
 
-	m_deferred_program.loadVec3("uniform_camera_pos", m_camera_position);
-	m_deferred_program.loadVec3("uniform_camera_dir", normalize(m_camera_target_position - m_camera_position));
+		map_light.shadow_valid = true;
+		map_light.shadow_rendered = true;
+		map_light.caster_generation = m_caster_generation;
+		map_light.last_update = m_shadow_atlas_frame;
+		updates++;
+	}
 
-	m_deferred_program.loadMat4("uniform_light_projection_view", m_light.GetProjectionMatrix() * m_light.GetViewMatrix());
-	m_deferred_program.loadInt("uniform_cast_shadows", m_light.GetCastShadowsStatus() ? 1 : 0);
+	if (!bound) return;
 
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, m_fbo_pos_texture);
-	m_deferred_program.loadInt("uniform_tex_pos", 0);
+	glBindBuffer(GL_UNIFORM_BUFFER, m_ubo_frame);
+	glBufferSubData(GL_UNIFORM_BUFFER, offsetof(FrameUniforms, light_projection_view), sizeof(glm::mat4), &m_shadow_projection_view);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
 
-	glActiveTexture(GL_TEXTURE1);
-	glBindTexture(GL_TEXTURE_2D, m_fbo_normal_texture);
-	m_deferred_program.loadInt("uniform_tex_normal", 1);
+	glDisable(GL_SCISSOR_TEST);
+	glDisable(GL_DEPTH_TEST);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
 
-	glActiveTexture(GL_TEXTURE2);
-	glBindTexture(GL_TEXTURE_2D, m_fbo_albedo_texture);
-	m_deferred_program.loadInt("uniform_tex_albedo", 2);
+void Renderer::UpdateLightUniforms()
+{
+	LightUniforms lights;
+	lights.count = static_cast<int>(m_map_lights.size());
 
-	glActiveTexture(GL_TEXTURE3);
-	glBindTexture(GL_TEXTURE_2D, m_fbo_mask_texture);
-	m_deferred_program.loadInt("uniform_tex_mask", 3);
+	// by decreasing priority, a full cluster keeps the lights that matter most on screen
+	for (size_t slot = 0; slot < m_map_light_order.size(); slot++)
+	{
+		size_t i = m_map_light_order[slot];
+		LightNode& light = m_map_lights[i].light;
+		SpotLightUniforms& uniforms = lights.lights[slot];
+		uniforms.projection_view = light.GetProjectionMatrix() * light.GetViewMatrix();
+		uniforms.position_range = glm::vec4(light.GetPosition(), light.GetRange());
+		uniforms.direction_cos_umbra = glm::vec4(light.GetDirection(), std::cos(glm::radians(light.GetUmbra() * 0.5f)));
+		uniforms.color_cos_penumbra = glm::vec4(light.GetColor(), std::cos(glm::radians(light.GetPenumbra() * 0.5f)));
+		// a negative size marks a light waiting for its first shadow, it is left out instead of lighting through the walls
+		uniforms.shadow_rect = m_map_lights[i].shadow_rendered ? m_shadow_atlas.GetTileRect(m_map_lights[i].tile) : glm::vec4(0.f, 0.f, -1.f, -1.f);
+
+		if (m_map_lights[i].point)
+		{
+			// the cosine of half of a full turn lets every direction through the cone tests
+			uniforms.projection_view = glm::mat4(1.f);
+			uniforms.direction_cos_umbra.w = -1.f;
+			uniforms.color_cos_penumbra.w = -1.f;
+			// no shadow map, it lights everything in range
+			uniforms.shadow_rect = glm::vec4(0.f);
+		}
+	}
 
-	glActiveTexture(GL_TEXTURE4);
-	glBindTexture(GL_TEXTURE_2D, m_fbo_depth_texture);
-	m_deferred_program.loadInt("uniform_tex_depth", 4);
+	// the unused part of the array is left as it was
+	GLenum target = m_use_light_clusters ? GL_SHADER_STORAGE_BUFFER : GL_UNIFORM_BUFFER;
+	glBindBuffer(target, m_light_buffer);
+	glBufferSubData(target, 0, offsetof(LightUniforms, lights) + lights.count * sizeof(SpotLightUniforms), &lights);
+	glBindBuffer(target, 0);
+}
 
-	glActiveTexture(GL_TEXTURE10);
-	glBindTexture(GL_TEXTURE_2D, m_light.GetShadowMapDepthTexture());
-	m_deferred_program.loadInt("uniform_shadow_map", 10);
+std::string Renderer::GetLightDefines() const
+{
+	char defines[256];
+	snprintf(defines, sizeof(defines),
+		"#define MAX_SPOT_LIGHTS %d\n#define LIGHT_TILE_SIZE %d\n#define LIGHT_SLICES %d\n#define MAX_CLUSTER_LIGHTS %d\n",
+		m_max_spot_lights, LIGHT_TILE_SIZE, LIGHT_SLICES, MAX_CLUSTER_LIGHTS);
+
+	// the deferred pass is a GL 3.3 shader, the storage buffer comes with the extension
+	if (!m_use_light_clusters) return defines;
+	return std::string("#extension GL_ARB_shader_storage_buffer_object : require\n#define LIGHT_STORAGE\n") + defines;
+}
 
-	glBindVertexArray(m_vao_fbo);
-	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-	glBindVertexArray(0);
+float Renderer::GetScreenCoverage(const glm::vec3& center, float radius)
+{
+	float distance = glm::distance(center, m_camera_position);
+	if (distance <= radius) return 1.f;
 
-	m_deferred_program.Unbind();
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
-	glDepthMask(GL_TRUE);
+	// radius of the projected sphere in clip space units, against the clip space area of the screen
+	float projected = radius * m_projection_matrix[1][1] / std::sqrt(distance * distance - radius * radius);
+	float aspect = m_projection_matrix[1][1] / m_projection_matrix[0][0];
+	return std::min(glm::pi<float>() * projected * projected / (4.f * aspect), 1.f);
 }
 
-void Renderer::RenderGeometry()
+void Renderer::PlaceLight(glm::vec3 position, glm::vec3 target, glm::vec3 color, float umbra, float penumbra, float range, float importance)
 {
-	glBindFramebuffer(GL_FRAMEBUFFER, m_fbo);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_fbo_pos_texture, 0);
+	if (m_map_lights.size() == static_cast<size_t>(m_max_spot_lights))
+	{
+		printf("Map light limit of %d reached\n", m_max_spot_lights);
+		return;
+	}
 
-	GLenum drawbuffers[4] = {
-		GL_COLOR_ATTACHMENT0,
-		GL_COLOR_ATTACHMENT1,
-		GL_COLOR_ATTACHMENT2,
-		GL_COLOR_ATTACHMENT3 };
+	MapLight map_light;
+	map_light.light.SetLightOffset(glm::vec3(0.f));
+	map_light.light.SetPosition(position);
+	map_light.light.SetTarget(target);
+	map_light.light.SetColor(color);
+	map_light.light.SetConeSize(umbra, penumbra, range);
+	map_light.importance = importance;
+	map_light.tile = { 0, 0, 0 };
+	map_light.next_tile = { 0, 0, 0 };
+	map_light.requested_size = 0;
+	map_light.update_interval = 1;
+	map_light.last_update = 0;
+	map_light.caster_generation = 0;
+	map_light.shadow_valid = false;
+	map_light.shadow_rendered = false;
+	map_light.priority = 0.f;
+	map_light.point = false;
+	m_map_lights.push_back(map_light);
+}
 
-	glDrawBuffers(4, drawbuffers);
+void Renderer::PlacePointLight(glm::vec3 position, glm::vec3 color, float range)
+{
+	// the cone is only there to keep the light node valid, it is never used
+	size_t count = m_map_lights.size();
+	PlaceLight(position, position + glm::vec3(0.f, -1.f, 0.f), color, 90.f, 90.f, range, 0.f);
+	if (m_map_lights.size() > count) m_map_lights.back().point = true;
+}
 
-	glViewport(0, 0, m_screen_width, m_screen_height);
-	glClearColor(0.f, 0.8f, 1.f, 1.f);
-	glClearDepth(1.f);
-	glDepthFunc(GL_LEQUAL);
-	glDepthMask(GL_TRUE);
-	glEnable(GL_DEPTH_TEST);
+void Renderer::BuildLightClusters()
+{
+	if (!m_use_light_clusters) return;
 
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	int tiles_x = (m_screen_width + LIGHT_TILE_SIZE - 1) / LIGHT_TILE_SIZE;
+	int tiles_y = (m_screen_height + LIGHT_TILE_SIZE - 1) / LIGHT_TILE_SIZE;
 
-	m_geometry_program.Bind();
-	RenderStaticGeometry();
-	RenderCollidableGeometry();
+	m_light_cluster_program.Bind();
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, LIGHT_STORAGE, m_light_buffer);
+	m_light_cluster_program.loadVec2(Uniforms::cluster_depth, glm::vec2(nearPlane, farPlane));
+	m_light_cluster_program.loadVec2(Uniforms::screen_size, glm::vec2(m_screen_width, m_screen_height));
+	glBindImageTexture(0, m_light_cluster_texture, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_R16UI);
 
-	m_geometry_program.Unbind();
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
-	glDisable(GL_DEPTH_TEST);
-	glDepthMask(GL_FALSE);
+	// one invocation per cluster, each tests every light
+	glDispatchCompute((tiles_x + 7) / 8, (tiles_y + 7) / 8, LIGHT_SLICES);
+	glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+
+	glBindImageTexture(0, 0, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_R16UI);
+	m_light_cluster_program.Unbind();
 }
 
-void Renderer::RenderShadowMaps()
+void Renderer::PrepareShadowMap()
 {
-	if (m_light.GetCastShadowsStatus())
+	if (!m_light.GetCastShadowsStatus())
 	{
-		int m_depth_texture_resolution = m_light.GetShadowMapResolution();
-
-		glBindFramebuffer(GL_FRAMEBUFFER, m_light.GetShadowMapFBO());
-		glViewport(0, 0, m_depth_texture_resolution, m_depth_texture_resolution);
-		glEnable(GL_DEPTH_TEST);
-		glClear(GL_DEPTH_BUFFER_BIT);
-
-		// Bind the shadow mapping program
-		m_spot_light_shadow_map_program.Bind();
+		m_shadow_valid = false;
+		m_shadow_dirty_bounds.clear();
+		return;
+	}
 
-		glm::mat4 proj = m_light.GetProjectionMatrix() * m_light.GetViewMatrix() * m_world_matrix;
+	glm::mat4 projection_view = FitShadowProjection(m_light.GetProjectionMatrix() * m_light.GetViewMatrix());
+	uint64_t light_hash = HashLightMatrix(projection_view);
 
-		for (auto& node : this->m_nodes)
+	if (!m_shadow_valid || light_hash != m_shadow_light_hash)
+	{
+		m_shadow_update = SHADOW_FULL;
+		m_shadow_projection_view = projection_view;
+		m_shadow_light_hash = light_hash;
+	}
+	else if (m_caster_generation == m_shadow_caster_generation)
+	{
+		m_shadow_update = SHADOW_SKIP;
+	}
+	else
+	{
+		// the casters changed under the same light, redraw the rectangle around their old and new boxes
+		glm::ivec4 bounds(INT_MAX, INT_MAX, INT_MIN, INT_MIN);
+		bool full = false;
+		for (auto& box : m_shadow_dirty_bounds)
 		{
-			glBindVertexArray(node->m_vao);
-
-			m_spot_light_shadow_map_program.loadMat4("uniform_projection_matrix", proj * node->app_model_matrix);
-
-			for (int j = 0; j < node->parts.size(); ++j)
+			glm::ivec4 rect;
+			if (!ProjectToShadowMap(box.first, box.second, rect))
 			{
-				glDrawArrays(GL_TRIANGLES, node->parts[j].start_offset, node->parts[j].count);
+				full = true;
+				break;
 			}
+			// empty when the box is outside the map
+			if (rect.z <= rect.x || rect.w <= rect.y) continue;
+			bounds = glm::ivec4(glm::min(glm::ivec2(bounds), glm::ivec2(rect)), glm::max(glm::ivec2(bounds.z, bounds.w), glm::ivec2(rect.z, rect.w)));
+		}
 
-			glBindVertexArray(0);
+		// past half the map a full render costs about the same
+		int resolution = m_light.GetShadowMapResolution();
+		if (full)
+		{
+			m_shadow_update = SHADOW_FULL;
+		}
+		else if (bounds.z <= bounds.x || bounds.w <= bounds.y)
+		{
+			m_shadow_update = SHADOW_SKIP;
 		}
+		else if ((bounds.z - bounds.x) * (bounds.w - bounds.y) > resolution * resolution / 2)
+		{
+			m_shadow_update = SHADOW_FULL;
+		}
+		else
+		{
+			m_shadow_update = SHADOW_PARTIAL;
+			m_shadow_scissor = glm::ivec4(bounds.x, bounds.y, bounds.z - bounds.x, bounds.w - bounds.y);
+		}
+	}
 
-		// seems unnecessary since it just makes a shadow of the collision hull encasing the actual shadow sometimes
-		/*glm::vec3 camera_dir = normalize(m_camera_target_position - m_camera_position);
-		float_t isectT = 0.f;
-		int32_t primID;
+	m_shadow_caster_generation = m_caster_generation;
+	m_shadow_dirty_bounds.clear();
+	m_shadow_valid = true;
+}
 
-		for (auto& node : this->m_collidables_nodes)
+glm::mat4 Renderer::FitShadowProjection(const glm::mat4& projection_view)
+{
+	// only receivers the camera sees inside the light frustum read the shadow map,
+	// the map covers their extent in light clip space instead of the whole cone
+	glm::mat4 camera_projection_view = m_projection_matrix * m_view_matrix;
+	glm::vec4 planes[12];
+	m_frustum_culler.ExtractPlanes(camera_projection_view);
+	m_light_frustum_culler.ExtractPlanes(projection_view);
+	std::copy(m_frustum_culler.GetPlanes(), m_frustum_culler.GetPlanes() + 6, planes);
+	std::copy(m_light_frustum_culler.GetPlanes(), m_light_frustum_culler.GetPlanes() + 6, planes + 6);
+
+	glm::vec3 corners[8];
+	m_shadow_region.clear();
+	FrustumCuller::GetCorners(camera_projection_view, corners);
+	FrustumCuller::ClipHexahedron(corners, planes + 6, 6, m_shadow_region);
+	FrustumCuller::GetCorners(projection_view, corners);
+	FrustumCuller::ClipHexahedron(corners, planes, 6, m_shadow_region);
+	if (m_shadow_region.empty()) return projection_view;
+
+	m_shadow_fit_points.clear();
+	m_node_bvh.QueryFrustum(planes, m_shadow_receivers);
+	for (uint32_t index : m_shadow_receivers)
+	{
+		glm::vec3 min, max;
+		m_node_bvh.GetItemBounds(index, min, max);
+		for (int i = 0; i < 8; i++)
+		{
+			corners[i] = glm::vec3((i & 1) ? max.x : min.x, (i & 2) ? max.y : min.y, (i & 4) ? max.z : min.z);
+		}
+		FrustumCuller::ClipHexahedron(corners, planes, 12, m_shadow_fit_points);
+
+		// a box around the camera or the light also holds corners of the intersection
+		for (auto& point : m_shadow_region)
 		{
-			node->intersectRay(m_camera_position, camera_dir, m_world_matrix, isectT, primID);
+			if (glm::all(glm::greaterThanEqual(point, min)) && glm::all(glm::lessThanEqual(point, max))) m_shadow_fit_points.push_back(point);
+		}
+	}
+
+	// the points are inside the light near plane, their w is positive
+	glm::vec2 ndc_min(1.f), ndc_max(-1.f);
+	for (auto& point : m_shadow_fit_points)
+	{
+		glm::vec4 clip = projection_view * glm::vec4(point, 1.f);
+		ndc_min = glm::min(ndc_min, glm::vec2(clip) / clip.w);
+		ndc_max = glm::max(ndc_max, glm::vec2(clip) / clip.w);
+	}
+	if (ndc_max.x <= ndc_min.x || ndc_max.y <= ndc_min.y) return projection_view;
 
-			glBindVertexArray(node->m_vao);
+	// two texels of margin for the filter, snapped outwards so small moves keep the same fit
+	float margin = 4.f / m_light.GetShadowMapResolution();
+	ndc_min = glm::max(glm::floor((ndc_min - margin) * SHADOW_FIT_GRID) / SHADOW_FIT_GRID, glm::vec2(-1.f));
+	ndc_max = glm::min(glm::ceil((ndc_max + margin) * SHADOW_FIT_GRID) / SHADOW_FIT_GRID, glm::vec2(1.f));
 
-			m_spot_light_shadow_map_program.loadMat4("uniform_projection_matrix", proj * node->app_model_matrix);
+	return CropMatrix(ndc_min, ndc_max) * projection_view;
+}
 
-			for (int j = 0; j < node->parts.size(); ++j)
-			{
-				glDrawArrays(GL_TRIANGLES, node->parts[j].start_offset, node->parts[j].count);
-			}
+glm::mat4 Renderer::CropMatrix(const glm::vec2& ndc_min, const glm::vec2& ndc_max)
+{
+	// scales and moves the rectangle onto the whole clip space
+	glm::mat4 crop(1.f);
+	crop[0][0] = 2.f / (ndc_max.x - ndc_min.x);
+	crop[1][1] = 2.f / (ndc_max.y - ndc_min.y);
+	crop[3][0] = -(ndc_max.x + ndc_min.x) / (ndc_max.x - ndc_min.x);
+	crop[3][1] = -(ndc_max.y + ndc_min.y) / (ndc_max.y - ndc_min.y);
+	return crop;
+}
 
-			glBindVertexArray(0);
-		}*/
+bool Renderer::ProjectToShadowMap(const glm::vec3& min, const glm::vec3& max, glm::ivec4& rect)
+{
+	glm::vec2 ndc_min(1.f), ndc_max(-1.f);
+	for (int i = 0; i < 8; i++)
+	{
+		glm::vec3 corner((i & 1) ? max.x : min.x, (i & 2) ? max.y : min.y, (i & 4) ? max.z : min.z);
+		glm::vec4 clip = m_shadow_projection_view * glm::vec4(corner, 1.f);
+		// behind the light, the rectangle is unbounded
+		if (clip.w <= 0.f) return false;
+		ndc_min = glm::min(ndc_min, glm::vec2(clip) / clip.w);
+		ndc_max = glm::max(ndc_max, glm::vec2(clip) / clip.w);
+	}
 
-		m_spot_light_shadow_map_program.Unbind();
-		glDisable(GL_DEPTH_TEST);
-		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	// min and max texel corners, one texel wider for the rasterization rules
+	float resolution = float(m_light.GetShadowMapResolution());
+	glm::vec2 texel_min = glm::clamp((ndc_min * 0.5f + 0.5f) * resolution - 1.f, 0.f, resolution);
+	glm::vec2 texel_max = glm::clamp((ndc_max * 0.5f + 0.5f) * resolution + 1.f, 0.f, resolution);
+	rect = glm::ivec4(glm::floor(texel_min.x), glm::floor(texel_min.y), glm::ceil(texel_max.x), glm::ceil(texel_max.y));
+	return true;
+}
+
+uint64_t Renderer::HashLightMatrix(const glm::mat4& matrix)
+{
+	// FNV-1a over the elements rounded to the threshold
+	uint64_t hash = 14695981039346656037ull;
+	for (int column = 0; column < 4; column++)
+	{
+		for (int row = 0; row < 4; row++)
+		{
+			int64_t value = static_cast<int64_t>(std::floor(matrix[column][row] / SHADOW_MATRIX_THRESHOLD + 0.5f));
+			for (int byte = 0; byte < 8; byte++)
+			{
+				hash ^= static_cast<uint64_t>(value >> (byte * 8)) & 0xFFu;
+				hash *= 1099511628211ull;
+			}
+		}
 	}
+	return hash;
+}
+
+FrustumCuller::Cone Renderer::GetLightCone(LightNode& light)
+{
+	FrustumCuller::Cone cone;
+	cone.apex = light.GetPosition();
+	cone.direction = light.GetDirection();
+	cone.angle = glm::radians(light.GetPenumbra() * 0.5f);
+	cone.range = light.GetRange();
+	return cone;
 }
 
 void Renderer::CameraMoveForward(bool enable)
@@ -735,40 +2680,79 @@ void Renderer::CameraRollRight(bool enable) // removed, looked weird
 
 void Renderer::PlaceObject(bool &init, std::array<const char*, MAP_ASSETS::SIZE_ALL> &map_assets, MAP_ASSETS asset, glm::vec3 move, glm::vec3 rotate, glm::vec3 scale)
 {
-	OBJLoader loader;
-	GeometricMesh* mesh;
-
-	mesh = loader.load(map_assets[asset]);
+	// every asset is loaded once, later placements share its buffers so they can be drawn instanced
+	GeometryNode* source = m_asset_meshes[asset];
+	GeometricMesh* mesh = nullptr;
 
-	if (mesh != nullptr)
+	if (source == nullptr)
 	{
-		GeometryNode* temp;
-		if (asset % 2 == 0)
+		OBJLoader loader;
+		mesh = loader.load(map_assets[asset]);
+
+		if (mesh == nullptr)
 		{
-			GeometryNode* node = new GeometryNode();
-			node->Init(mesh);
-			this->m_nodes.push_back(node);
-			node->SetType(asset);
-			temp = node;
-
-			int nextAsset = static_cast<int>(asset);
-			nextAsset++;
-			PlaceObject(init, map_assets, static_cast<MAP_ASSETS>(nextAsset), move, rotate, scale);
+			init = false;
+			return;
 		}
-		else
+	}
+
+	GeometryNode* temp;
+	if (asset % 2 == 0)
+	{
+		GeometryNode* node = new GeometryNode();
+		if (source) node->Share(*source);
+		else node->Init(mesh, m_mesh_pool);
+		this->m_nodes.push_back(node);
+		node->SetType(asset);
+		temp = node;
+
+		int nextAsset = static_cast<int>(asset);
+		nextAsset++;
+		PlaceObject(init, map_assets, static_cast<MAP_ASSETS>(nextAsset), move, rotate, scale);
+	}
+	else
+	{
+		CollidableNode* node = new CollidableNode();
+		if (source) node->Share(*source);
+		else node->Init(mesh, m_mesh_pool);
+		this->m_collidables_nodes.push_back(node);
+		node->SetType(asset);
+		temp = node;
+	}
+
+	if (source == nullptr)
+	{
+		RegisterMaterials(*temp);
+		m_asset_meshes[asset] = temp;
+	}
+
+	temp->Place(move, rotate, scale);
+	delete mesh;
+
+	// the pieces holding a light fixture place it with them
+	if (asset == CORRIDOR_STRAIGHT)
+	{
+		// ceiling lamp shining down the middle of the corridor
+		glm::vec3 position = glm::vec3(temp->model_matrix * glm::vec4(0.f, 3.5f, 0.f, 1.f));
+		glm::vec3 target = glm::vec3(temp->model_matrix * glm::vec4(0.f, -3.f, 0.f, 1.f));
+		PlaceLight(position, target, glm::vec3(60.f, 58.f, 54.f), 90.f, 120.f, 15.f, 1.f);
+
+		// glowing strips low on both walls, short ranged so they only light their part of the corridor
+		for (float z : { -5.f, -15.f })
 		{
-			CollidableNode* node = new CollidableNode();
-			node->Init(mesh);
-			this->m_collidables_nodes.push_back(node);
-			node->SetType(asset);
-			temp = node;
+			for (float x : { -4.5f, 4.5f })
+			{
+				glm::vec3 fixture = glm::vec3(temp->model_matrix * glm::vec4(x, -4.f, z, 1.f));
+				PlacePointLight(fixture, glm::vec3(3.f, 6.f, 5.5f), 6.f);
+			}
 		}
-		temp->Place(move, rotate, scale);
-		delete mesh;
 	}
-	else
+	else if (asset == CANNON_MOUNT)
 	{
-		init = false;
+		// muzzle light of the cannons under the mount, they matter more for the player
+		glm::vec3 position = glm::vec3(temp->model_matrix * glm::vec4(0.f, -0.5f, 0.f, 1.f));
+		glm::vec3 target = glm::vec3(temp->model_matrix * glm::vec4(0.f, -6.f, 0.f, 1.f));
+		PlaceLight(position, target, glm::vec3(120.f, 45.f, 20.f), 60.f, 90.f, 15.f, 2.f);
 	}
 }
 
@@ -788,10 +2772,7 @@ void Renderer::ExtractPlanesFromFrustum(glm::mat4 MVP, bool normalize)
 	{
 		for (int i = 0; i < 6; i++)
 		{
-			for (int j = 0; j < 4; j++)
-			{
-				m_frustum_planes[i][j] = glm::normalize(m_frustum_planes[i][j]);
-			}
+			m_frustum_planes[i] /= glm::length(glm::vec3(m_frustum_planes[i]));
 		}
 	}
 }
@@ -980,9 +2961,10 @@ void Renderer::CollisionDetection(glm::vec3& direction)
 	std::vector<float> isectDst;
 
 	float distance = 17.f;
-	for (auto& node : this->m_collidables_nodes)
+	m_collidable_bvh.QuerySphere(m_camera_position, distance, m_visible_indices);
+	for (uint32_t index : m_visible_indices)
 	{
-		if (CalculateDistance(m_camera_position, node->GetPosition()) > distance) continue;
+		CollidableNode* node = m_collidables_nodes[index];
 
 		float_t isectT = 0.f;
 		int32_t primID = -1;
@@ -1002,35 +2984,18 @@ void Renderer::CollisionDetection(glm::vec3& direction)
 
 bool Renderer::FrustumClipping(glm::mat4 MVP, GeometryNode& node)
 {
+	// planes are in the space MVP maps from, the box is moved there by the node transform
 	ExtractPlanesFromFrustum(MVP, true);
-	node.ExtractMinMaxFromAABB(node);
+
+	glm::vec3 center, extent;
+	FrustumCuller::TransformBox(node.m_aabb.min, node.m_aabb.max, node.app_model_matrix, center, extent);
 
 	for (int i = 0; i < 6; i++)
 	{
-		int out = 0;
-		out += glm::dot(m_frustum_planes[i], glm::vec4(node.m_aabb.min.x, node.m_aabb.min.y, node.m_aabb.min.z, 1.0f)) < 0.f ? 1 : 0;
-		out += glm::dot(m_frustum_planes[i], glm::vec4(node.m_aabb.max.x, node.m_aabb.min.y, node.m_aabb.min.z, 1.0f)) < 0.f ? 1 : 0;
-
-		out += glm::dot(m_frustum_planes[i], glm::vec4(node.m_aabb.min.x, node.m_aabb.max.y, node.m_aabb.min.z, 1.0f)) < 0.f ? 1 : 0;
-		out += glm::dot(m_frustum_planes[i], glm::vec4(node.m_aabb.max.x, node.m_aabb.max.y, node.m_aabb.min.z, 1.0f)) < 0.f ? 1 : 0;
-
-		out += glm::dot(m_frustum_planes[i], glm::vec4(node.m_aabb.min.x, node.m_aabb.min.y, node.m_aabb.max.z, 1.0f)) < 0.f ? 1 : 0;
-		out += glm::dot(m_frustum_planes[i], glm::vec4(node.m_aabb.max.x, node.m_aabb.min.y, node.m_aabb.max.z, 1.0f)) < 0.f ? 1 : 0;
-
-		out += glm::dot(m_frustum_planes[i], glm::vec4(node.m_aabb.min.x, node.m_aabb.max.y, node.m_aabb.max.z, 1.0f)) < 0.f ? 1 : 0;
-		out += glm::dot(m_frustum_planes[i], glm::vec4(node.m_aabb.max.x, node.m_aabb.max.y, node.m_aabb.max.z, 1.0f)) < 0.f ? 1 : 0;
-
-		if (out == 8) return false;
+		glm::vec3 normal = glm::vec3(m_frustum_planes[i]);
+		if (glm::dot(normal, center) + m_frustum_planes[i].w + glm::dot(glm::abs(normal), extent) < 0.f) return false;
 	}
 
-	int out;
-	out = 0; for (int i = 0; i < 8; i++) out += ((m_frustum_planes[i].x > node.m_aabb.max.x) ? 1 : 0); if (out == 8) return false;
-	out = 0; for (int i = 0; i < 8; i++) out += ((m_frustum_planes[i].x < node.m_aabb.min.x) ? 1 : 0); if (out == 8) return false;
-	out = 0; for (int i = 0; i < 8; i++) out += ((m_frustum_planes[i].y > node.m_aabb.max.y) ? 1 : 0); if (out == 8) return false;
-	out = 0; for (int i = 0; i < 8; i++) out += ((m_frustum_planes[i].y < node.m_aabb.min.y) ? 1 : 0); if (out == 8) return false;
-	out = 0; for (int i = 0; i < 8; i++) out += ((m_frustum_planes[i].z > node.m_aabb.max.z) ? 1 : 0); if (out == 8) return false;
-	out = 0; for (int i = 0; i < 8; i++) out += ((m_frustum_planes[i].z < node.m_aabb.min.z) ? 1 : 0); if (out == 8) return false;
-
 	return true;
 }
 
@@ -1045,12 +3010,16 @@ void Renderer::Shoot(bool shoot)
 	{
 		last_shoot = m_continous_time;
 		glm::vec3 direction = glm::normalize(m_camera_target_position - m_camera_position);
-		for (int i = 0; i < this->m_collidables_nodes.size(); i++)
+
+		// hulls in range, in placement order so the first one hit is the same as before
+		m_collidable_bvh.QuerySphere(m_camera_position, 75.f, m_visible_indices);
+		std::sort(m_visible_indices.begin(), m_visible_indices.end());
+
+		for (uint32_t index : m_visible_indices)
 		{
+			int i = static_cast<int>(index);
 			if (m_collidables_nodes[i]->GetType() == MAP_ASSETS::CH_IRIS || m_collidables_nodes[i]->GetType() == MAP_ASSETS::CH_CANNON)
 			{
-				if (CalculateDistance(m_camera_position, m_collidables_nodes[i]->GetPosition()) > 75.f) continue;
-
 				float_t isectT = 0.f;
 				int32_t primID = -1;
 				if (m_collidables_nodes[i]->intersectRay(m_camera_position, direction, m_world_matrix, isectT, primID))
@@ -1058,8 +3027,18 @@ void Renderer::Shoot(bool shoot)
 					last_hit = m_continous_time;
 					if (m_collidables_nodes[i]->GetType() == MAP_ASSETS::CH_CANNON)
 					{
+						glm::vec3 old_min, old_max;
+						m_node_bvh.GetItemBounds(index, old_min, old_max);
+						m_shadow_dirty_bounds.push_back({ old_min, old_max });
+						m_caster_generation++;
+
 						m_collidables_nodes.erase(m_collidables_nodes.begin() + i);
 						m_nodes.erase(m_nodes.begin() + i);
+						glDeleteQueries(1, &m_node_queries[i].query);
+						m_node_queries.erase(m_node_queries.begin() + i);
+						// the indices after i shifted
+						BuildSceneBounds();
+						if (m_gpu_culling_supported) BuildGpuCulling();
 					}
 					else
 					{
@@ -1086,4 +3065,60 @@ void Renderer::Zoom(bool zoom)
 {
 	float np = zoom ? this->nearPlane * 10: this->nearPlane;
 	this->m_projection_matrix = glm::perspective(glm::radians(FOV), aspectRatio, np, farPlane);
+}
+
+void Renderer::ToggleGpuCulling()
+{
+	if (!m_gpu_culling_supported)
+	{
+		printf("gpu culling: not supported\n");
+		return;
+	}
+	m_use_gpu_culling = !m_use_gpu_culling;
+	// the depth was not kept up to date while it was off
+	m_gpu_culler.InvalidateDepthPyramid();
+	printf("gpu culling: %s\n", m_use_gpu_culling ? "enabled" : "disabled");
+}
+
+void Renderer::ToggleVisibilityBuffer()
+{
+	if (!m_visibility_supported)
+	{
+		printf("visibility buffer: not supported\n");
+		return;
+	}
+	m_use_visibility_buffer = !m_use_visibility_buffer;
+	printf("visibility buffer: %s%s\n", m_use_visibility_buffer ? "enabled" : "disabled",
+		(m_use_visibility_buffer && !m_use_gpu_culling) ? ", waits for gpu culling" : "");
+}
+
+void Renderer::ToggleDepthPrepass()
+{
+	m_use_depth_prepass = !m_use_depth_prepass;
+	m_overdraw_report = true;
+	printf("depth prepass: %s%s\n", m_use_depth_prepass ? "enabled" : "disabled",
+		(m_use_visibility_buffer && m_use_gpu_culling) ? ", unused by the visibility buffer" : "");
+}
+
+void Renderer::ToggleGeometryShader()
+{
+	m_use_geometry_shader = !m_use_geometry_shader;
+	printf("geometry pass geometry shader: %s%s\n", m_use_geometry_shader ? "enabled" : "disabled",
+		m_use_gpu_culling ? ", only the cpu culling path has one" : "");
+}
+
+void Renderer::ToggleShadowFilter()
+{
+	bool evsm = m_light.GetShadowFilter() == LightNode::SHADOW_FILTER_PCF;
+	m_light.SetShadowFilter(evsm ? LightNode::SHADOW_FILTER_EVSM : LightNode::SHADOW_FILTER_PCF);
+	// the moments were not kept up to date while it was off
+	m_shadow_valid = false;
+	printf("shadow filter: %s\n", evsm ? "evsm" : "pcf");
+}
+
+void Renderer::ToggleDepthPyramid()
+{
+	m_use_depth_pyramid = !m_use_depth_pyramid;
+	m_gpu_culler.InvalidateDepthPyramid();
+	printf("depth pyramid occlusion: %s\n", m_use_depth_pyramid ? "enabled" : "disabled");
 }
\ No newline at end of file
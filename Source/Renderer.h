@@ -4,10 +4,20 @@
 #include "GLEW\glew.h"
 #include "glm\glm.hpp"
 #include <vector>
+#include <array>
+#include <map>
 #include "ShaderProgram.h"
 #include "GeometryNode.h"
 #include "CollidableNode.h"
 #include "LightNode.h"
+#include "RenderQueue.h"
+#include "MeshPool.h"
+#include "FrustumCuller.h"
+#include "BVH.h"
+#include "PortalGraph.h"
+#include "OcclusionBuffer.h"
+#include "GpuCuller.h"
+#include "ShadowAtlas.h"
 
 class Renderer
 {
@@ -59,17 +69,151 @@ protected:
 		SIZE_ALL
 	};
 
+	// uniform buffer binding points shared by all programs
+	enum UNIFORM_BLOCKS
+	{
+		FRAME_BLOCK = 0,
+		MATERIAL_BLOCK,
+		LIGHT_BLOCK,
+	};
+
+	// lights of the LightData block, point lights are spots with no cone. The block is a storage buffer
+	// with the light clusters and a uniform buffer without, then it holds what GL_MAX_UNIFORM_BLOCK_SIZE allows
+	static constexpr int MAX_SPOT_LIGHTS = 256;
+
+	// the lights are binned into clusters of LIGHT_TILE_SIZE pixels by LIGHT_SLICES exponential depth slices,
+	// a cluster keeps up to MAX_CLUSTER_LIGHTS, the most important first. The light shaders get these
+	// values and the light limit as defines
+	static constexpr int LIGHT_TILE_SIZE = 32;
+	static constexpr int LIGHT_SLICES = 16;
+	static constexpr int MAX_CLUSTER_LIGHTS = 31;
+
+	// the light passes bind the storage buffer of the lights again before use, like the visibility resolve
+	enum LIGHT_STORAGE_BLOCKS
+	{
+		LIGHT_STORAGE = 0,
+	};
+
+	// shader storage binding points of the indirect path
+	enum STORAGE_BLOCKS
+	{
+		INSTANCE_STORAGE = 0,
+		DRAW_STORAGE,
+		MATERIAL_STORAGE,
+	};
+
+	// the visibility resolve reuses the binding points of the draw data and the culling,
+	// eight blocks is all a fragment shader is guaranteed
+	enum VISIBILITY_STORAGE_BLOCKS
+	{
+		TRIANGLE_STORAGE = 1,
+		// positions, normals, texcoords, tangents and bitangents of the mesh pool
+		VERTEX_STORAGE = 3,
+	};
+
+	// a visibility texel is the item in the high bits and its pool triangle in the low ones
+	static constexpr GLuint VISIBILITY_TRIANGLE_BITS = 16;
+	static constexpr GLuint VISIBILITY_EMPTY = 0xFFFFFFFF;
+
+	// std140 layout of the FrameData block, every vec3 is packed with the scalar after it
+	struct FrameUniforms
+	{
+		glm::mat4 view_matrix;
+		glm::mat4 projection_matrix;
+		glm::mat4 view_projection_matrix;
+		glm::mat4 light_projection_view;
+		glm::vec3 camera_pos;
+		float time;
+		glm::vec3 camera_dir;
+		int cast_shadows;
+		glm::vec3 light_pos;
+		float light_umbra;
+		glm::vec3 light_dir;
+		float light_penumbra;
+		glm::vec3 light_color;
+		float padding;
+	};
+
+	// std140 and std430 layout of one spot light of the LightData block
+	struct SpotLightUniforms
+	{
+		glm::mat4 projection_view;
+		// xyz position, w range
+		glm::vec4 position_range;
+		// xyz direction, w cosine of half the umbra
+		glm::vec4 direction_cos_umbra;
+		// rgb color, w cosine of half the penumbra
+		glm::vec4 color_cos_penumbra;
+		// offset and scale of the shadow tile in the atlas, zero without a shadow
+		glm::vec4 shadow_rect;
+	};
+
+	// the count first, so the layout is the same in a uniform and a storage buffer
+	struct LightUniforms
+	{
+		int count;
+		int padding[3];
+		SpotLightUniforms lights[MAX_SPOT_LIGHTS];
+	};
+
+	// std140 layout of the MaterialData block
+	struct MaterialUniforms
+	{
+		glm::vec3 diffuse;
+		float shininess;
+		glm::vec3 ambient;
+		int has_tex_diffuse;
+		glm::vec3 specular;
+		int has_tex_mask;
+		int has_tex_normal;
+		int has_tex_emissive;
+		int is_tex_bumb;
+		int padding;
+	};
+
 	bool InitShaders();
+	bool InitUniformBuffers();
+	void UpdateFrameUniforms();
 	bool InitGeometricMeshes();
 	bool InitCommonItems();
 	bool InitLights();
 	bool InitIntermediateBuffers();
 	void InitCamera();
 	void RenderGeometry();
+	void RenderDepthPrepass();
+	void ReadOverdrawQuery();
 	void RenderDeferredShading();
-	void RenderStaticGeometry();
-	void RenderCollidableGeometry();
+	void BuildRenderQueue();
+	void CullVisibleNodes();
+	void ReadOcclusionQueries();
+	void RenderOcclusionQueries();
+	void BuildSceneBounds();
+	void GetWorldBounds(const GeometryNode& node, glm::vec3& center, glm::vec3& extent);
+	void SubmitRenderQueue();
+	void SubmitRenderQueueIndirect();
+	void UploadIndirectCommands();
+	void BuildGpuCulling();
+	void GetGpuCullItem(GeometryNode& node, GLuint flags, GpuCuller::Item& item);
+	void SubmitGpuCulledGeometry();
+	void BuildVisibilityTriangles();
+	void RenderVisibilityBuffer();
+	void ResolveVisibilityBuffer();
 	void RenderShadowMaps();
+	void FilterShadowMap();
+	void UpdateShadowAtlas();
+	void RenderShadowAtlas();
+	void UpdateLightUniforms();
+	void BuildLightClusters();
+	float GetScreenCoverage(const glm::vec3& center, float radius);
+	void PlaceLight(glm::vec3 position, glm::vec3 target, glm::vec3 color, float umbra, float penumbra, float range, float importance);
+	void PlacePointLight(glm::vec3 position, glm::vec3 color, float range);
+	void DrawShadowCasters(const glm::mat4& cull_projection_view, const FrustumCuller::Cone& cone);
+	void PrepareShadowMap();
+	glm::mat4 FitShadowProjection(const glm::mat4& projection_view);
+	static glm::mat4 CropMatrix(const glm::vec2& ndc_min, const glm::vec2& ndc_max);
+	bool ProjectToShadowMap(const glm::vec3& min, const glm::vec3& max, glm::ivec4& rect);
+	static uint64_t HashLightMatrix(const glm::mat4& matrix);
+	FrustumCuller::Cone GetLightCone(LightNode& light);
 	void RenderPostProcess();
 	void PlaceObject(bool& init, std::array<const char*, MAP_ASSETS::SIZE_ALL>& map_assets, MAP_ASSETS asset, glm::vec3 move, glm::vec3 rotate, glm::vec3 scale = glm::vec3(1.f, 1.f, 1.f));
 	void ExtractPlanesFromFrustum(glm::mat4 MVP, bool normalize = false);
@@ -78,22 +222,296 @@ protected:
 	std::vector<CollidableNode*> m_collidables_nodes;
 	glm::vec4 m_frustum_planes[6];
 
+	// per instance vertex attributes, read at locations 5-8 (world) and 9-12 (normal)
+	struct InstanceData
+	{
+		glm::mat4 world_matrix;
+		glm::mat4 normal_matrix;
+	};
+
+	// a run of instances of the same asset inside the instance buffer
+	struct InstanceBatch
+	{
+		GeometryNode* mesh;
+		int type;
+		GLint first_instance;
+		GLsizei instance_count;
+	};
+
+	// first node placed for every asset, its buffers are shared by all others of the same type
+	std::array<GeometryNode*, MAP_ASSETS::SIZE_ALL> m_asset_meshes;
+	std::vector<GeometryNode*> m_visible_nodes;
+	// hierarchies over the world space bounds of m_nodes and m_collidables_nodes,
+	// items are indices into those arrays
+	BVH m_node_bvh;
+	BVH m_collidable_bvh;
+	FrustumCuller m_frustum_culler;
+	FrustumCuller m_light_frustum_culler;
+	std::vector<uint32_t> m_visible_indices;
+	// corridor pieces as cells, its items are the indices of m_nodes
+	PortalGraph m_portal_graph;
+	// depth of the occluding hulls, rasterized on the CPU every frame
+	OcclusionBuffer m_occlusion_buffer;
+	std::vector<uint32_t> m_candidate_nodes;
+	std::vector<uint32_t> m_candidate_hulls;
+
+	// hardware occlusion query of every node, same order as m_nodes
+	struct OcclusionQuery
+	{
+		GLuint query;
+		// issued and not read back yet
+		bool pending;
+		bool visible;
+		// last frame the node passed the CPU tests
+		unsigned int last_frame;
+	};
+
+	// frames between two queries of a node that stays visible
+	static const unsigned int OCCLUSION_RETEST_INTERVAL = 4;
+
+	std::vector<OcclusionQuery> m_node_queries;
+	// visible last frame, drawn through the queue and their boxes tested again
+	std::vector<uint32_t> m_retest_nodes;
+	// hidden last frame, drawn on their own under conditional rendering
+	std::vector<uint32_t> m_uncertain_nodes;
+	unsigned int m_frame_index;
+	GLuint m_vao_box;
+	GLuint m_vbo_box;
+	std::vector<GeometryNode*> m_shadow_casters;
+	std::vector<InstanceBatch> m_instance_batches;
+	// one per node in m_uncertain_nodes
+	std::vector<InstanceBatch> m_uncertain_batches;
+	std::vector<InstanceData> m_instance_data;
+	GLuint m_vbo_instances;
+	GLsizeiptr m_instance_buffer_size;
+
+	// textures a part samples, the geometry pass has a program variant per combination in use
+	enum MATERIAL_FEATURES
+	{
+		FEATURE_TEX_DIFFUSE = 1 << 0,
+		FEATURE_TEX_MASK = 1 << 1,
+		FEATURE_TEX_NORMAL = 1 << 2,
+		FEATURE_TEX_EMISSIVE = 1 << 3,
+		FEATURE_COUNT = 4,
+	};
+
+	// textures bound together by a part, the normal slot holds the bump map when there is one
+	struct TextureSet
+	{
+		GLuint diffuse;
+		GLuint mask;
+		GLuint normal;
+		GLuint emissive;
+		// MATERIAL_FEATURES of the textures present
+		GLuint features;
+	};
+
+	// unique materials and texture sets of all loaded assets, parts refer to them by index
+	std::vector<GeometryNode::Objects> m_materials;
+	std::vector<TextureSet> m_texture_sets;
+	// geometry pass programs keyed by MATERIAL_FEATURES, with the features compiled in
+	std::map<GLuint, ShaderProgram> m_geometry_variants;
+	RenderQueue m_render_queue;
+
+	GLuint m_ubo_frame;
+	GLuint m_light_buffer;
+	// MAX_SPOT_LIGHTS, or less when the lights are in a uniform buffer
+	int m_max_spot_lights;
+	GLuint m_ubo_materials;
+	// size of one material in m_ubo_materials, padded to the offset alignment
+	GLsizeiptr m_material_stride;
+
+	// vertices of every loaded asset, all parts draw from its single vao
+	MeshPool m_mesh_pool;
+
+	// layout of glMultiDrawArraysIndirect commands
+	struct DrawArraysCommand
+	{
+		GLuint count;
+		GLuint instance_count;
+		GLuint first;
+		GLuint base_instance;
+	};
+
+	// consecutive commands with the same textures and raster state, drawn by one call
+	struct DrawRun
+	{
+		bool cull;
+		int texture_set;
+		GLsizei first;
+		GLsizei count;
+	};
+
+	// set when the context has multi draw indirect and gl_DrawID / gl_BaseInstance
+	bool m_use_indirect;
+	std::vector<DrawArraysCommand> m_draw_commands;
+	// material index of every command, read by the shader through gl_DrawID
+	std::vector<GLuint> m_draw_materials;
+	GLuint m_indirect_buffer;
+	GLuint m_ssbo_draw_materials;
+	// same data as m_ubo_materials, tightly packed
+	GLuint m_ssbo_materials;
+
+	// the nodes are culled by a compute pass writing the indirect commands,
+	// the CPU culling above is only the fallback when this is off
+	bool m_gpu_culling_supported;
+	bool m_use_gpu_culling;
+	// test against the depth of the previous frame as well
+	bool m_use_depth_pyramid;
+	GpuCuller m_gpu_culler;
+	// fixed commands of the camera view, one per part of every placed asset
+	std::vector<DrawRun> m_gpu_runs;
+	GLuint m_ssbo_gpu_draw_materials;
+
+	// the geometry pass writes only ids and depth, the G-buffer is filled once per pixel from them
+	bool m_visibility_supported;
+	bool m_use_visibility_buffer;
+	// material in the low 16 bits and texture set in the high ones, one per pool triangle
+	GLuint m_ssbo_triangle_materials;
+	GLuint m_fbo_visibility;
+	GLuint m_fbo_visibility_texture;
+
+	// opaque depth first with positions only, the G-buffer pass then tests GL_EQUAL without writing depth
+	bool m_use_depth_prepass;
+	// the cpu culling path through the pass-through geometry shader, off unless comparing
+	bool m_use_geometry_shader;
+	// samples written by the G-buffer pass, read a frame late, and the fragments per pixel measured with and without the prepass
+	GLuint m_overdraw_query;
+	bool m_overdraw_pending;
+	bool m_overdraw_query_prepass;
+	bool m_overdraw_report;
+	float m_overdraw[2];
+
+	// seconds between two checks of the shader files, a changed program is compiled again in the background
+	static constexpr float SHADER_WATCH_INTERVAL = 0.5f;
+	float m_shader_watch_time;
+	std::vector<ShaderProgram*> m_shader_programs;
+	// programs of the reload in flight, swapped together once all of them linked
+	std::vector<ShaderProgram*> m_reload_programs;
+
+	void BuildInstanceBatches(const std::vector<GeometryNode*>& nodes, std::vector<InstanceBatch>& batches);
+	void UploadInstanceData();
+	void BindInstanceAttributes(GLint first_instance, GLuint vao);
+	void BindTextureSet(const TextureSet& set);
+	void RegisterMaterials(GeometryNode& node);
+	void InitGeometryVariants();
+	void SetGeometrySamplers(ShaderProgram& program);
+	ShaderProgram& GetGeometryProgram(GLuint features);
+	// every program in use, reloaded by the R key and by the file watcher
+	void CollectShaderPrograms(std::vector<ShaderProgram*>& programs);
+	// limits of the lights and their clusters for the shaders reading them
+	std::string GetLightDefines() const;
+	void UpdateShaders(float dt);
+	void BeginShaderReload();
+	void EndShaderReload();
+
+	// the shadow map is kept while the light and the casters stay the same
+	enum SHADOW_UPDATE
+	{
+		SHADOW_SKIP = 0,
+		SHADOW_PARTIAL,
+		SHADOW_FULL,
+	};
+
+	// light matrix elements closer than this hash the same, the map is reused for them
+	static constexpr float SHADOW_MATRIX_THRESHOLD = 1e-4f;
+
+	// the fitted projection snaps to steps of 1 / SHADOW_FIT_GRID in light clip space
+	static constexpr float SHADOW_FIT_GRID = 32.f;
+
+	// light matrix the shadow map was rendered with, the lighting reads the map with it too
+	glm::mat4 m_shadow_projection_view;
+	uint64_t m_shadow_light_hash;
+	// bumped whenever a caster moves or disappears
+	unsigned int m_caster_generation;
+	unsigned int m_shadow_caster_generation;
+	bool m_shadow_valid;
+	int m_shadow_update;
+	// old and new world boxes of the casters changed since the last shadow render
+	std::vector<std::pair<glm::vec3, glm::vec3>> m_shadow_dirty_bounds;
+	// x, y, width, height of the texels to render again for a partial update
+	glm::ivec4 m_shadow_scissor;
+	// vertices of the camera and light frusta intersection and of the receivers clipped to it
+	std::vector<glm::vec3> m_shadow_region;
+	std::vector<glm::vec3> m_shadow_fit_points;
+	std::vector<uint32_t> m_shadow_receivers;
+
+	// spot lights placed with the map, their shadows share one atlas
+	struct MapLight
+	{
+		LightNode light;
+		// scales the shadow resolution and how often it refreshes
+		float importance;
+		ShadowAtlas::Tile tile;
+		// tile of a new size, the current one stays in use until this one has its shadow
+		ShadowAtlas::Tile next_tile;
+		// tile size wanted by the last update, kept when only a smaller one was free
+		int requested_size;
+		// frames between refreshes of the shadow while its casters change
+		unsigned int update_interval;
+		unsigned int last_update;
+		// caster generation the tile was rendered with
+		unsigned int caster_generation;
+		// the shadow is up to date, and the tile holds a shadow at all, however old
+		bool shadow_valid;
+		bool shadow_rendered;
+		float priority;
+		// lights all around and casts no shadow
+		bool point;
+	};
+
+	// tiles of the atlas go from SHADOW_TILE_MIN to SHADOW_TILE_MAX texels by screen coverage and importance
+	static constexpr int SHADOW_ATLAS_SIZE = 2048;
+	static constexpr int SHADOW_TILE_MIN = 64;
+	static constexpr int SHADOW_TILE_MAX = 512;
+	// tiles rendered per frame at most, the rest wait for the next frames
+	static constexpr int SHADOW_ATLAS_UPDATES = 4;
+
+	std::vector<MapLight> m_map_lights;
+	ShadowAtlas m_shadow_atlas;
+	// map lights by decreasing priority
+	std::vector<size_t> m_map_light_order;
+	// counts the atlas updates, the refresh intervals are measured in it
+	unsigned int m_shadow_atlas_frame;
+
+	// the deferred pass loops over the lights of its cluster instead of all of them,
+	// slot 0 of a cluster column is its light count and the indices follow
+	bool m_use_light_clusters;
+	GLuint m_light_cluster_texture;
+
 	LightNode									m_light;
 	ShaderProgram								m_geometry_program;
+	ShaderProgram								m_geometry_gs_program;
 	ShaderProgram								m_deferred_program;
 	ShaderProgram								m_post_program;
 	ShaderProgram								m_spot_light_shadow_map_program;
+	ShaderProgram								m_shadow_moments_program;
+	ShaderProgram								m_shadow_blur_program;
+	ShaderProgram								m_geometry_indirect_program;
+	ShaderProgram								m_shadow_indirect_program;
+	ShaderProgram								m_occlusion_box_program;
+	ShaderProgram								m_geometry_gpu_program;
+	ShaderProgram								m_shadow_gpu_program;
+	ShaderProgram								m_visibility_program;
+	ShaderProgram								m_visibility_resolve_program;
+	ShaderProgram								m_light_cluster_program;
+	ShaderProgram								m_depth_prepass_program;
+	ShaderProgram								m_depth_prepass_gpu_program;
 
 	GLuint m_fbo;
 	GLuint m_vao_fbo;
 	GLuint m_vbo_fbo_vertices;
 
+	// attachment 0, lit result in R11G11B10F
 	GLuint m_fbo_texture;
 
+	// the world position is rebuilt from the depth and the inverse view projection
 	GLuint m_fbo_depth_texture;
-	GLuint m_fbo_pos_texture;
+	// attachment 1, RGB10A2: octahedral normal in rg, log encoded gloss in b
 	GLuint m_fbo_normal_texture;
+	// attachment 2, RGBA8: albedo in rgb, metallic in a
 	GLuint m_fbo_albedo_texture;
+	// attachment 3, RGBA8: emission in rgb, reflectance in a
 	GLuint m_fbo_mask_texture;
 
 public:
@@ -124,6 +542,12 @@ public:
 	float										CalculateDistance(glm::vec3 u, glm::vec3);
 	void										Shoot(bool shoot);
 	void										Zoom(bool zoom);
+	void										ToggleGpuCulling();
+	void										ToggleDepthPyramid();
+	void										ToggleShadowFilter();
+	void										ToggleVisibilityBuffer();
+	void										ToggleDepthPrepass();
+	void										ToggleGeometryShader();
 };
 
 #endif
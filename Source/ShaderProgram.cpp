@@ -1,16 +1,32 @@
 #include "ShaderProgram.h"
 #include "Tools.h"
 #include "SDL2\SDL.h"
+#include <fstream>
+#include <direct.h>
+#include <sys/stat.h>
+
+const char* ShaderProgram::BINARY_CACHE_FOLDER = "ShaderCache";
+
+// part of every key, change it when the layout of the cache files changes
+static const uint32_t BINARY_CACHE_VERSION = 1;
 
 ShaderProgram::ShaderProgram()
 {
 	program = 0;
+	pending_program = 0;
 
 	vertexShaderFilename = NULL;
 	fragmentShaderFilename = NULL;
+	geometryShaderFilename = NULL;
+	computeShaderFilename = NULL;
 	vs = 0;
 	fs = 0;
 	gs = 0;
+	cs = 0;
+	for (auto& time : source_times) time = 0;
+
+	slots.resize(32, { 0, -1, NULL });
+	slot_count = 0;
 }
 
 ShaderProgram::~ShaderProgram()
@@ -18,6 +34,8 @@ ShaderProgram::~ShaderProgram()
 	delete[] vertexShaderFilename;
 	delete[] fragmentShaderFilename;
 	delete[] geometryShaderFilename;
+	delete[] computeShaderFilename;
+	DiscardPendingProgram();
 	glDeleteProgram(program);
 }
 
@@ -48,33 +66,124 @@ int ShaderProgram::LoadGeometryShaderFromFile(const char* filename)
 	return 0;
 }
 
+int ShaderProgram::LoadComputeShaderFromFile(const char* filename)
+{
+	// copy compute shader file path
+	char* fname = new char[strlen(filename) + 1];
+	strcpy(fname, filename);
+	computeShaderFilename = fname;
+	return 0;
+}
+
 bool ShaderProgram::CreateProgramShader()
 {
-	glDeleteProgram(program);
-	program = glCreateProgram();
-	// load the VS Shader
-	if ((vs = GenerateShader(vertexShaderFilename, GL_VERTEX_SHADER)) == 0) return false;
-	glAttachShader(program, vs);
-	//glDeleteShader(vs);
+	if (!StartPendingProgram()) return false;
+	if (!CheckPendingProgram())
+	{
+		// the current program stays in use
+		DiscardPendingProgram();
+		return false;
+	}
+	return SwapPendingProgram();
+}
 
-	// load the FS shader
-	if ((fs = GenerateShader(fragmentShaderFilename, GL_FRAGMENT_SHADER)) == 0) return false;
-	glAttachShader(program, fs);
-	//glDeleteShader(fs);
+bool ShaderProgram::StartPendingProgram()
+{
+	// compute, vertex, fragment and geometry, the missing stages stay empty
+	const char* filenames[4] = { computeShaderFilename, vertexShaderFilename, fragmentShaderFilename, geometryShaderFilename };
+	const GLenum types[4] = { GL_COMPUTE_SHADER, GL_VERTEX_SHADER, GL_FRAGMENT_SHADER, GL_GEOMETRY_SHADER };
+	std::string sources[4];
 
-	gs = GenerateShader(geometryShaderFilename, GL_GEOMETRY_SHADER);
-	if (gs) glAttachShader(program, gs);
+	DiscardPendingProgram();
+
+	// taken before reading, an edit made while loading triggers another reload
+	for (int i = 0; i < 4; i++)
+	{
+		source_times[i] = GetFileTime(filenames[i]);
+	}
+
+	if (computeShaderFilename)
+	{
+		if (!LoadShaderSource(computeShaderFilename, sources[0])) return false;
+	}
+	else
+	{
+		if (!LoadShaderSource(vertexShaderFilename, sources[1])) return false;
+		if (!LoadShaderSource(fragmentShaderFilename, sources[2])) return false;
+		if (geometryShaderFilename && !LoadShaderSource(geometryShaderFilename, sources[3])) return false;
+	}
+
+	pending_cache_path = GetBinaryCachePath(sources, 4);
+	pending_program = glCreateProgram();
+
+	if (!pending_cache_path.empty() && LoadProgramBinary(pending_cache_path))
+	{
+		// nothing to store once it links
+		pending_cache_path.clear();
+		return true;
+	}
+
+	// the statuses are not queried here, with parallel compilation the driver works on them in the background
+	GLuint* shaders[4] = { &cs, &vs, &fs, &gs };
+	for (int i = 0; i < 4; i++)
+	{
+		if (sources[i].empty()) continue;
+		*shaders[i] = GenerateShader(sources[i], types[i]);
+		glAttachShader(pending_program, *shaders[i]);
+	}
+
+	if (!pending_cache_path.empty()) glProgramParameteri(pending_program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	glLinkProgram(pending_program);
+	return true;
+}
+
+bool ShaderProgram::CheckPendingProgram()
+{
+	if (!pending_program) return false;
 
 	// link them
 	GLint link_ok = GL_FALSE;
-	GLint validate_ok = GL_FALSE;
-	glLinkProgram(program);
-	glGetProgramiv(program, GL_LINK_STATUS, &link_ok);
+	glGetProgramiv(pending_program, GL_LINK_STATUS, &link_ok);
 	if (!link_ok) {
+		const char* filenames[4] = { computeShaderFilename, vertexShaderFilename, fragmentShaderFilename, geometryShaderFilename };
+		GLuint shaders[4] = { cs, vs, fs, gs };
+		for (int i = 0; i < 4; i++)
+		{
+			GLint compile_ok = GL_TRUE;
+			if (shaders[i]) glGetShaderiv(shaders[i], GL_COMPILE_STATUS, &compile_ok);
+			if (compile_ok == GL_FALSE) {
+				printf("%s:", filenames[i]);
+				PrintLog(shaders[i]);
+			}
+		}
 		printf("glLinkProgram:");
-		PrintLog(program);
+		PrintLog(pending_program);
 		return false;
 	}
+	return true;
+}
+
+bool ShaderProgram::SwapPendingProgram()
+{
+	if (!pending_cache_path.empty()) SaveProgramBinary(pending_program, pending_cache_path);
+
+	glDeleteProgram(program);
+	program = pending_program;
+	pending_program = 0;
+	DiscardPendingProgram();
+
+	for (auto& it : uniforms)
+	{
+		it.second = glGetUniformLocation(program, it.first.c_str());
+	}
+	// the slots stay where they are, only their locations change
+	for (auto& slot : slots)
+	{
+		if (slot.name) slot.location = glGetUniformLocation(program, slot.name);
+	}
+
+	GLint validate_ok = GL_FALSE;
+	ApplyUniformBlockBindings();
 	glValidateProgram(program);
 	glGetProgramiv(program, GL_VALIDATE_STATUS, &validate_ok);
 	if (!validate_ok) {
@@ -85,6 +194,123 @@ bool ShaderProgram::CreateProgramShader()
 	return true;
 }
 
+void ShaderProgram::DiscardPendingProgram()
+{
+	// a linked program keeps its shaders alive, the names can go
+	GLuint* shaders[4] = { &cs, &vs, &fs, &gs };
+	for (int i = 0; i < 4; i++)
+	{
+		glDeleteShader(*shaders[i]);
+		*shaders[i] = 0;
+	}
+	glDeleteProgram(pending_program);
+	pending_program = 0;
+	pending_cache_path.clear();
+}
+
+time_t ShaderProgram::GetFileTime(const char* filename)
+{
+	struct stat info;
+	if (!filename || stat(filename, &info) != 0) return 0;
+	return info.st_mtime;
+}
+
+std::string ShaderProgram::GetBinaryCachePath(const std::string* sources, int count)
+{
+	// checked once, some drivers expose the entry points without any binary format
+	static int supported = -1;
+	static std::string driver;
+	if (supported < 0)
+	{
+		GLint formats = 0;
+		if (GLEW_VERSION_4_1 || GLEW_ARB_get_program_binary) glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+		supported = (formats > 0) ? 1 : 0;
+
+		// a binary is only valid for the driver that produced it
+		driver = std::string(reinterpret_cast<const char*>(glGetString(GL_VENDOR))) + "\n" +
+			reinterpret_cast<const char*>(glGetString(GL_RENDERER)) + "\n" +
+			reinterpret_cast<const char*>(glGetString(GL_VERSION));
+	}
+	if (!supported) return std::string();
+
+	// 64 bit FNV-1a over the driver and every stage, the stages are told apart by their position
+	uint64_t hash = 14695981039346656037ull;
+	auto add = [&](const void* data, size_t size)
+	{
+		const uint8_t* bytes = static_cast<const uint8_t*>(data);
+		for (size_t i = 0; i < size; i++)
+		{
+			hash ^= bytes[i];
+			hash *= 1099511628211ull;
+		}
+	};
+	add(&BINARY_CACHE_VERSION, sizeof(BINARY_CACHE_VERSION));
+	add(driver.data(), driver.size());
+	for (int i = 0; i < count; i++)
+	{
+		uint64_t size = sources[i].size();
+		add(&size, sizeof(size));
+		add(sources[i].data(), sources[i].size());
+	}
+
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.bin", static_cast<unsigned long long>(hash));
+	return std::string(BINARY_CACHE_FOLDER) + "/" + name;
+}
+
+bool ShaderProgram::LoadProgramBinary(const std::string& path)
+{
+	std::ifstream in(path, std::ifstream::ate | std::ifstream::binary);
+	if (!in.is_open()) return false;
+
+	size_t length = static_cast<size_t>(in.tellg());
+	if (length <= sizeof(GLenum)) return false;
+	in.seekg(0, in.beg);
+
+	// the format the driver reported, then its data
+	GLenum format = 0;
+	std::vector<char> binary(length - sizeof(GLenum));
+	in.read(reinterpret_cast<char*>(&format), sizeof(GLenum));
+	in.read(binary.data(), binary.size());
+	if (!in) return false;
+
+	glProgramBinary(pending_program, format, binary.data(), static_cast<GLsizei>(binary.size()));
+
+	// rejected after a driver update, the caller compiles the sources into a new program
+	GLint link_ok = GL_FALSE;
+	glGetProgramiv(pending_program, GL_LINK_STATUS, &link_ok);
+	if (link_ok) return true;
+
+	printf("%s: cached binary rejected, compiling\n", path.c_str());
+	glDeleteProgram(pending_program);
+	pending_program = glCreateProgram();
+	return false;
+}
+
+void ShaderProgram::SaveProgramBinary(GLuint pProgram, const std::string& path)
+{
+	GLint length = 0;
+	glGetProgramiv(pProgram, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0) return;
+
+	GLenum format = 0;
+	std::vector<char> binary(length);
+	glGetProgramBinary(pProgram, length, NULL, &format, binary.data());
+
+	// fails harmlessly when the folder is there
+	_mkdir(BINARY_CACHE_FOLDER);
+
+	std::ofstream out(path, std::ofstream::binary | std::ofstream::trunc);
+	if (!out.is_open()) return;
+	out.write(reinterpret_cast<const char*>(&format), sizeof(GLenum));
+	out.write(binary.data(), binary.size());
+}
+
+void ShaderProgram::SetDefines(const std::string& pDefines)
+{
+	defines = pDefines;
+}
+
 bool ShaderProgram::CreateProgram()
 {
 	// if fail, show text message and redo
@@ -92,20 +318,100 @@ bool ShaderProgram::CreateProgram()
 	return true;
 }
 
-GLenum ShaderProgram::LoadUniform(std::string uniform)
+GLenum ShaderProgram::LoadUniform(const std::string& uniform)
 {
 	uniforms[uniform] = glGetUniformLocation(program, uniform.c_str());
 	return glGetError();
 }
 
+void ShaderProgram::BindUniformBlock(const std::string& block, GLuint binding)
+{
+	for (auto& it : uniform_blocks)
+	{
+		if (it.first == block)
+		{
+			it.second = binding;
+			ApplyUniformBlockBindings();
+			return;
+		}
+	}
+	uniform_blocks.push_back({ block, binding });
+	ApplyUniformBlockBindings();
+}
+
+void ShaderProgram::BindStorageBlock(const std::string& block, GLuint binding)
+{
+	for (auto& it : storage_blocks)
+	{
+		if (it.first == block)
+		{
+			it.second = binding;
+			ApplyUniformBlockBindings();
+			return;
+		}
+	}
+	storage_blocks.push_back({ block, binding });
+	ApplyUniformBlockBindings();
+}
+
+void ShaderProgram::ApplyUniformBlockBindings()
+{
+	if (program == 0) return;
+
+	for (auto& it : uniform_blocks)
+	{
+		// blocks that are not used by the shader are removed by the compiler
+		GLuint index = glGetUniformBlockIndex(program, it.first.c_str());
+		if (index != GL_INVALID_INDEX) glUniformBlockBinding(program, index, it.second);
+	}
+	for (auto& it : storage_blocks)
+	{
+		GLuint index = glGetProgramResourceIndex(program, GL_SHADER_STORAGE_BLOCK, it.first.c_str());
+		if (index != GL_INVALID_INDEX) glShaderStorageBlockBinding(program, index, it.second);
+	}
+}
+
 bool ShaderProgram::ReloadProgram()
 {
-	SDL_assert_release(CreateProgramShader());
-	for (auto& it : uniforms)
+	// on failure the old program is kept
+	return CreateProgramShader();
+}
+
+bool ShaderProgram::BeginReload()
+{
+	return StartPendingProgram();
+}
+
+bool ShaderProgram::IsReloadReady() const
+{
+	// without parallel compilation the status queries of CheckReload wait for the driver
+	if (!pending_program || !GLEW_ARB_parallel_shader_compile) return true;
+
+	GLint complete = GL_FALSE;
+	glGetProgramiv(pending_program, GL_COMPLETION_STATUS_ARB, &complete);
+	return complete == GL_TRUE;
+}
+
+bool ShaderProgram::CheckReload()
+{
+	return CheckPendingProgram();
+}
+
+void ShaderProgram::EndReload(bool swap)
+{
+	// swapped even when it does not validate against the current state
+	if (swap && pending_program) SwapPendingProgram();
+	else DiscardPendingProgram();
+}
+
+bool ShaderProgram::SourcesChanged() const
+{
+	const char* filenames[4] = { computeShaderFilename, vertexShaderFilename, fragmentShaderFilename, geometryShaderFilename };
+	for (int i = 0; i < 4; i++)
 	{
-		it.second = glGetUniformLocation(program, it.first.c_str());
+		if (filenames[i] && GetFileTime(filenames[i]) != source_times[i]) return true;
 	}
-	return true;
+	return false;
 }
 
 void ShaderProgram::Bind()
@@ -142,36 +448,42 @@ void ShaderProgram::PrintLog(GLuint object)
 	delete[] log;
 }
 
-GLuint ShaderProgram::GenerateShader(const char* filename, GLenum shaderType)
+bool ShaderProgram::LoadShaderSource(const char* filename, std::string& source)
 {
-	if (!filename) return 0;
+	if (!filename) return false;
 
-	const char* source = Tools::LoadWholeStringFile(filename);
-	if (source == NULL) {
+	const char* text = Tools::LoadWholeStringFile(filename);
+	if (text == NULL) {
 		printf("Error opening %s: ", filename);
-		delete[] source;
-		return 0;
+		return false;
 	}
+	source = text;
+	delete[] text;
+
+	// the #version line has to stay first
+	if (!defines.empty())
+	{
+		size_t line_end = source.find('\n');
+		source.insert((line_end == std::string::npos) ? source.size() : line_end + 1, defines);
+	}
+	return true;
+}
+
+GLuint ShaderProgram::GenerateShader(const std::string& source, GLenum shaderType)
+{
+	const char* text = source.c_str();
 
 	GLuint res = glCreateShader(shaderType);
 
-	glShaderSource(res, 1, &source, NULL);
-	delete[] source;
+	glShaderSource(res, 1, &text, NULL);
 
+	// the status is read with the link status
 	glCompileShader(res);
-	GLint compile_ok = GL_FALSE;
-	glGetShaderiv(res, GL_COMPILE_STATUS, &compile_ok);
-	if (compile_ok == GL_FALSE) {
-		printf("%s:", filename);
-		PrintLog(res);
-		glDeleteShader(res);
-		return 0;
-	}
 
 	return res;
 }
 
-GLint ShaderProgram::operator[](const std::string key)
+GLint ShaderProgram::operator[](const std::string& key)
 {
 	auto it = uniforms.find(key);
 
@@ -183,7 +495,7 @@ GLint ShaderProgram::operator[](const std::string key)
 	return uniforms[key];
 }
 
-GLint ShaderProgram::GetIndex(const std::string key)
+GLint ShaderProgram::GetIndex(const std::string& key)
 {
 	auto it = uniforms.find(key);
 	return (it != uniforms.end()) ? it->second : -1;
@@ -208,4 +520,77 @@ void ShaderProgram::loadMat4(const std::string& pKey, const glm::mat4& pValue)
 {
 	glUniformMatrix4fv((*this)[pKey], 1, GL_FALSE,
 		glm::value_ptr(pValue));
+}
+
+ShaderProgram::UniformSlot& ShaderProgram::Slot(const UniformName& pKey)
+{
+	size_t mask = slots.size() - 1;
+	size_t i = pKey.hash & mask;
+
+	while (slots[i].name)
+	{
+		// two names may share a hash, the strings tell them apart
+		if (slots[i].hash == pKey.hash && (slots[i].name == pKey.name || strcmp(slots[i].name, pKey.name) == 0)) return slots[i];
+		i = (i + 1) & mask;
+	}
+
+	// keep the table at most half full so probing stays short
+	if ((slot_count + 1) * 2 > slots.size())
+	{
+		GrowSlots();
+		return Slot(pKey);
+	}
+
+	slots[i].hash = pKey.hash;
+	slots[i].name = pKey.name;
+	slots[i].location = glGetUniformLocation(program, pKey.name);
+	slot_count++;
+	return slots[i];
+}
+
+void ShaderProgram::GrowSlots()
+{
+	std::vector<UniformSlot> old;
+	old.swap(slots);
+	slots.resize(old.size() * 2, { 0, -1, NULL });
+
+	size_t mask = slots.size() - 1;
+	for (auto& slot : old)
+	{
+		if (!slot.name) continue;
+		size_t i = slot.hash & mask;
+		while (slots[i].name) i = (i + 1) & mask;
+		slots[i] = slot;
+	}
+}
+
+GLint ShaderProgram::Location(const UniformName& pKey)
+{
+	return Slot(pKey).location;
+}
+
+void ShaderProgram::loadVec2(const UniformName& pKey, const glm::vec2& pValue)
+{
+	glUniform2f(Slot(pKey).location, pValue.x, pValue.y);
+}
+
+void ShaderProgram::loadVec3(const UniformName& pKey, const glm::vec3& pValue)
+{
+	glUniform3f(Slot(pKey).location, pValue.x, pValue.y, pValue.z);
+}
+
+void ShaderProgram::loadFloat(const UniformName& pKey, const float pValue)
+{
+	glUniform1f(Slot(pKey).location, pValue);
+}
+
+void ShaderProgram::loadInt(const UniformName& pKey, const int pValue)
+{
+	glUniform1i(Slot(pKey).location, pValue);
+}
+
+void ShaderProgram::loadMat4(const UniformName& pKey, const glm::mat4& pValue)
+{
+	glUniformMatrix4fv(Slot(pKey).location, 1, GL_FALSE,
+		glm::value_ptr(pValue));
 }
\ No newline at end of file
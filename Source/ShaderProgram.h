@@ -4,23 +4,74 @@
 #include <string>
 #include <vector>
 #include <unordered_map>
+#include <cstdint>
+#include <ctime>
 #include "GLEW\glew.h"
 #include "glm/gtc/type_ptr.hpp"
 
+// Name of a uniform hashed at compile time (FNV-1a), declare them constexpr
+// so the hot path never builds a std::string or hashes a string at runtime
+struct UniformName
+{
+	uint32_t hash;
+	const char* name;
+
+	explicit constexpr UniformName(const char* str) : hash(Hash(str)), name(str) {}
+
+	static constexpr uint32_t Hash(const char* str)
+	{
+		uint32_t hash = 2166136261u;
+		while (*str)
+		{
+			hash ^= static_cast<uint8_t>(*str++);
+			hash *= 16777619u;
+		}
+		return hash;
+	}
+};
+
 class ShaderProgram
 {
 	// filepaths of the shaders
 	const char* vertexShaderFilename;
 	const char* fragmentShaderFilename;
 	const char* geometryShaderFilename;
+	const char* computeShaderFilename;
 
-	// program and shaders
+	// program and the shaders of the program being linked
 	GLuint program;
-	GLuint vs, fs, gs;
+	GLuint vs, fs, gs, cs;
+
+	// program being compiled, it replaces the current one only once it links
+	GLuint pending_program;
+	std::string pending_cache_path;
+	// modification times of the compute, vertex, fragment and geometry sources when they were read
+	time_t source_times[4];
 
 	// hash map with uniform indices
 	std::unordered_map<std::string, GLint> uniforms;
 
+	// open addressing table of uniform slots keyed by the name hash,
+	// the locations are resolved on first use and again after every link
+	struct UniformSlot
+	{
+		uint32_t hash;
+		GLint location;
+		const char* name;
+	};
+	std::vector<UniformSlot> slots;
+	size_t slot_count;
+
+	// uniform and storage blocks and the buffer binding points they are attached to
+	std::vector<std::pair<std::string, GLuint>> uniform_blocks;
+	std::vector<std::pair<std::string, GLuint>> storage_blocks;
+
+	// lines inserted after the #version of every stage, one program per permutation
+	std::string defines;
+
+	// linked programs are kept on disk, keyed by their sources and the driver, and loaded instead of compiled
+	static const char* BINARY_CACHE_FOLDER;
+
 public:
 	ShaderProgram();
 	~ShaderProgram();
@@ -29,35 +80,86 @@ public:
 	int LoadVertexShaderFromFile(const char* filename);
 	int LoadFragmentShaderFromFile(const char* filename);
 	int LoadGeometryShaderFromFile(const char* filename);
+	// A compute program has no other stage
+	int LoadComputeShaderFromFile(const char* filename);
+
+	// #define lines compiled into every stage, set before CreateProgram
+	void SetDefines(const std::string& pDefines);
 
 	// Create the program using the provided vertex and fragment shader
 	bool CreateProgram();
 
-	// Delete and reload shaders
+	// Delete and reload shaders, waits for the driver and keeps the old program on failure
 	bool ReloadProgram();
 
+	// Start compiling the shaders again without waiting, the old program stays in use.
+	// Programs reloaded together are swapped together: wait until all are ready,
+	// check them all, then end all of them with the same answer
+	bool BeginReload();
+	// true once the driver is done with the program started by BeginReload
+	bool IsReloadReady() const;
+	// true when the new program linked, its logs are printed otherwise
+	bool CheckReload();
+	// swap in the new program, or drop it and keep the old one
+	void EndReload(bool swap);
+	// true when a source file was written since it was read
+	bool SourcesChanged() const;
+
+	// string keyed setters, meant for debugging
 	void loadVec3(const std::string& pKey, const glm::vec3& pValue);
 	void loadInt(const std::string& pKey, const int pValue);
 	void loadMat4(const std::string& pKey, const glm::mat4& pValue);
 	void loadFloat(const std::string& pKey, const float pValue);
 
+	// hashed name setters used while rendering
+	void loadVec2(const UniformName& pKey, const glm::vec2& pValue);
+	void loadVec3(const UniformName& pKey, const glm::vec3& pValue);
+	void loadInt(const UniformName& pKey, const int pValue);
+	void loadMat4(const UniformName& pKey, const glm::mat4& pValue);
+	void loadFloat(const UniformName& pKey, const float pValue);
+
+	// location of a hashed uniform, -1 if the program does not use it
+	GLint Location(const UniformName& pKey);
+
 	// Bind the program to use
 	void Bind();
 	// Unbind the program
 	void Unbind();
 	// Load the index of the uniform
-	GLenum LoadUniform(const std::string uniform);
+	GLenum LoadUniform(const std::string& uniform);
+	// Attach a uniform block to a binding point, kept across reloads
+	void BindUniformBlock(const std::string& block, GLuint binding);
+	// Same for a shader storage block, needs GL 4.3
+	void BindStorageBlock(const std::string& block, GLuint binding);
 
 	// Access the index of the uniform
-	GLint operator[](const std::string key);
-	GLint GetIndex(const std::string key);
+	GLint operator[](const std::string& key);
+	GLint GetIndex(const std::string& key);
 
 private:
 	// Create the shader
 	bool CreateProgramShader();
+	// compile and link into the pending program, then check it and swap it in
+	bool StartPendingProgram();
+	bool CheckPendingProgram();
+	bool SwapPendingProgram();
+	void DiscardPendingProgram();
+	static time_t GetFileTime(const char* filename);
+	// Reapply the uniform and storage block bindings after linking
+	void ApplyUniformBlockBindings();
+	// Find or add the slot of a hashed uniform
+	UniformSlot& Slot(const UniformName& pKey);
+	void GrowSlots();
+
+	// Load the shader from the disk, with the defines
+	bool LoadShaderSource(const char* filename, std::string& source);
+	// Compile the loaded source, the status is checked after linking
+	GLuint GenerateShader(const std::string& source, GLenum shaderType);
 
-	// Load the shader from the disk
-	GLuint GenerateShader(const char* filename, GLenum shaderType);
+	// path of the cached binary of these sources, empty when the driver cannot store programs
+	std::string GetBinaryCachePath(const std::string* sources, int count);
+	bool LoadProgramBinary(const std::string& path);
+	void SaveProgramBinary(GLuint pProgram, const std::string& path);
 	// print the log when something goes wrong
 	void PrintLog(GLuint object);
 };
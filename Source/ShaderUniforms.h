@@ -0,0 +1,60 @@
+#ifndef SHADER_UNIFORMS_H
+#define SHADER_UNIFORMS_H
+
+#include "ShaderProgram.h"
+
+// Uniforms set by the renderer, hashed at compile time
+namespace Uniforms
+{
+	constexpr UniformName prim_id("uniform_prim_id");
+	constexpr UniformName draw_offset("uniform_draw_offset");
+
+	constexpr UniformName tex_diffuse("uniform_tex_diffuse");
+	constexpr UniformName tex_mask("uniform_tex_mask");
+	constexpr UniformName tex_normal("uniform_tex_normal");
+	constexpr UniformName tex_emissive("uniform_tex_emissive");
+
+	constexpr UniformName tex_albedo("uniform_tex_albedo");
+	constexpr UniformName tex_depth("uniform_tex_depth");
+	constexpr UniformName inverse_view_projection("uniform_inverse_view_projection");
+	constexpr UniformName shadow_map("uniform_shadow_map");
+	constexpr UniformName shadow_moments("uniform_shadow_moments");
+	constexpr UniformName shadow_atlas("uniform_shadow_atlas");
+	constexpr UniformName shadow_filter("uniform_shadow_filter");
+	constexpr UniformName shadow_exponent("uniform_shadow_exponent");
+	constexpr UniformName light_near("uniform_light_near");
+	constexpr UniformName light_far("uniform_light_far");
+	constexpr UniformName light_clusters("uniform_light_clusters");
+	constexpr UniformName light_clusters_texture("uniform_light_clusters_texture");
+	constexpr UniformName cluster_depth("uniform_cluster_depth");
+	constexpr UniformName screen_size("uniform_screen_size");
+	constexpr UniformName light_pass("uniform_light_pass");
+	constexpr UniformName light_volume("uniform_light_volume");
+
+	constexpr UniformName box_center("uniform_box_center");
+	constexpr UniformName box_extent("uniform_box_extent");
+
+	constexpr UniformName planes("uniform_planes");
+	constexpr UniformName item_count("uniform_item_count");
+	constexpr UniformName node_count("uniform_node_count");
+	constexpr UniformName required_flags("uniform_required_flags");
+	constexpr UniformName cone("uniform_cone");
+	constexpr UniformName cone_apex("uniform_cone_apex");
+	constexpr UniformName cone_direction("uniform_cone_direction");
+	constexpr UniformName cone_angle("uniform_cone_angle");
+	constexpr UniformName cone_range("uniform_cone_range");
+	constexpr UniformName occlusion("uniform_occlusion");
+	constexpr UniformName depth_pyramid("uniform_depth_pyramid");
+	constexpr UniformName pyramid_view_projection("uniform_pyramid_view_projection");
+	constexpr UniformName command_count("uniform_command_count");
+	constexpr UniformName source("uniform_source");
+	constexpr UniformName source_level("uniform_source_level");
+	constexpr UniformName visibility("uniform_visibility");
+	constexpr UniformName texture_set("uniform_texture_set");
+
+	constexpr UniformName texture("uniform_texture");
+	constexpr UniformName shoot_flag("shoot_flag");
+	constexpr UniformName hit_flag("hit_flag");
+};
+
+#endif
@@ -0,0 +1,147 @@
+#include "ShadowAtlas.h"
+#include "Tools.h"
+#include <algorithm>
+#include <cstdio>
+
+ShadowAtlas::ShadowAtlas()
+{
+	m_texture = 0;
+	m_fbo = 0;
+	m_size = 0;
+	m_min_tile = 0;
+}
+
+ShadowAtlas::~ShadowAtlas()
+{
+	glDeleteFramebuffers(1, &m_fbo);
+	glDeleteTextures(1, &m_texture);
+}
+
+bool ShadowAtlas::Init(int size, int min_tile)
+{
+	m_size = size;
+	m_min_tile = min_tile;
+
+	m_free.assign(GetLevel(min_tile) + 1, std::vector<glm::ivec2>());
+	m_free[0].push_back(glm::ivec2(0));
+
+	glGenTextures(1, &m_texture);
+	glBindTexture(GL_TEXTURE_2D, m_texture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, m_size, m_size, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	glGenFramebuffers(1, &m_fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, m_fbo);
+	glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, m_texture, 0);
+	glDrawBuffer(GL_NONE);
+	glReadBuffer(GL_NONE);
+
+	GLenum status = Tools::CheckFramebufferStatus(m_fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	if (status != GL_FRAMEBUFFER_COMPLETE)
+	{
+		printf("Error in shadow atlas FB generation.\n");
+		return false;
+	}
+
+	return true;
+}
+
+int ShadowAtlas::GetLevel(int size) const
+{
+	int level = 0;
+	while ((m_size >> level) > size) level++;
+	return level;
+}
+
+bool ShadowAtlas::Take(int level, glm::ivec2& origin)
+{
+	if (!m_free[level].empty())
+	{
+		origin = m_free[level].back();
+		m_free[level].pop_back();
+		return true;
+	}
+
+	// split a tile of the level above, the first quarter is returned and the rest kept
+	glm::ivec2 parent;
+	if (level == 0 || !Take(level - 1, parent)) return false;
+
+	int half = m_size >> level;
+	m_free[level].push_back(parent + glm::ivec2(half, 0));
+	m_free[level].push_back(parent + glm::ivec2(0, half));
+	m_free[level].push_back(parent + glm::ivec2(half, half));
+	origin = parent;
+	return true;
+}
+
+void ShadowAtlas::Release(int level, const glm::ivec2& origin)
+{
+	if (level > 0)
+	{
+		int size = m_size >> level;
+		glm::ivec2 parent = (origin / (2 * size)) * (2 * size);
+
+		// merge when the other three quarters of the parent are free
+		auto& free = m_free[level];
+		int siblings = 0;
+		for (auto& tile : free)
+		{
+			if (tile != origin && tile / (2 * size) * (2 * size) == parent) siblings++;
+		}
+		if (siblings == 3)
+		{
+			free.erase(std::remove_if(free.begin(), free.end(),
+				[&](const glm::ivec2& tile) { return tile / (2 * size) * (2 * size) == parent; }), free.end());
+			Release(level - 1, parent);
+			return;
+		}
+	}
+
+	m_free[level].push_back(origin);
+}
+
+bool ShadowAtlas::Allocate(int size, Tile& tile)
+{
+	glm::ivec2 origin;
+	if (size < m_min_tile || size > m_size || !Take(GetLevel(size), origin))
+	{
+		tile = { 0, 0, 0 };
+		return false;
+	}
+
+	tile = { origin.x, origin.y, size };
+	return true;
+}
+
+void ShadowAtlas::Free(Tile& tile)
+{
+	if (tile.size == 0) return;
+	Release(GetLevel(tile.size), glm::ivec2(tile.x, tile.y));
+	tile = { 0, 0, 0 };
+}
+
+GLuint ShadowAtlas::GetTexture() const
+{
+	return m_texture;
+}
+
+GLuint ShadowAtlas::GetFBO() const
+{
+	return m_fbo;
+}
+
+int ShadowAtlas::GetSize() const
+{
+	return m_size;
+}
+
+glm::vec4 ShadowAtlas::GetTileRect(const Tile& tile) const
+{
+	float scale = 1.f / m_size;
+	return glm::vec4(tile.x * scale, tile.y * scale, tile.size * scale, tile.size * scale);
+}
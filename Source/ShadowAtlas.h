@@ -0,0 +1,52 @@
+#ifndef SHADOW_ATLAS_H
+#define SHADOW_ATLAS_H
+
+#include <vector>
+#include "GLEW\glew.h"
+#include "glm\glm.hpp"
+
+// One depth texture shared by the shadows of many spot lights. Tiles are squares
+// with power of two sides handed out like a quadtree: a free tile of the asked size
+// is taken, or a larger one is split in four, and a freed tile merges back into
+// its parent once its three siblings are free too.
+class ShadowAtlas
+{
+public:
+	// texels of the atlas a light renders into, a size of 0 means none
+	struct Tile
+	{
+		int x;
+		int y;
+		int size;
+	};
+
+private:
+	GLuint m_texture;
+	GLuint m_fbo;
+	int m_size;
+	int m_min_tile;
+	// origins of the free tiles of every level, level 0 is the whole atlas
+	std::vector<std::vector<glm::ivec2>> m_free;
+
+	int GetLevel(int size) const;
+	bool Take(int level, glm::ivec2& origin);
+	void Release(int level, const glm::ivec2& origin);
+
+public:
+	ShadowAtlas();
+	~ShadowAtlas();
+
+	bool Init(int size, int min_tile);
+
+	// false when no tile of that size is left, size is a power of two between the smallest tile and the atlas
+	bool Allocate(int size, Tile& tile);
+	void Free(Tile& tile);
+
+	GLuint GetTexture() const;
+	GLuint GetFBO() const;
+	int GetSize() const;
+	// offset and scale of the tile in texture coordinates
+	glm::vec4 GetTileRect(const Tile& tile) const;
+};
+
+#endif
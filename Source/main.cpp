@@ -3,7 +3,9 @@
 #include <chrono>
 #include "GLEW\glew.h"
 #include "Renderer.h"
+#include "FrustumCuller.h"
 #include <thread>         // std::this_thread::sleep_for
+#include <cstring>
 
 #define FPS_INTERVAL 1.0 // seconds.
 
@@ -119,6 +121,12 @@ void keyboardInput(bool &quit)
 			renderer->CameraMoveRight(true);
 		}
 		else if (event.key.keysym.sym == SDLK_r) renderer->ReloadShaders();
+		else if (event.key.keysym.sym == SDLK_g) renderer->ToggleGpuCulling();
+		else if (event.key.keysym.sym == SDLK_h) renderer->ToggleDepthPyramid();
+		else if (event.key.keysym.sym == SDLK_v) renderer->ToggleShadowFilter();
+		else if (event.key.keysym.sym == SDLK_b) renderer->ToggleVisibilityBuffer();
+		else if (event.key.keysym.sym == SDLK_p) renderer->ToggleDepthPrepass();
+		else if (event.key.keysym.sym == SDLK_n) renderer->ToggleGeometryShader();
 	}
 	else if (event.type == SDL_KEYUP)
 	{
@@ -194,6 +202,13 @@ void showFPS()
 
 int main(int argc, char* argv[])
 {
+	// run the culling micro-benchmark without opening a window
+	if (argc > 1 && strcmp(argv[1], "--benchmark-culling") == 0)
+	{
+		FrustumCuller::Benchmark(argc > 2 ? static_cast<size_t>(atoi(argv[2])) : 16384);
+		return EXIT_SUCCESS;
+	}
+
 	//Initialize SDL, glew, engine
 	if (init() == false)
 	{